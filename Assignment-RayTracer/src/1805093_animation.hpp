@@ -0,0 +1,402 @@
+#include <cstdio>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+using namespace std;
+
+// camera state at one point in time of an animation
+class Keyframe
+{
+public:
+    double time; // seconds
+    Point position, look, up;
+};
+
+// camera path read from a keyframe file, see animation.txt for the format
+class CameraPath
+{
+public:
+    int framesPerSecond;
+    vector<Keyframe> keyframes;
+
+    boolean load(string fileName);
+    int frameCount();
+    void apply(int frame); // moves pos, look, r8 and up to the given frame
+};
+
+boolean CameraPath::load(string fileName)
+{
+    ifstream input(fileName);
+    if (!input)
+    {
+        cout << "animation: could not open " << fileName << endl;
+        return false;
+    }
+
+    int noOfKeyframes;
+    input >> framesPerSecond >> noOfKeyframes;
+
+    keyframes.clear();
+    for (int i = 0; i < noOfKeyframes; i++)
+    {
+        Keyframe keyframe;
+        input >> keyframe.time;
+        input >> keyframe.position.x >> keyframe.position.y >> keyframe.position.z;
+        input >> keyframe.look.x >> keyframe.look.y >> keyframe.look.z;
+        input >> keyframe.up.x >> keyframe.up.y >> keyframe.up.z;
+        keyframe.look.normalize();
+        keyframe.up.normalize();
+        keyframes.push_back(keyframe);
+    }
+    boolean valid = !input.fail() && keyframes.size() > 0 && framesPerSecond > 0;
+    input.close();
+
+    if (!valid)
+    {
+        cout << "animation: " << fileName << " is not a valid keyframe file" << endl;
+        return false;
+    }
+    return true;
+}
+
+int CameraPath::frameCount()
+{
+    return (int)floor((keyframes.back().time - keyframes.front().time) * framesPerSecond) + 1;
+}
+
+Point lerpPoint(Point &a, Point &b, double s)
+{
+    return Point(a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s);
+}
+
+void CameraPath::apply(int frame)
+{
+    double time = keyframes.front().time + (double)frame / framesPerSecond;
+
+    int k = 0;
+    while (k + 2 < keyframes.size() && keyframes[k + 1].time <= time)
+        k++;
+
+    Keyframe &from = keyframes[k];
+    Keyframe &to = keyframes[min(k + 1, (int)keyframes.size() - 1)];
+    double s = to.time > from.time ? (time - from.time) / (to.time - from.time) : 0;
+    s = max(0.0, min(1.0, s));
+
+    *pos = lerpPoint(from.position, to.position, s);
+    *look = lerpPoint(from.look, to.look, s);
+    look->normalize();
+    Point upHint = lerpPoint(from.up, to.up, s);
+
+    // same orthonormal basis as display()
+    Point *right = look->cross(&upHint);
+    right->normalize();
+    Point *trueUp = right->cross(look);
+    trueUp->normalize();
+    *r8 = *right;
+    *up = *trueUp;
+    delete right;
+    delete trueUp;
+}
+
+// writes frames as a YUV4MPEG2 (4:4:4) stream, to a file or to the stdin of an encoder
+class Y4mWriter
+{
+    FILE *file;
+    boolean isPipe;
+    int width, height;
+    vector<unsigned char> planes;
+
+public:
+    Y4mWriter();
+    ~Y4mWriter();
+    boolean open(string target, boolean pipe, int width, int height, int framesPerSecond);
+    void writeFrame(vector<unsigned char> &pixels);
+    void close();
+};
+
+Y4mWriter::Y4mWriter()
+{
+    file = NULL;
+    isPipe = false;
+    width = height = 0;
+}
+
+Y4mWriter::~Y4mWriter()
+{
+    close();
+}
+
+boolean Y4mWriter::open(string target, boolean pipe, int width, int height, int framesPerSecond)
+{
+    this->width = width;
+    this->height = height;
+    isPipe = pipe;
+    file = pipe ? popen(target.c_str(), "w") : fopen(target.c_str(), "wb");
+    if (file == NULL)
+    {
+        cout << "animation: could not open " << target << endl;
+        return false;
+    }
+
+    fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, framesPerSecond);
+    planes.resize(width * height * 3);
+    return true;
+}
+
+// BT.601 studio range, which is what encoders assume for y4m input
+void Y4mWriter::writeFrame(vector<unsigned char> &pixels)
+{
+    int count = width * height;
+    unsigned char *Y = &planes[0], *Cb = &planes[count], *Cr = &planes[2 * count];
+    rgbToYCbCr(pixels.data(), Y, Cb, Cr, count);
+
+    fputs("FRAME\n", file);
+    fwrite(planes.data(), 1, planes.size(), file);
+}
+
+void Y4mWriter::close()
+{
+    if (file == NULL)
+        return;
+
+    if (isPipe)
+        pclose(file);
+    else
+        fclose(file);
+    file = NULL;
+}
+
+// shaded pixels of the previous frame, reused when the same surface point is
+// visible again (reverse reprojection), see renderReprojected()
+class TemporalCache
+{
+public:
+    static const int REFRESH_PERIOD = 8; // a reused pixel is shaded again after this many frames
+
+    boolean valid;
+    RenderView view;
+    int sceneVersion; // of the scene the pixels were shaded in
+    vector<GBufferEntry> entries;
+    vector<unsigned char> pixels;
+    vector<int> ages; // frames since the pixel was last shaded
+
+    long long reusedPixels, shadedPixels;
+
+    TemporalCache();
+    boolean project(Point &point, int &i, int &j); // pixel of the previous view that sees the point
+    boolean isFlat(int i, int j);                  // no color edge around the pixel
+};
+
+TemporalCache::TemporalCache()
+{
+    valid = false;
+    sceneVersion = -1;
+    reusedPixels = shadedPixels = 0;
+}
+
+boolean TemporalCache::project(Point &point, int &i, int &j)
+{
+    // intersect the line eye -> point with the plane of the pixel centers
+    Point normal(view.right.y * view.down.z - view.right.z * view.down.y,
+                 view.right.z * view.down.x - view.right.x * view.down.z,
+                 view.right.x * view.down.y - view.right.y * view.down.x);
+    Point toPoint(point.x - view.eye.x, point.y - view.eye.y, point.z - view.eye.z);
+    Point toPlane(view.topLeft.x - view.eye.x, view.topLeft.y - view.eye.y, view.topLeft.z - view.eye.z);
+
+    double along = toPoint.dot(&normal);
+    double s = toPlane.dot(&normal) / along;
+    if (along == 0 || s <= 0)
+        return false;
+
+    Point onPlane(view.eye.x + toPoint.x * s - view.topLeft.x,
+                  view.eye.y + toPoint.y * s - view.topLeft.y,
+                  view.eye.z + toPoint.z * s - view.topLeft.z);
+    j = (int)lround(onPlane.dot(&view.right) / view.right.dot(&view.right));
+    i = (int)lround(onPlane.dot(&view.down) / view.down.dot(&view.down));
+    return i >= 0 && i < view.height && j >= 0 && j < view.width;
+}
+
+// the reprojected point lands up to half a pixel away from the old sample, which is
+// only harmless where the old image has no edge (tile borders, shadow and reflection edges)
+boolean TemporalCache::isFlat(int i, int j)
+{
+    static const int MAX_DIFFERENCE = 6;
+    static const int di[] = {-1, 1, 0, 0}, dj[] = {0, 0, -1, 1};
+
+    unsigned char *pixel = &pixels[(i * view.width + j) * 3];
+    for (int k = 0; k < 4; k++)
+    {
+        int ni = min(max(i + di[k], 0), view.height - 1);
+        int nj = min(max(j + dj[k], 0), view.width - 1);
+        unsigned char *neighbour = &pixels[(ni * view.width + nj) * 3];
+        for (int c = 0; c < 3; c++)
+            if (abs(pixel[c] - neighbour[c]) > MAX_DIFFERENCE)
+                return false;
+    }
+    return true;
+}
+
+TemporalCache temporalCache;
+
+// renders a frame of a camera path, copying the color of every pixel whose primary hit
+// was already shaded in the previous frame; disoccluded pixels, pixels that landed on
+// another surface and pixels older than REFRESH_PERIOD frames are shaded again
+void renderReprojected(RenderView &view, vector<unsigned char> &pixels)
+{
+    PROFILE_SCOPE("render reprojected");
+    STATS_FRAME_BEGIN(view.width * view.height);
+
+    if (!gBuffer.matches(view))
+        gBuffer.fill(view);
+
+    TemporalCache &cache = temporalCache;
+    boolean reuse = cache.valid && cache.view.width == view.width && cache.view.height == view.height &&
+                    cache.sceneVersion == sceneVersion;
+
+    int count = view.width * view.height;
+    pixels.resize(count * 3);
+    vector<int> ages(count);
+
+    // a sample may move by about a pixel on the surface between the two views
+    double pixelSize = sqrt(view.right.dot(&view.right));
+    double nearDistance = sqrt(pow(view.topLeft.x - view.eye.x, 2) + pow(view.topLeft.y - view.eye.y, 2) + pow(view.topLeft.z - view.eye.z, 2));
+
+    for (int i = 0; i < view.height; i++)
+    {
+        PROFILE_SCOPE("shade");
+        ArenaScope arenaScope;
+        for (int j = 0; j < view.width; j++)
+        {
+            int index = i * view.width + j;
+            GBufferEntry &entry = gBuffer.entries[index];
+            unsigned char *pixel = &pixels[index * 3];
+
+            int oldI, oldJ;
+            if (reuse && entry.objectId >= 0 && cache.project(entry.hitPoint, oldI, oldJ))
+            {
+                int oldIndex = oldI * view.width + oldJ;
+                GBufferEntry &old = cache.entries[oldIndex];
+                double tolerance = 2 * pixelSize * entry.t / nearDistance;
+
+                if (old.objectId == entry.objectId && cache.ages[oldIndex] + 1 < TemporalCache::REFRESH_PERIOD &&
+                    fabs(old.hitPoint.x - entry.hitPoint.x) < tolerance &&
+                    fabs(old.hitPoint.y - entry.hitPoint.y) < tolerance &&
+                    fabs(old.hitPoint.z - entry.hitPoint.z) < tolerance &&
+                    old.normal.dot(&entry.normal) > 0.99 && cache.isFlat(oldI, oldJ))
+                {
+                    memcpy(pixel, &cache.pixels[oldIndex * 3], 3);
+                    ages[index] = cache.ages[oldIndex] + 1;
+                    cache.reusedPixels++;
+                    continue;
+                }
+            }
+
+            shadePixel(view, i, j, entry, pixel);
+            // stagger the first frame so that the refreshes are spread over the following ones
+            ages[index] = reuse ? 0 : index % TemporalCache::REFRESH_PERIOD;
+            cache.shadedPixels++;
+        }
+    }
+
+    cache.valid = true;
+    cache.view = view;
+    cache.sceneVersion = sceneVersion;
+    cache.entries = gBuffer.entries;
+    cache.pixels = pixels;
+    cache.ages.swap(ages);
+}
+
+bitmap_image toBitmap(vector<unsigned char> &pixels, int width, int height)
+{
+    bitmap_image image(width, height);
+    for (int i = 0; i < height; i++)
+        pixel_kernels().swap_outer(&pixels[i * width * 3], image.row(i), width);
+    return image;
+}
+
+// renders every frame of the path back to back without opening a window,
+// the scene and the mesh BVHs are loaded once and reused for all frames
+// with reproject the shading is reused across frames, compare also renders every frame
+// from scratch and reports the speedup and the PSNR of the reprojected frame against it
+void renderAnimation(string pathFile, string target, boolean pipe, boolean reproject, boolean compare)
+{
+    CameraPath path;
+    if (!path.load(pathFile))
+        return;
+
+    Y4mWriter writer;
+    if (!writer.open(target, pipe, imageWidth, imageHeight, path.framesPerSecond))
+        return;
+
+    int frames = path.frameCount();
+    vector<unsigned char> pixels, fullPixels;
+    double totalSeconds = 0, totalFullSeconds = 0, totalPsnr = 0, worstPsnr = 1000000.0;
+    int differentFrames = 0;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        path.apply(frame);
+        RenderView view = captureView(imageWidth, imageHeight);
+
+        double fullSeconds = 0;
+        if (compare)
+        {
+            auto fullBegin = chrono::steady_clock::now();
+            renderFrame(view, fullPixels, false);
+            fullSeconds = chrono::duration<double>(chrono::steady_clock::now() - fullBegin).count();
+            totalFullSeconds += fullSeconds;
+        }
+
+        auto frameBegin = chrono::steady_clock::now();
+        boolean primaryDone = gBuffer.matches(view);
+        if (reproject)
+            renderReprojected(view, pixels);
+        else
+            renderFrame(view, pixels, false);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - frameBegin).count();
+        if (primaryDone) // the full render already traced the primary rays for us
+            seconds += gBuffer.traceSeconds;
+        totalSeconds += seconds;
+
+        writer.writeFrame(pixels);
+
+        cout << "frame " << frame + 1 << "/" << frames << " rendered in " << seconds << "s";
+        if (compare)
+        {
+            bitmap_image image = toBitmap(pixels, imageWidth, imageHeight);
+            bitmap_image fullImage = toBitmap(fullPixels, imageWidth, imageHeight);
+            double psnr = fullImage.psnr(image);
+            worstPsnr = min(worstPsnr, psnr);
+            if (psnr < 1000000.0) // identical frames are reported as 1000000dB
+                totalPsnr += psnr, differentFrames++;
+            cout << ", full render " << fullSeconds << "s, speedup " << fullSeconds / seconds << "x, psnr " << psnr << "dB";
+        }
+        cout << endl;
+    }
+
+    writer.close();
+
+    cout << "animation: " << frames << " frames in " << totalSeconds << "s (" << frames / totalSeconds << " fps)" << endl;
+    if (reproject)
+    {
+        long long total = temporalCache.reusedPixels + temporalCache.shadedPixels;
+        cout << "reprojection: " << temporalCache.reusedPixels << " of " << total << " pixels reused ("
+             << fixed << setprecision(1) << 100.0 * temporalCache.reusedPixels / total << "%)" << endl;
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6);
+    }
+    if (compare)
+    {
+        cout << "full renders: " << totalFullSeconds << "s, speedup " << totalFullSeconds / totalSeconds << "x, psnr average ";
+        if (differentFrames > 0)
+            cout << totalPsnr / differentFrames << "dB over the " << differentFrames << " frames that differ, worst " << worstPsnr << "dB" << endl;
+        else
+            cout << "identical to the full renders" << endl;
+    }
+    // counters of the whole path, pixel times of the last frame
+    STATS_REPORT("images/heat-animation.bmp");
+    writeTrace("trace.json");
+}
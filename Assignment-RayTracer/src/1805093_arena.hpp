@@ -0,0 +1,133 @@
+// per thread bump allocator for the Point, Color and Ray temporaries of the trace path
+// inside an ArenaScope `new` takes the next bytes of the thread's arena and `delete` does
+// nothing, everything is released at once when the outermost scope ends (a band of rows)
+// outside a scope, e.g. for the scene itself, the normal heap is used
+
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <fstream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+class Arena
+{
+public:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    int depth; // open scopes on this thread
+    size_t peakBytes;
+
+    Arena() : depth(0), peakBytes(0), current(0), used(0), lowest(0), highest(0) {}
+    ~Arena()
+    {
+        for (char *block : blocks)
+            free(block);
+    }
+
+    void *allocate(size_t size)
+    {
+        size = (size + 15) & ~(size_t)15;
+        if (blocks.empty() || used + size > BLOCK_SIZE)
+            nextBlock();
+
+        void *memory = blocks[current] + used;
+        used += size;
+        return memory;
+    }
+
+    // heap memory outside the span of the blocks is turned down at once, and a temporary
+    // is nearly always in the block being filled; only the rest is searched
+    boolean owns(void *memory)
+    {
+        uintptr_t address = (uintptr_t)memory;
+        if (address < lowest || address >= highest)
+            return false;
+        if (address - (uintptr_t)blocks[current] < BLOCK_SIZE)
+            return true;
+        for (char *block : blocks)
+            if (address - (uintptr_t)block < BLOCK_SIZE)
+                return true;
+        return false;
+    }
+
+    // the blocks are kept for the next scope
+    void reset()
+    {
+        peakBytes = max(peakBytes, current * BLOCK_SIZE + used);
+        current = 0;
+        used = 0;
+    }
+
+private:
+    vector<char *> blocks;
+    size_t current; // block being filled
+    size_t used;    // bytes used in it
+    uintptr_t lowest, highest; // span of all the blocks
+
+    void nextBlock()
+    {
+        if (!blocks.empty())
+            current++;
+        used = 0;
+        if (current == blocks.size())
+        {
+            char *block = (char *)malloc(BLOCK_SIZE);
+            if (block == NULL)
+                throw bad_alloc();
+            blocks.push_back(block);
+            lowest = lowest == 0 ? (uintptr_t)block : min(lowest, (uintptr_t)block);
+            highest = max(highest, (uintptr_t)block + BLOCK_SIZE);
+        }
+    }
+};
+
+Arena &threadArena()
+{
+    thread_local Arena arena;
+    return arena;
+}
+
+class ArenaScope
+{
+public:
+    ArenaScope() { threadArena().depth++; }
+    ~ArenaScope()
+    {
+        Arena &arena = threadArena();
+        if (--arena.depth == 0)
+            arena.reset();
+    }
+};
+
+inline void *arenaNew(size_t size)
+{
+    Arena &arena = threadArena();
+    if (arena.depth > 0)
+        return arena.allocate(size);
+    return ::operator new(size);
+}
+
+inline void arenaDelete(void *memory)
+{
+    if (memory != NULL && !threadArena().owns(memory))
+        ::operator delete(memory);
+}
+
+// resident set size in kB, -1 where /proc is not available
+long residentKb()
+{
+#ifdef _WIN32
+    return -1;
+#else
+    ifstream statm("/proc/self/statm");
+    long pages, resident;
+    if (!(statm >> pages >> resident))
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
@@ -0,0 +1,342 @@
+// bucket rendering with a checkpoint, for renders that take hours: the frame is cut into square
+// buckets and every finished bucket is appended to images/render.checkpoint with a checksum,
+// flushed right away and synced to disk every few seconds; --resume skips the buckets found in
+// the checkpoint, a bucket torn by a crash fails its checksum and is rendered again
+// --crop x y width height renders only that part of the frame, into an image of that size
+// the buckets do not depend on each other, every core takes the next one left
+
+#include <cstdio>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+const char *CHECKPOINT_FILE = "images/render.checkpoint";
+const char CHECKPOINT_MAGIC[8] = "RTCKP01";
+const double CHECKPOINT_SYNC_SECONDS = 10;
+
+// start of a checkpoint, the records follow
+class CheckpointHeader
+{
+public:
+    char magic[8];
+    uint64_t key; // scene, camera and settings, a checkpoint of another render is not resumed
+    int32_t width, height, bucketSize;
+    int32_t bucketCount;
+};
+
+// one finished bucket, followed by its RGB bytes
+class CheckpointRecord
+{
+public:
+    int32_t bucket;
+    int32_t size;      // bytes that follow
+    uint64_t checksum; // of those bytes
+};
+
+class BucketRender
+{
+public:
+    BucketRender(int bucketSize, PixelRect crop);
+    // renders the starting camera, false if the crop is empty
+    boolean run(boolean resume);
+
+private:
+    int bucketSize;
+    PixelRect crop;
+    int columns, rows; // of buckets over the crop
+    RenderView view;
+    uint64_t key;
+    vector<unsigned char> image; // the crop, RGB rows from the top
+    vector<boolean> done;
+    FILE *checkpoint;
+
+    // shared by the render threads, everything below the lock is guarded by it
+    vector<int> pending; // buckets left, handed out in order
+    atomic<int> nextPending;
+    mutex lock;
+    int finished, rendered;
+    chrono::steady_clock::time_point lastSync;
+
+    PixelRect bucketRect(int bucket);
+    uint64_t renderKey();
+    void renderBuckets();
+    void renderBucket(int bucket, vector<GBufferEntry> &entries, vector<unsigned char> &pixels);
+    void finishBucket(int bucket, vector<unsigned char> &pixels);
+    void storeBucket(int bucket, vector<unsigned char> &pixels);
+    int readCheckpoint();
+    boolean startCheckpoint();
+    boolean appendBucket(int bucket, vector<unsigned char> &pixels);
+};
+
+BucketRender::BucketRender(int bucketSize, PixelRect crop)
+{
+    this->bucketSize = bucketSize;
+
+    // clip the crop to the frame
+    int x0 = max(0, crop.x), y0 = max(0, crop.y);
+    int x1 = min((long long)imageWidth, (long long)crop.x + crop.width);
+    int y1 = min((long long)imageHeight, (long long)crop.y + crop.height);
+    this->crop = PixelRect{x0, y0, max(0, x1 - x0), max(0, y1 - y0)};
+
+    columns = (this->crop.width + bucketSize - 1) / bucketSize;
+    rows = (this->crop.height + bucketSize - 1) / bucketSize;
+    checkpoint = NULL;
+}
+
+// in crop coordinates
+PixelRect BucketRender::bucketRect(int bucket)
+{
+    int x = bucket % columns * bucketSize, y = bucket / columns * bucketSize;
+    return PixelRect{x, y, min(bucketSize, crop.width - x), min(bucketSize, crop.height - y)};
+}
+
+// everything the pixels depend on
+uint64_t BucketRender::renderKey()
+{
+    stringstream text;
+    text << CHECKPOINT_MAGIC << "\n" << setprecision(17);
+    text << imageWidth << " " << imageHeight << " " << crop.x << " " << crop.y << " " << crop.width << " " << crop.height << " " << bucketSize << "\n";
+    text << view.eye.x << " " << view.eye.y << " " << view.eye.z << " " << view.topLeft.x << " " << view.topLeft.y << " " << view.topLeft.z << " "
+         << view.right.x << " " << view.right.y << " " << view.right.z << " " << view.down.x << " " << view.down.y << " " << view.down.z << "\n";
+    text << nearPlane << " " << farPlane << " " << recursionLevel << " " << (int)showTexture << " " << precisionName() << " "
+         << areaSamples << " " << shadowRayBudget << " " << lightCutoff << "\n";
+    // the description only names the OBJ files, their contents may change under the same name
+    for (Object *object : objects)
+    {
+        text << object->source << "\n";
+        if (object->objectType == "mesh")
+            text << fileStamp(((Mesh *)object)->fileName) << "\n";
+        if (object->objectType == "instance" && ((Instance *)object)->asset->objectType == "mesh")
+            text << fileStamp(((Mesh *)((Instance *)object)->asset.get())->fileName) << "\n";
+    }
+    for (LightSource *light : lights)
+        text << light->source << "\n";
+    return hashText(text.str());
+}
+
+// runs on every render thread until no bucket is left
+void BucketRender::renderBuckets()
+{
+    vector<unsigned char> pixels;
+    vector<GBufferEntry> entries;
+    for (int k = nextPending++; k < pending.size(); k = nextPending++)
+    {
+        renderBucket(pending[k], entries, pixels);
+        finishBucket(pending[k], pixels);
+    }
+}
+
+void BucketRender::renderBucket(int bucket, vector<GBufferEntry> &entries, vector<unsigned char> &pixels)
+{
+    PROFILE_SCOPE("bucket");
+    PixelRect rect = bucketRect(bucket);
+    PixelRect frameRect = {crop.x + rect.x, crop.y + rect.y, rect.width, rect.height};
+    pixels.resize(rect.width * rect.height * 3);
+    renderRect(view, frameRect, entries, pixels.data());
+}
+
+void BucketRender::storeBucket(int bucket, vector<unsigned char> &pixels)
+{
+    PixelRect rect = bucketRect(bucket);
+    for (int i = 0; i < rect.height; i++)
+        memcpy(&image[((rect.y + i) * crop.width + rect.x) * 3], &pixels[i * rect.width * 3], rect.width * 3);
+    done[bucket] = true;
+}
+
+// takes the buckets of a checkpoint of the same render, returns how many
+int BucketRender::readCheckpoint()
+{
+    FILE *file = fopen(CHECKPOINT_FILE, "rb");
+    if (file == NULL)
+    {
+        cout << "render: no checkpoint to resume, starting over" << endl;
+        return 0;
+    }
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.key != key || header.bucketCount != columns * rows)
+    {
+        cout << "render: " << CHECKPOINT_FILE << " is of a different render, starting over" << endl;
+        fclose(file);
+        return 0;
+    }
+
+    // stops at the first record that is cut short, the crash happened there; a record whose
+    // pixels fail the checksum is only skipped
+    int count = 0, damaged = 0;
+    CheckpointRecord record;
+    vector<unsigned char> pixels;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.bucket < 0 || record.bucket >= columns * rows)
+            break;
+        PixelRect rect = bucketRect(record.bucket);
+        if (record.size != rect.width * rect.height * 3)
+            break;
+        pixels.resize(record.size);
+        if (fread(pixels.data(), 1, record.size, file) != record.size)
+            break;
+        if (hashBytes(pixels.data(), record.size) != record.checksum)
+        {
+            damaged++;
+            continue;
+        }
+        if (!done[record.bucket])
+            count++;
+        storeBucket(record.bucket, pixels);
+    }
+    fclose(file);
+
+    if (damaged > 0)
+        cout << "render: " << damaged << " damaged buckets in " << CHECKPOINT_FILE << " are traced again" << endl;
+    return count;
+}
+
+// writes the buckets done so far to a new checkpoint, next to the old one and renamed over it,
+// and keeps it open for appending
+boolean BucketRender::startCheckpoint()
+{
+    string temporary = string(CHECKPOINT_FILE) + ".tmp";
+    checkpoint = fopen(temporary.c_str(), "wb");
+    if (checkpoint == NULL)
+        return false;
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.width = crop.width;
+    header.height = crop.height;
+    header.bucketSize = bucketSize;
+    header.bucketCount = columns * rows;
+    boolean written = fwrite(&header, sizeof(header), 1, checkpoint) == 1;
+
+    vector<unsigned char> pixels;
+    for (int bucket = 0; bucket < columns * rows && written; bucket++)
+    {
+        if (!done[bucket])
+            continue;
+        PixelRect rect = bucketRect(bucket);
+        pixels.resize(rect.width * rect.height * 3);
+        for (int i = 0; i < rect.height; i++)
+            memcpy(&pixels[i * rect.width * 3], &image[((rect.y + i) * crop.width + rect.x) * 3], rect.width * 3);
+        written = appendBucket(bucket, pixels);
+    }
+
+    written = written && fflush(checkpoint) == 0;
+    if (!written || rename(temporary.c_str(), CHECKPOINT_FILE) != 0)
+    {
+        fclose(checkpoint);
+        checkpoint = NULL;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+boolean BucketRender::appendBucket(int bucket, vector<unsigned char> &pixels)
+{
+    CheckpointRecord record;
+    record.bucket = bucket;
+    record.size = pixels.size();
+    record.checksum = hashBytes(pixels.data(), pixels.size());
+    return fwrite(&record, sizeof(record), 1, checkpoint) == 1 && fwrite(pixels.data(), 1, pixels.size(), checkpoint) == pixels.size();
+}
+
+// takes a traced bucket into the image and the checkpoint, on the thread that traced it
+void BucketRender::finishBucket(int bucket, vector<unsigned char> &pixels)
+{
+    lock_guard<mutex> guard(lock);
+    storeBucket(bucket, pixels);
+    rendered++;
+    finished++;
+
+    // flushed at once so a crash of the process loses at most the buckets being traced,
+    // synced now and then so a crash of the machine loses at most a few seconds
+    if (checkpoint != NULL)
+    {
+        boolean written = appendBucket(bucket, pixels) && fflush(checkpoint) == 0;
+        auto now = chrono::steady_clock::now();
+        if (written && chrono::duration<double>(now - lastSync).count() >= CHECKPOINT_SYNC_SECONDS)
+        {
+#ifdef _WIN32
+            _commit(_fileno(checkpoint));
+#else
+            fsync(fileno(checkpoint));
+#endif
+            lastSync = now;
+        }
+        if (!written)
+        {
+            cout << "render: could not write " << CHECKPOINT_FILE << ", continuing without a checkpoint" << endl;
+            fclose(checkpoint);
+            checkpoint = NULL;
+        }
+    }
+
+    int buckets = columns * rows;
+    if (finished * 10 / buckets != (finished - 1) * 10 / buckets)
+        cout << "render: " << finished << "/" << buckets << " buckets" << endl;
+}
+
+boolean BucketRender::run(boolean resume)
+{
+    if (crop.width == 0 || crop.height == 0)
+    {
+        cout << "render: the crop is outside the " << imageWidth << "x" << imageHeight << " frame" << endl;
+        return false;
+    }
+
+    view = captureView(imageWidth, imageHeight);
+    key = renderKey();
+    image.assign(crop.width * crop.height * 3, 0);
+    done.assign(columns * rows, false);
+
+    int buckets = columns * rows;
+    finished = resume ? readCheckpoint() : 0;
+    if (finished > 0)
+        cout << "render: resuming, " << finished << " of " << buckets << " buckets found in " << CHECKPOINT_FILE << endl;
+    if (!startCheckpoint())
+        cout << "render: could not write " << CHECKPOINT_FILE << ", rendering without a checkpoint" << endl;
+
+    STATS_FRAME_BEGIN(imageWidth * imageHeight);
+    auto begin = chrono::steady_clock::now();
+    lastSync = begin;
+    rendered = 0;
+    pending.clear();
+    for (int bucket = 0; bucket < buckets; bucket++)
+        if (!done[bucket])
+            pending.push_back(bucket);
+    nextPending = 0;
+
+    unsigned int threads = min((size_t)max(1u, thread::hardware_concurrency()), pending.size());
+    vector<thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+        workers.push_back(thread(&BucketRender::renderBuckets, this));
+    renderBuckets();
+    for (thread &worker : workers)
+        worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    string imageName = nextImageName();
+    saveBmp(image, crop.width, crop.height, imageName);
+    if (checkpoint != NULL)
+    {
+        fclose(checkpoint);
+        checkpoint = NULL;
+        remove(CHECKPOINT_FILE);
+    }
+    cout << "render: " << imageName << " saved, " << crop.width << "x" << crop.height << " at " << crop.x << "," << crop.y
+         << ", " << rendered << " buckets traced in " << seconds << "s on " << threads << (threads == 1 ? " thread" : " threads") << endl;
+    STATS_REPORT("images/heat" + to_string(imageCount - 1) + ".bmp");
+    return true;
+}
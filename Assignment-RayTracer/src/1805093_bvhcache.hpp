@@ -0,0 +1,225 @@
+// on disk cache of built meshes: the vertex, index, edge, normal and BVH node arrays are written
+// as they are in memory to bvh-cache/<key>.bin, the key being a hash of the mesh's entry in the
+// scene description and the size and modification time of its OBJ file; the next run maps the
+// file and points the arrays into it, so a cached mesh is neither parsed nor built
+// mapped MAP_PRIVATE, so a refit can still write to the arrays without touching the file
+
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+boolean useMeshCache = true; // --no-cache turns it off
+const char *MESH_CACHE_DIRECTORY = "bvh-cache";
+
+// array of a mesh, built in memory or pointing into a mapped cache file
+// indexing is a plain pointer access either way; growing it copies a mapped array into memory first
+template <typename T>
+class MeshArray
+{
+public:
+    MeshArray() : items(NULL), count(0), mapped(false) {}
+
+    T &operator[](size_t i) { return items[i]; }
+    const T &operator[](size_t i) const { return items[i]; }
+    size_t size() const { return count; }
+    boolean empty() const { return count == 0; }
+    T *data() { return items; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+
+    void clear()
+    {
+        owned.clear();
+        mapped = false;
+        sync();
+    }
+    void reserve(size_t n)
+    {
+        adopt();
+        owned.reserve(n);
+        sync();
+    }
+    void resize(size_t n)
+    {
+        adopt();
+        owned.resize(n);
+        sync();
+    }
+    void push_back(const T &item)
+    {
+        adopt();
+        owned.push_back(item);
+        sync();
+    }
+    void swap(vector<T> &other)
+    {
+        adopt();
+        owned.swap(other);
+        sync();
+    }
+    void swap(MeshArray &other)
+    {
+        owned.swap(other.owned);
+        std::swap(items, other.items);
+        std::swap(count, other.count);
+        std::swap(mapped, other.mapped);
+    }
+
+    // the memory must outlive the array, the mesh keeps the mapping alive
+    void map(T *items, size_t count)
+    {
+        vector<T>().swap(owned);
+        this->items = items;
+        this->count = count;
+        mapped = true;
+    }
+
+private:
+    vector<T> owned;
+    T *items;
+    size_t count;
+    boolean mapped;
+
+    void adopt()
+    {
+        if (mapped)
+        {
+            owned.assign(items, items + count);
+            mapped = false;
+        }
+    }
+    void sync()
+    {
+        items = owned.data();
+        count = owned.size();
+    }
+};
+
+// a whole file, mapped read-write private where mmap exists and read into memory elsewhere
+class MappedFile
+{
+public:
+    char *bytes;
+    size_t size;
+
+    MappedFile() : bytes(NULL), size(0), isMapped(false) {}
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (isMapped)
+        {
+            munmap(bytes, size);
+            return;
+        }
+#endif
+        free(bytes);
+    }
+
+    boolean open(const string &path)
+    {
+#ifdef _WIN32
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            return false;
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        bytes = (char *)malloc(size);
+        boolean complete = bytes != NULL && fread(bytes, 1, size, file) == size;
+        fclose(file);
+        return complete;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        size = info.st_size;
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+            return false;
+        bytes = (char *)memory;
+        isMapped = true;
+        return true;
+#endif
+    }
+
+private:
+    boolean isMapped;
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+// FNV-1a
+uint64_t hashBytes(const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hashText(const string &text)
+{
+    return hashBytes(text.data(), text.size());
+}
+
+// size and modification time stand in for the contents, reading them would cost as much as parsing
+string fileStamp(const string &path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) < 0)
+        return "missing";
+    return to_string((long long)info.st_size) + ":" + to_string((long long)info.st_mtime);
+}
+
+string cachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+    return string(MESH_CACHE_DIRECTORY) + "/" + name;
+}
+
+void makeCacheDirectory()
+{
+#ifdef _WIN32
+    _mkdir(MESH_CACHE_DIRECTORY);
+#else
+    mkdir(MESH_CACHE_DIRECTORY, 0755);
+#endif
+}
+
+// start of a cache file, the arrays follow at the given offsets
+class MeshCacheHeader
+{
+public:
+    static const int ARRAYS = 6; // vertices, indices, edges, normals, nodes, wide nodes
+
+    char magic[8];
+    uint64_t key;
+    uint64_t elementSizes[ARRAYS]; // so a file written by a different build is not misread
+    uint64_t counts[ARRAYS];
+    uint64_t offsets[ARRAYS];
+};
+
+const char MESH_CACHE_MAGIC[8] = "RTBVH03"; // 03: the BVH depth is capped
@@ -0,0 +1,136 @@
+// the viewer's eye and orthonormal basis, held by value so that moving it never allocates
+// held keys move it continuously at fixed rates per second; the motion is integrated in fixed
+// ticks, so the cosine and sine of the rotation step are computed once, not per component and frame
+
+using namespace std;
+
+// what the held keys ask for, each -1, 0 or 1
+class CameraControls
+{
+public:
+    int yaw, pitch, roll;        // 1/2, 3/4, 5/6
+    int forward, sideways, lift; // arrows and page up/down
+    int orbitUp, orbitAround;    // w/s and a/d, keep looking at the point in front of the eye
+
+    CameraControls() { clear(); }
+    void clear() { yaw = pitch = roll = forward = sideways = lift = orbitUp = orbitAround = 0; }
+    boolean any() { return yaw || pitch || roll || forward || sideways || lift || orbitUp || orbitAround; }
+};
+
+class Camera
+{
+public:
+    static const int TICKS_PER_SECOND = 120;
+    // a key press used to turn by 0.05 radians and move by 2 (arrows) or 0.25 (w/s/a/d) units,
+    // at the usual 30 repeats per second that is
+    static constexpr double TURN_RATE = 1.5;   // radians per second
+    static constexpr double MOVE_RATE = 60;    // units per second
+    static constexpr double ORBIT_RATE = 7.5;  // units per second
+
+    Point eye, look, right, up;
+
+    Camera();
+    void reset();          // the starting view
+    void orthonormalize(); // right and up from look and the current up
+    // moves by the controls for the given time, returns false if nothing is held
+    boolean advance(double seconds, CameraControls &controls);
+
+private:
+    double cosStep, sinStep; // of the rotation in one tick
+    double pending;          // seconds not yet integrated
+
+    void tick(CameraControls &controls);
+    static void rotate(Point &a, Point &b, double c, double s);
+    static void normalize(Point &p);
+};
+
+Camera::Camera()
+{
+    cosStep = cos(TURN_RATE / TICKS_PER_SECOND);
+    sinStep = sin(TURN_RATE / TICKS_PER_SECOND);
+    pending = 0;
+    reset();
+}
+
+void Camera::reset()
+{
+    eye = Point(0, 100, 100);
+    look = Point(0, -1, -1);
+    look.normalize();
+    right = Point(-20, 0, 0);
+    right.normalize();
+    up = Point(right.y * look.z - right.z * look.y, right.z * look.x - right.x * look.z, right.x * look.y - right.y * look.x);
+}
+
+void Camera::orthonormalize()
+{
+    right = Point(look.y * up.z - look.z * up.y, look.z * up.x - look.x * up.z, look.x * up.y - look.y * up.x);
+    right.normalize();
+    up = Point(right.y * look.z - right.z * look.y, right.z * look.x - right.x * look.z, right.x * look.y - right.y * look.x);
+    up.normalize();
+}
+
+boolean Camera::advance(double seconds, CameraControls &controls)
+{
+    if (!controls.any())
+    {
+        pending = 0;
+        return false;
+    }
+
+    // after a stall, do not replay more than a quarter of a second
+    pending = min(pending + seconds, 0.25);
+    while (pending >= 1.0 / TICKS_PER_SECOND)
+    {
+        tick(controls);
+        pending -= 1.0 / TICKS_PER_SECOND;
+    }
+    orthonormalize();
+    return true;
+}
+
+// a' = a cos + b sin, b' = b cos - a sin
+void Camera::rotate(Point &a, Point &b, double c, double s)
+{
+    Point oldA = a;
+    a = Point(a.x * c + b.x * s, a.y * c + b.y * s, a.z * c + b.z * s);
+    b = Point(b.x * c - oldA.x * s, b.y * c - oldA.y * s, b.z * c - oldA.z * s);
+}
+
+void Camera::normalize(Point &p)
+{
+    double length = p.magnitude();
+    if (length > 0)
+        p = Point(p.x / length, p.y / length, p.z / length);
+}
+
+void Camera::tick(CameraControls &controls)
+{
+    if (controls.yaw != 0)
+        rotate(right, look, cosStep, controls.yaw * sinStep);
+    if (controls.pitch != 0)
+        rotate(look, up, cosStep, controls.pitch * sinStep);
+    if (controls.roll != 0)
+        rotate(up, right, cosStep, controls.roll * sinStep);
+
+    double move = MOVE_RATE / TICKS_PER_SECOND;
+    eye.x += (look.x * controls.forward + right.x * controls.sideways + up.x * controls.lift) * move;
+    eye.y += (look.y * controls.forward + right.y * controls.sideways + up.y * controls.lift) * move;
+    eye.z += (look.z * controls.forward + right.z * controls.sideways + up.z * controls.lift) * move;
+
+    if (controls.orbitUp == 0 && controls.orbitAround == 0)
+        return;
+
+    // move without changing the point one unit in front of the eye
+    double orbit = ORBIT_RATE / TICKS_PER_SECOND;
+    Point center(eye.x + look.x, eye.y + look.y, eye.z + look.z);
+    eye.x += orbit * (controls.orbitUp * up.x - controls.orbitAround * up.y * look.y);
+    eye.y += orbit * (controls.orbitUp * up.y + controls.orbitAround * look.x * up.y);
+    eye.z += orbit * controls.orbitUp * up.z;
+
+    look.x = center.x - eye.x;
+    look.y = center.y - eye.y;
+    if (controls.orbitUp != 0)
+        look.z = center.z - eye.z;
+    normalize(look);
+}
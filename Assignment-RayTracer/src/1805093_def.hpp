@@ -1,22 +1,33 @@
+#ifdef _WIN32
 #include <windows.h> // for MS Windows
+#else
+typedef unsigned char boolean; // defined by windows.h on MS Windows
+#endif
 #include <GL/glut.h> // GLUT, include glu.h and gl.h
 #include <cmath>
 #include <iostream>
 #include <vector>
 #include <iomanip>
 #include <cassert>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <map>
 
 using namespace std;
 
-#define EPSILON 0.00001
+#include "1805093_stats.hpp"
+#include "1805093_profiler.hpp"
+#include "1805093_arena.hpp"
+#include "1805093_precision.hpp"
+#include "1805093_widebvh.hpp"
+#include "1805093_displaylist.hpp"
+#include "1805093_bvhcache.hpp"
+#include "bitmap_image.hpp"
 
-double determinant(double a[3][3])
-{
-    double det = 0;
-    for (int i = 0; i < 3; i++)
-        det = det + (a[0][i] * (a[1][(i + 1) % 3] * a[2][(i + 2) % 3] - a[1][(i + 2) % 3] * a[2][(i + 1) % 3]));
-    return det;
-}
+#define EPSILON 0.00001
 
 class Point
 {
@@ -32,6 +43,9 @@ public:
     Point *cross(Point *p);
     double dot(Point *p);
     double magnitude();
+
+    static void *operator new(size_t size) { return arenaNew(size); }
+    static void operator delete(void *memory) { arenaDelete(memory); }
 };
 
 class Color
@@ -46,11 +60,27 @@ public:
     Color *add(Color *c);
     Color *copy();
     void adjust();
+
+    static void *operator new(size_t size) { return arenaNew(size); }
+    static void operator delete(void *memory) { arenaDelete(memory); }
+};
+
+// RGB texels with a precomputed chain of mip levels, all in one image_pyramid
+class Texture
+{
+public:
+    image_pyramid mips; // level 0 is the full resolution image, RGB rows
+
+    void build(int width, int height, vector<float> &texels);
+    Color sample(double u, double v, double footprint);
+
+private:
+    Color bilinear(int level, double u, double v);
 };
 
 extern boolean showTexture;
-extern vector<vector<Color *>> whiteTileColorBuffer;
-extern vector<vector<Color *>> blackTileColorBuffer;
+extern Texture whiteTileTexture;
+extern Texture blackTileTexture;
 
 class Ray
 {
@@ -61,6 +91,9 @@ public:
     Point *getPoint(double t);
     Ray *copy();
     ~Ray();
+
+    static void *operator new(size_t size) { return arenaNew(size); }
+    static void operator delete(void *memory) { arenaDelete(memory); }
 };
 
 class LightCoefficients
@@ -69,13 +102,32 @@ public:
     double ambient, diffuse, specular, reflection;
 };
 
+// per ray constants of the watertight ray/triangle test (Woop, Benthin and Wald 2013)
+// the ray is sheared so that it runs along +z, then the triangle is tested in 2D,
+// which gives consistent results on shared edges and no cracks between triangles
+template <typename Real>
+class WatertightRay
+{
+public:
+    Vec3<Real> origin;
+    int kx, ky, kz;
+    Real Sx, Sy, Sz;
+
+    WatertightRay(const RayT<Real> &ray);
+    Real intersect(const Point &a, const Point &b, const Point &c);
+};
+
 class Triangle
 {
 public:
     Point a, b, c;
 
+    double size; // largest extent, scales the float tolerance
+
     Triangle(Point a, Point b, Point c);
     double calcIntersection(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
     Point *getNormal(Point *p);
 };
 
@@ -85,19 +137,33 @@ public:
     Point corner1, corner2;
     Rect(Point corner1, Point corner2);
     double calcIntersection(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
 };
 
+class LightSource;
+class ReflectionHit;
+
 class Object
 {
 public:
     string objectType;
+    int id;        // index in objects
+    string source; // its entry in the scene description
+    DisplayList displayList;
     Color color;
     LightCoefficients lightCoefficients;
     double shininess;
 
     Object();
+    virtual ~Object() {}
     Color *recIntersection(Ray *ray, Point *intersectionPoint, double t, int recLevel);
-    virtual void draw() {}
+    boolean lightReaches(LightSource *light, Point *p, double &spotFactor, double &visibility);
+    LightSource *firstLitLight(Point *p, ReflectionHit &hit);
+    boolean isShadowed(Point *source, Point *p);
+    Object *nearestReflected(Ray *reflectedRay, double &tMin); // nearest other object
+    virtual void draw();         // replays the display list, compiled from drawGeometry() on first use
+    virtual void drawGeometry() {} // immediate mode
     virtual double handleIntersecttion(Ray *ray) = 0;
     virtual Point *getNormal(Point *p, Point *rayDir) = 0;
     virtual Color *getColorAt(Point *p) { return color.copy(); }
@@ -105,30 +171,46 @@ public:
 
 class Board : public Object
 {
+    vector<DisplayList> chunkLists;
+    GLuint checkerTexture;
+    void drawChunk(int iBegin, int iEnd, int jBegin, int jEnd);
+
 public:
+    static const int CHUNK_TILES = 16; // tiles per side of one display list
+
     int tileWidth, tileHeight;
     int tileCount;
 
+    Board();
+    ~Board();
     void draw();
+    void drawGeometry();
+    void drawTiles(int iBegin, int iEnd, int jBegin, int jEnd);
     double handleIntersecttion(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
     Point *getNormal(Point *p, Point *rayDir);
     Color *getColorAt(Point *p);
-    Color *getTextureAt(Point *p);
+    Color getTextureAt(Point *p, Point *rayDir, double t);
 };
 
 class Pyramid : public Object
 {
     vector<Triangle *> sideTriangles;
-    Rect *bottomRect;
-    void calculateAllSides();
+    Rect *bottomRect = NULL;
 
 public:
     Point lowest;
     double width;
     double height;
 
-    void draw();
+    // once the size is set, before any thread traces it
+    void calculateAllSides();
+
+    void drawGeometry();
     double handleIntersecttion(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
     Point *getNormal(Point *p, Point *rayDir);
     ~Pyramid();
 };
@@ -142,8 +224,10 @@ public:
     Point center;
     double radius;
 
-    void draw();
+    void drawGeometry();
     double handleIntersecttion(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
     Point *getNormal(Point *p, Point *rayDir);
 };
 
@@ -153,6 +237,108 @@ public:
     Point bottomLeftFront;
     double side;
 
+    void drawGeometry();
+    double handleIntersecttion(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
+    Point *getNormal(Point *p, Point *rayDir);
+};
+
+// node of a mesh BVH, the left child of an inner node is the next node
+class MeshNode
+{
+public:
+    double lo[3], hi[3];
+    int start; // first triangle of a leaf or the right child of an inner node
+    int count; // number of triangles, 0 for inner nodes
+    int axis;  // split axis of an inner node
+};
+
+// triangle mesh loaded from an OBJ file
+class Mesh : public Object
+{
+    static const int LEAF_SIZE = 4;
+    // deeper nodes become leaves, so the traversal stacks below always fit: a binary traversal
+    // keeps at most one sibling per level, a wide one three, and collapsing never adds a level
+    static const int MAX_DEPTH = 64;
+    static const int STACK_SIZE = MAX_DEPTH + 1;
+    static const int WIDE_STACK_SIZE = 3 * MAX_DEPTH + 1;
+
+    int buildNode(vector<int> &order, vector<Point> &centroids, int begin, int end, int depth);
+    int collapseNode(int index, vector<WideNode> &built);
+    void refitWide(uint32_t child, double *lo, double *hi);
+    double wideExtent();
+    template <typename Real>
+    boolean hitsBox(MeshNode &node, const RayT<Real> &ray, Real *invDir, Real tMax);
+    template <typename Real>
+    Real intersectWide(const RayT<Real> &ray);
+    void closerTriangle(Point *p, int triangle, int &best, double &bestDistance);
+    int nearestTriangle(Point *p, double tolerance);
+    int nearestTriangleWide(Point *p, double tolerance);
+
+public:
+    string fileName;
+    Point offset;
+    double scale;
+
+    MeshArray<Point> vertices; // indexed vertex buffer
+    MeshArray<int> indices;    // 3 vertex indices per triangle
+    MeshArray<Point> edges;    // b - a and c - a of every triangle
+    MeshArray<Point> normals;  // unit geometric normal of every triangle
+    MeshArray<MeshNode> nodes;       // binary BVH, empty once collapsed into wideNodes
+    MeshArray<WideNode> wideNodes;   // 4-wide quantized BVH, with --bvh wide
+    shared_ptr<MappedFile> cacheFile; // the arrays point into it when they came from the cache
+
+    Mesh();
+    boolean load();
+    void buildBvh();
+    boolean buildWide(); // false if a leaf does not fit the wide encoding, the binary tree is kept then
+    string bvhText();
+    void refit(Mesh *old); // takes the geometry of a mesh of the same file at another offset or scale
+    uint64_t cacheKey();
+    boolean loadCache(uint64_t key);
+    void saveCache(uint64_t key);
+    int triangleCount() { return indices.size() / 3; }
+
+    void drawGeometry();
+    double handleIntersecttion(Ray *ray);
+    template <typename Real>
+    Real intersect(const RayT<Real> &ray);
+    Point *getNormal(Point *p, Point *rayDir);
+};
+
+// the triangles meshes were last hit at on this thread, newest first, for their normals;
+// a few are kept since the shadow rays of a point may hit the mesh elsewhere before the normal is asked for
+class MeshHits
+{
+public:
+    static const int SIZE = 4;
+
+    const Mesh *mesh[SIZE];
+    int triangle[SIZE];
+
+    void add(const Mesh *hitMesh, int hitTriangle)
+    {
+        for (int k = SIZE - 1; k > 0; k--)
+            mesh[k] = mesh[k - 1], triangle[k] = triangle[k - 1];
+        mesh[0] = hitMesh;
+        triangle[0] = hitTriangle;
+    }
+};
+
+thread_local MeshHits recentMeshHits = {};
+
+// a placement of shared geometry: rays are moved into the asset's space through the inverse of
+// a 3x4 transform, so a thousand instances of an asset keep one copy of it (and of its BVH)
+class Instance : public Object
+{
+public:
+    string assetName;
+    shared_ptr<Object> asset;
+    double toWorld[3][4];
+    double toObject[3][4];
+
+    boolean setTransform(double matrix[3][4]); // false if it is singular
     void draw();
     double handleIntersecttion(Ray *ray);
     Point *getNormal(Point *p, Point *rayDir);
@@ -165,8 +351,12 @@ public:
     Point position;
     double falloff;
     Color color;
+    int index;             // position in lights
+    double influenceRadius; // beyond it exp(-d^2 falloff) is below the light cutoff
+    string source;          // its entry in the scene description
 
     LightSource(string lightType);
+    virtual ~LightSource() {}
     virtual void draw() = 0;
 };
 
@@ -181,33 +371,278 @@ class SpotLightSource : public LightSource
 {
 public:
     Point direction;
-    double cutoffAngle;
+    double cutoffAngle;  // degrees
+    double penumbraAngle; // degrees inside the cutoff over which the light fades out, 0 for a hard edge
+
+    // set by prepare() once the light is read
+    double cosCutoff, cosInner;
 
     SpotLightSource();
+    void prepare();
+    double coneFactor(Point *p); // 0 outside the cone, 1 inside the inner cone
+    void draw();
+};
+
+// rectangle (corner and two edges) or sphere that casts soft shadows
+// it is shaded like a point light at its center, scaled by the share of its shadow samples that reach the point
+class AreaLightSource : public LightSource
+{
+public:
+    enum Shape
+    {
+        RECTANGLE,
+        SPHERE
+    };
+
+    Shape shape;
+    Point corner, edgeU, edgeV; // rectangle
+    double radius;              // sphere, centered at position
+
+    AreaLightSource(Shape shape);
+    void prepare(); // puts the position of a rectangle at its center
+    Point samplePoint(Point *p, double u, double v); // u, v in [0, 1) over the light as seen from p
+    double visibility(Object *receiver, Point *p, int &shadowRaysLeft);
     void draw();
 };
 
+// uniform grid over the spheres of influence of the lights, so a shading point only
+// visits the lights that can still light it; lights without falloff reach everywhere
+class LightGrid
+{
+public:
+    static const int MAX_CELLS_PER_AXIS = 64;
+
+    vector<LightSource *> unbounded;
+
+    void build(vector<LightSource *> &lights, double cutoff);
+    const vector<LightSource *> &cellAt(Point *p); // bounded lights whose sphere may contain p
+    boolean reaches(LightSource *light, Point *p);
+
+private:
+    double lo[3], cellSize;
+    int dims[3];
+    vector<vector<LightSource *>> cells;
+    vector<LightSource *> none;
+};
+
 //////////////////////////////// OBJECT ////////////////////////////////
 
 Object::Object()
 {
+    id = -1;
     color = Color();
     lightCoefficients = LightCoefficients();
     shininess = 0;
 }
 
+// an object is not changed once it is in the scene, a reload replaces it, so the list never goes stale
+void Object::draw()
+{
+    if (!retainedPreview)
+    {
+        drawGeometry();
+        return;
+    }
+
+    if (!displayList.ready())
+    {
+        displayList.begin();
+        drawGeometry();
+        displayList.end();
+    }
+    displayList.call();
+}
+
 extern vector<Object *> objects;
 extern vector<LightSource *> lights;
+extern LightGrid lightGrid;
+extern int fovY, imageHeight;
+extern int recursionLevel;
+extern int shadowRayBudget;
+
+// shadow rays the pixel being traced may still cast, refilled at its primary hit
+thread_local int shadowRaysLeft = 0;
+
+// the first reflection of a pixel, traced ahead of the shading together with the walk over
+// the lights of its primary hit up to the first lit one, where recIntersection traces it
+class ReflectionHit
+{
+public:
+    boolean traced;
+    int objectId; // -1 if the ray hits nothing
+    double t;
+    int litLight;                  // lights walked before the first lit one, all of them if none is
+    double spotFactor, visibility; // of the first lit light
+    int shadowRaysLeft;            // of the pixel after the walk
+};
+
+// the lights that may reach p in shading order, the ones of its light grid cell
+// merged by index with the unbounded ones
+class LightWalk
+{
+public:
+    LightWalk(Point *p) : bounded(lightGrid.cellAt(p)), unbounded(lightGrid.unbounded)
+    {
+        nextBounded = nextUnbounded = 0;
+    }
+
+    // NULL after the last one
+    LightSource *next();
+
+private:
+    const vector<LightSource *> &bounded;
+    const vector<LightSource *> &unbounded;
+    int nextBounded, nextUnbounded;
+};
+
+// set while a pixel whose first reflection was traced ahead is shaded, taken by its primary hit
+thread_local ReflectionHit *preparedReflection = NULL;
+
+// mirror image of dir about the unit normal N, the same for N and -N
+Point *reflectDirection(Point *dir, Point *N)
+{
+    Point *scaled = N->multiply(2 * dir->dot(N));
+    Point *R = dir->subtract(scaled);
+    delete scaled;
+    R->normalize();
+    return R;
+}
+
+Ray *reflectedRayFrom(Point *p, Point *R)
+{
+    Point *step = R->multiply(rayOffset(p));
+    Ray *ray = new Ray(p->add(step), R->copy());
+    delete step;
+    return ray;
+}
+
+LightSource *LightWalk::next()
+{
+    if (nextBounded == bounded.size() && nextUnbounded == unbounded.size())
+        return NULL;
+    if (nextUnbounded == unbounded.size() || (nextBounded < bounded.size() && bounded[nextBounded]->index < unbounded[nextUnbounded]->index))
+        return bounded[nextBounded++];
+    return unbounded[nextUnbounded++];
+}
+
+// false if nothing of the light reaches p, out of reach, outside the cone or shadowed;
+// the shadow rays come out of the budget of the pixel
+boolean Object::lightReaches(LightSource *light, Point *p, double &spotFactor, double &visibility)
+{
+    if (!lightGrid.reaches(light, p))
+    {
+        STATS_COUNT(culledLights);
+        return false;
+    }
+
+    // a spot light that does not face the point costs one dot product, no shadow ray
+    spotFactor = 1;
+    if (light->lightType == "spot")
+    {
+        spotFactor = ((SpotLightSource *)light)->coneFactor(p);
+        if (spotFactor == 0)
+            return false;
+    }
+
+    // let's check if the light is blocked by any other object
+    visibility = 1;
+    if (light->lightType == "area")
+    {
+        visibility = ((AreaLightSource *)light)->visibility(this, p, shadowRaysLeft);
+        return visibility != 0;
+    }
+
+    shadowRaysLeft--;
+    return !isShadowed(&(light->position), p);
+}
+
+// walks the lights of the primary hit p as recIntersection does until one is lit, the one
+// the first reflection leaves by, and keeps where the walk stopped in hit; NULL if none is,
+// recIntersection traces no reflection for the pixel then
+LightSource *Object::firstLitLight(Point *p, ReflectionHit &hit)
+{
+    shadowRaysLeft = shadowRayBudget;
+    LightWalk walk(p);
+    LightSource *light;
+    for (hit.litLight = 0; (light = walk.next()) != NULL; hit.litLight++)
+        if (lightReaches(light, p, hit.spotFactor, hit.visibility))
+            break;
+    hit.shadowRaysLeft = shadowRaysLeft;
+    hit.traced = true;
+    return light;
+}
+
+Object *Object::nearestReflected(Ray *reflectedRay, double &tMin)
+{
+    tMin = -1;
+    Object *nearestObject = NULL;
+    for (Object *object : objects)
+    {
+        // for spheres, pyramids and cubes - self reflection is not possible
+        if (object == this)
+            continue;
+
+        STATS_OBJECT_TEST(object->id);
+        double t = object->handleIntersecttion(reflectedRay);
+        if (t > -EPSILON && (tMin < 0 || t < tMin))
+        {
+            tMin = t;
+            nearestObject = object;
+        }
+    }
+
+    if (nearestObject != NULL)
+        STATS_OBJECT_HIT(nearestObject->id);
+    return nearestObject;
+}
+
+// true if an object lies between source and p, a point on this object
+boolean Object::isShadowed(Point *source, Point *p)
+{
+    Point *toObject = p->subtract(source);
+    Ray *toObjectRay = new Ray(source->copy(), toObject->copy());
+    delete toObject;
+
+    STATS_COUNT(shadowRays);
+    boolean isBlocked = false;
+    STATS_OBJECT_TEST(id);
+    double tCurrent = this->handleIntersecttion(toObjectRay);
+    for (Object *object : objects)
+    {
+        // no need to check if the object is the current object
+        // cause self blocking is a thing
+
+        STATS_OBJECT_TEST(object->id);
+        double t = object->handleIntersecttion(toObjectRay);
+        // the blocking object must be closer than the current object from the source
+        if (t > -EPSILON && (tCurrent < 0 || t < tCurrent))
+        {
+            isBlocked = true;
+            break;
+        }
+    }
+    delete toObjectRay;
+
+    return isBlocked;
+}
 
 Color *Object::recIntersection(Ray *ray, Point *intersectionPoint, double t, int recLevel)
 {
     if (t <= EPSILON || recLevel == 0)
         return new Color(0, 0, 0);
 
+    ReflectionHit *prepared = NULL;
+    if (recLevel == recursionLevel)
+    {
+        shadowRaysLeft = shadowRayBudget;
+        prepared = preparedReflection;
+        preparedReflection = NULL;
+    }
+
     Color *colorHere = getColorAt(intersectionPoint);
     // this is not to make the board dark, there is a corresponding commented out part below
     if (showTexture && objectType == "board")
-        colorHere = ((Board *)this)->getTextureAt(intersectionPoint);
+        *colorHere = ((Board *)this)->getTextureAt(intersectionPoint, ray->dir, t);
 
     // ambient
     Color *ambient = colorHere->multiply(this->lightCoefficients.ambient);
@@ -216,41 +651,27 @@ Color *Object::recIntersection(Ray *ray, Point *intersectionPoint, double t, int
     double lambert = 0, phong = 0;
     Color *reflection = new Color(0, 0, 0); // reflection is black by default
 
-    for (LightSource *light : lights)
+    // the reflected ray does not depend on the light, trace it once and add it for every lit light
+    Color *reflectedColor = NULL;
+
+    // lights out of reach are skipped before their shadow ray, the rest in the order of lights;
+    // with the reflection traced ahead the walk already got to the first lit light, resume it
+    boolean resumed = prepared != NULL && prepared->traced;
+    if (resumed)
+        shadowRaysLeft = prepared->shadowRaysLeft;
+    LightWalk walk(intersectionPoint);
+    LightSource *light;
+    for (int walked = 0; (light = walk.next()) != NULL; walked++)
     {
-        // let's check if the light is blocked by any other object
-        Point *toObject = intersectionPoint->subtract(&(light->position));
-        Ray *toObjectRay = new Ray(light->position.copy(), toObject->copy());
-
-        boolean isBlocked = false;
-        double tCurrent = this->handleIntersecttion(toObjectRay);
-        for (Object *object : objects)
-        {
-            // no need to check if the object is the current object
-            // cause self blocking is a thing
-
-            double t = object->handleIntersecttion(toObjectRay);
-            // the blocking object must be closer than the current object from the source
-            if (t > -EPSILON && (tCurrent < 0 || t < tCurrent))
-            {
-                isBlocked = true;
-                break;
-            }
-        }
-        delete toObjectRay;
-
-        if (isBlocked == false && light->lightType == "spot")
+        double spotFactor, visibility;
+        if (resumed && walked < prepared->litLight)
+            continue;
+        if (resumed && walked == prepared->litLight)
         {
-            SpotLightSource *spot = (SpotLightSource *)light;
-            Point *sourceToObject = intersectionPoint->subtract(&(spot->position));
-            sourceToObject->normalize();
-            spot->direction.normalize();
-            double angle = acos(sourceToObject->dot(&(spot->direction)));
-            if (angle * 180 / M_PI > spot->cutoffAngle)
-                isBlocked = true;
+            spotFactor = prepared->spotFactor;
+            visibility = prepared->visibility;
         }
-
-        if (isBlocked)
+        else if (!lightReaches(light, intersectionPoint, spotFactor, visibility))
             continue;
 
         Point *toSource = light->position.subtract(intersectionPoint);
@@ -261,51 +682,60 @@ Color *Object::recIntersection(Ray *ray, Point *intersectionPoint, double t, int
         N->normalize();
 
         double distance = light->position.subtract(intersectionPoint)->magnitude();
-        double scalingFactor = exp(-distance * distance * light->falloff);
+        double scalingFactor = exp(-distance * distance * light->falloff) * spotFactor * visibility;
         lambert += max(0.0, toSource->dot(N)) * scalingFactor;
 
-        Point *R = ray->dir->subtract(N->multiply(2 * ray->dir->dot(N)));
+        Point *R = reflectDirection(ray->dir, N);
         // Point *R = N->multiply(2 * N->dot(toSource))->subtract(toSource);
         // this commented line here gave me multiple reflections for multiple sources
-        R->normalize();
 
         phong += pow(max(0.0, R->dot(toSource)), this->shininess) * scalingFactor;
 
-        delete toSource, N;
+        delete toSource;
+        delete N;
 
         // reflection
         if (recLevel == 1)
             continue;
 
-        Ray *reflectedRay = new Ray(intersectionPoint->add(R->multiply(2 * EPSILON)), R->copy());
-
-        double tMin = -1;
-        Object *nearestObject = NULL;
-        for (Object *object : objects)
+        if (reflectedColor == NULL)
         {
-            // for spheres, pyramids and cubes - self reflection is not possible
-            if (object == this)
-                continue;
+            Ray *reflectedRay = reflectedRayFrom(intersectionPoint, R);
+            STATS_COUNT(reflectionRays);
 
-            double t = object->handleIntersecttion(reflectedRay);
-            if (t > -EPSILON && (tMin < 0 || t < tMin))
+            double tMin;
+            Object *nearestObject;
+            if (resumed)
             {
-                tMin = t;
-                nearestObject = object;
+                STATS_COUNT(sortedReflectionsUsed);
+                tMin = prepared->t;
+                nearestObject = prepared->objectId < 0 ? NULL : objects[prepared->objectId];
             }
-        }
+            else
+                nearestObject = nearestReflected(reflectedRay, tMin);
 
-        if (nearestObject != NULL)
-        {
-            Point *reflectedPoint = reflectedRay->getPoint(tMin);
-            Color *reflectedColor = nearestObject->recIntersection(reflectedRay, reflectedPoint, tMin, recLevel - 1);
-            reflection = reflection->add(reflectedColor->multiply(this->lightCoefficients.reflection));
-            reflection->adjust();
-            delete reflectedPoint, reflectedColor;
+            if (nearestObject != NULL)
+            {
+                Point *reflectedPoint = reflectedRay->getPoint(tMin);
+                reflectedColor = nearestObject->recIntersection(reflectedRay, reflectedPoint, tMin, recLevel - 1);
+                delete reflectedPoint;
+            }
+            else
+            {
+                reflectedColor = new Color(0, 0, 0);
+            }
+            delete reflectedRay;
         }
-
-        delete reflectedRay, R;
+        delete R;
+
+        Color *scaledColor = reflectedColor->multiply(this->lightCoefficients.reflection);
+        Color *sum = reflection->add(scaledColor);
+        delete reflection;
+        reflection = sum;
+        reflection->adjust();
+        delete scaledColor;
     }
+    delete reflectedColor;
 
     Color *diffusedColor = colorHere->multiply(this->lightCoefficients.diffuse * lambert);
     Color *specularColor = colorHere->multiply(this->lightCoefficients.specular * phong);
@@ -314,7 +744,7 @@ Color *Object::recIntersection(Ray *ray, Point *intersectionPoint, double t, int
     // this makes the board too dark
     // if (showTexture && objectType == "board")
     // {
-    //     Color *textureColor = ((Board *)this)->getTextureAt(intersectionPoint);
+    //     Color *textureColor = ((Board *)this)->getTextureAt(intersectionPoint, ray->dir, t);
     //     assert(textureColor != NULL);
 
     //     // ambient = ambient->multiply(textureColor);
@@ -323,7 +753,11 @@ Color *Object::recIntersection(Ray *ray, Point *intersectionPoint, double t, int
     // }
     currColor = ambient->add(diffusedColor)->add(specularColor)->add(reflection);
     currColor->adjust();
-    delete ambient, diffusedColor, specularColor, colorHere;
+    delete ambient;
+    delete diffusedColor;
+    delete specularColor;
+    delete colorHere;
+    delete reflection;
 
     return currColor;
 }
@@ -498,6 +932,66 @@ void Color::adjust()
     // b = max(0.0, min(1.0, b));
 }
 
+/////////////////////////////// TEXTURE ///////////////////////////////
+
+// box filtered down to 1x1 in one pass, on every core
+void Texture::build(int width, int height, vector<float> &texels)
+{
+    mips.build(texels.data(), width, height, 3, image_pyramid::box_filter);
+}
+
+Color Texture::bilinear(int level, double u, double v)
+{
+    int width = mips.width(level), height = mips.height(level);
+    const float *texels = mips.level(level);
+    double x = u * (width - 1);
+    double y = v * (height - 1);
+
+    int x0 = max(0, min((int)floor(x), width - 1));
+    int y0 = max(0, min((int)floor(y), height - 1));
+    int x1 = min(x0 + 1, width - 1);
+    int y1 = min(y0 + 1, height - 1);
+    double fx = max(0.0, min(1.0, x - x0));
+    double fy = max(0.0, min(1.0, y - y0));
+
+    const float *t00 = &texels[(y0 * width + x0) * 3];
+    const float *t10 = &texels[(y0 * width + x1) * 3];
+    const float *t01 = &texels[(y1 * width + x0) * 3];
+    const float *t11 = &texels[(y1 * width + x1) * 3];
+
+    double c[3];
+    for (int i = 0; i < 3; i++)
+    {
+        double top = t00[i] + (t10[i] - t00[i]) * fx;
+        double bottom = t01[i] + (t11[i] - t01[i]) * fx;
+        c[i] = top + (bottom - top) * fy;
+    }
+    return Color(c[0], c[1], c[2]);
+}
+
+// footprint is the size of the sample in texture coordinates,
+// it picks the two closest mip levels and blends them (trilinear)
+Color Texture::sample(double u, double v, double footprint)
+{
+    if (mips.levels() == 0)
+        return Color(0, 0, 0);
+
+    double texels = footprint * max(mips.width(0), mips.height(0));
+    double lod = texels > 1 ? log2(texels) : 0;
+    int maxLevel = mips.levels() - 1;
+
+    int level = min((int)floor(lod), maxLevel);
+    double blend = lod - level;
+    if (level == maxLevel || blend <= 0)
+        return bilinear(level, u, v);
+
+    Color fine = bilinear(level, u, v);
+    Color coarse = bilinear(level + 1, u, v);
+    return Color(fine.r + (coarse.r - fine.r) * blend,
+                 fine.g + (coarse.g - fine.g) * blend,
+                 fine.b + (coarse.b - fine.b) * blend);
+}
+
 //////////////////////////////// RAY ////////////////////////////////
 
 Ray::Ray(Point *start, Point *dir)
@@ -524,108 +1018,87 @@ Ray::~Ray()
     delete dir;
 }
 
-/////////////////////////////// TRIANGLE ///////////////////////////////
+/////////////////////////// WATERTIGHT RAY ///////////////////////////
 
-Triangle::Triangle(Point a, Point b, Point c)
+double axisOf(Point &p, int k)
 {
-    this->a = a;
-    this->b = b;
-    this->c = c;
+    return k == 0 ? p.x : (k == 1 ? p.y : p.z);
 }
 
-double Triangle::calcIntersection(Ray *ray)
+template <typename Real>
+WatertightRay<Real>::WatertightRay(const RayT<Real> &ray)
 {
-    /////////////////// BARYCENTRIC COORDINATES ///////////////////
-    double betaMatrix[3][3] = {
-        {a.x - ray->start->x, a.x - c.x, ray->dir->x},
-        {a.y - ray->start->y, a.y - c.y, ray->dir->y},
-        {a.z - ray->start->z, a.z - c.z, ray->dir->z}};
-    double gammaMatrix[3][3] = {
-        {a.x - b.x, a.x - ray->start->x, ray->dir->x},
-        {a.y - b.y, a.y - ray->start->y, ray->dir->y},
-        {a.z - b.z, a.z - ray->start->z, ray->dir->z}};
-    double tMatrix[3][3] = {
-        {a.x - b.x, a.x - c.x, a.x - ray->start->x},
-        {a.y - b.y, a.y - c.y, a.y - ray->start->y},
-        {a.z - b.z, a.z - c.z, a.z - ray->start->z}};
-    double aMatrix[3][3] = {
-        {a.x - b.x, a.x - c.x, ray->dir->x},
-        {a.y - b.y, a.y - c.y, ray->dir->y},
-        {a.z - b.z, a.z - c.z, ray->dir->z}};
-
-    double aDet = determinant(aMatrix);
-    double beta = determinant(betaMatrix) / aDet;
-    double gamma = determinant(gammaMatrix) / aDet;
-    double t = determinant(tMatrix) / aDet;
-
-    if (beta >= -EPSILON && gamma >= -EPSILON && beta + gamma <= 1 + EPSILON && t > -EPSILON)
-        return t;
-
-    return -1;
-
-    // these other two are suggested by copilot
-    
-    /////////////////// MOLLER TRUMBORE ALGORITHM ///////////////////
-    // Point *edge1 = b.subtract(&a);
-    // Point *edge2 = c.subtract(&a);
-
-    // Point *h = ray->dir->cross(edge2);
-    // double a = edge1->dot(h);
-
-    // if (a > -EPSILON && a < EPSILON)
-    //     return -1;
-
-    // double f = 1 / a;
-    // Point *s = ray->start->subtract(&this->a);
-    // double u = f * s->dot(h);
+    origin = ray.start;
 
-    // if (u < 0 || u > 1)
-    //     return -1;
+    // the largest component of the direction becomes z
+    Real ax = fabs(ray.dir.x), ay = fabs(ray.dir.y), az = fabs(ray.dir.z);
+    kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    // keep the winding of the triangle
+    if (ray.dir[kz] < 0)
+        swap(kx, ky);
 
-    // Point *q = s->cross(edge1);
-    // double v = f * ray->dir->dot(q);
-
-    // if (v < 0 || u + v > 1)
-    //     return -1;
-
-    // double t = f * edge2->dot(q);
+    Sx = ray.dir[kx] / ray.dir[kz];
+    Sy = ray.dir[ky] / ray.dir[kz];
+    Sz = Real(1) / ray.dir[kz];
+}
 
-    // delete edge1, edge2, h, s, q;
+// returns t of the hit, or -1 if the ray misses
+template <typename Real>
+Real WatertightRay<Real>::intersect(const Point &a, const Point &b, const Point &c)
+{
+    STATS_COUNT(triangleTests);
 
-    // if (t > -EPSILON)
-    //     return t;
+    Vec3<Real> A = Vec3<Real>(a) - origin;
+    Vec3<Real> B = Vec3<Real>(b) - origin;
+    Vec3<Real> C = Vec3<Real>(c) - origin;
 
-    // return -1;
+    Real Az = A[kz], Bz = B[kz], Cz = C[kz];
+    Real Ax = A[kx] - Sx * Az, Ay = A[ky] - Sy * Az;
+    Real Bx = B[kx] - Sx * Bz, By = B[ky] - Sy * Bz;
+    Real Cx = C[kx] - Sx * Cz, Cy = C[ky] - Sy * Cz;
 
-    /////////////////// PLANE INTERSECTION ///////////////////
-    // Point *normal = getNormal(&a);
-    // double t = (normal->dot(&a) - normal->dot(ray->start)) / normal->dot(ray->dir);
-    // if (t < EPSILON)
-    //     return -1;
+    // scaled barycentric coordinates
+    Real U = Cx * By - Cy * Bx;
+    Real V = Ax * Cy - Ay * Cx;
+    Real W = Bx * Ay - By * Ax;
 
-    // Point *intersection = ray->getPoint(t);
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return -1;
 
-    // Point *edge1 = b.subtract(&a);
-    // Point *edge2 = c.subtract(&a);
+    Real det = U + V + W;
+    if (det == 0)
+        return -1;
 
-    // Point *C = intersection->subtract(&a);
+    Real T = Sz * (U * Az + V * Bz + W * Cz);
+    return T / det;
+}
 
-    // double dot11 = edge1->dot(edge1);
-    // double dot12 = edge1->dot(edge2);
-    // double dot22 = edge2->dot(edge2);
-    // double dot1c = edge1->dot(C);
-    // double dot2c = edge2->dot(C);
+/////////////////////////////// TRIANGLE ///////////////////////////////
 
-    // double invDenom = 1 / (dot11 * dot22 - dot12 * dot12);
-    // double u = (dot22 * dot1c - dot12 * dot2c) * invDenom;
-    // double v = (dot11 * dot2c - dot12 * dot1c) * invDenom;
+Triangle::Triangle(Point a, Point b, Point c)
+{
+    this->a = a;
+    this->b = b;
+    this->c = c;
+    size = max(max(fabs(b.x - a.x), fabs(c.x - a.x)), max(max(fabs(b.y - a.y), fabs(c.y - a.y)), max(fabs(b.z - a.z), fabs(c.z - a.z))));
+}
 
-    // delete normal, intersection, edge1, edge2, C;
+double Triangle::calcIntersection(Ray *ray)
+{
+    return intersectIn(this, ray);
+}
 
-    // if (u >= -EPSILON && v >= -EPSILON && u + v <= 1 + EPSILON)
-    //     return t;
+template <typename Real>
+Real Triangle::intersect(const RayT<Real> &ray)
+{
+    WatertightRay<Real> wray(ray);
+    Real t = wray.intersect(a, b, c);
+    if (t > -Tolerance<Real>::epsilon(size))
+        return t;
 
-    // return -1;
+    return -1;
 }
 
 Point *Triangle::getNormal(Point *p)
@@ -648,54 +1121,65 @@ Rect::Rect(Point corner1, Point corner2)
 
 double Rect::calcIntersection(Ray *ray)
 {
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Rect::intersect(const RayT<Real> &ray)
+{
+    STATS_COUNT(rectTests);
+    // the direction is a unit vector, only the hit distance depends on the size
+    const Real parallel = Tolerance<Real>::epsilon(1);
+    const Real epsilon = Tolerance<Real>::epsilon(max(fabs(corner2.x - corner1.x), max(fabs(corner2.y - corner1.y), fabs(corner2.z - corner1.z))));
+
     // first find out which plane the rectangle in parallel to
 
     // if the rectangle is parallel to XY plane
     if (corner1.z == corner2.z)
     {
         // if the ray is parallel to XY plane
-        if (ray->dir->z >= -EPSILON && ray->dir->z <= EPSILON)
+        if (ray.dir.z >= -parallel && ray.dir.z <= parallel)
             return -1;
 
         // if the ray is not parallel to XY plane
-        double t = (corner1.z - ray->start->z) / ray->dir->z;
-        if (t < -EPSILON)
+        Real t = ((Real)corner1.z - ray.start.z) / ray.dir.z;
+        if (t < -epsilon)
             return -1;
 
-        Point *intersection = ray->getPoint(t);
-        if (intersection->x >= corner1.x && intersection->x <= corner2.x && intersection->y >= corner1.y && intersection->y <= corner2.y)
+        Vec3<Real> intersection = ray.getPoint(t);
+        if (intersection.x >= corner1.x && intersection.x <= corner2.x && intersection.y >= corner1.y && intersection.y <= corner2.y)
             return t;
     }
     // if the rectangle is parallel to YZ plane
     else if (corner1.x == corner2.x)
     {
         // if the ray is parallel to YZ plane
-        if (ray->dir->x >= -EPSILON && ray->dir->x <= EPSILON)
+        if (ray.dir.x >= -parallel && ray.dir.x <= parallel)
             return -1;
 
         // if the ray is not parallel to YZ plane
-        double t = (corner1.x - ray->start->x) / ray->dir->x;
-        if (t < -EPSILON)
+        Real t = ((Real)corner1.x - ray.start.x) / ray.dir.x;
+        if (t < -epsilon)
             return -1;
 
-        Point *intersection = ray->getPoint(t);
-        if (intersection->z >= corner1.z && intersection->z <= corner2.z && intersection->y >= corner1.y && intersection->y <= corner2.y)
+        Vec3<Real> intersection = ray.getPoint(t);
+        if (intersection.z >= corner1.z && intersection.z <= corner2.z && intersection.y >= corner1.y && intersection.y <= corner2.y)
             return t;
     }
     // if the rectangle is parallel to XZ plane
     else if (corner1.y == corner2.y)
     {
         // if the ray is parallel to XZ plane
-        if (ray->dir->y >= -EPSILON && ray->dir->y <= EPSILON)
+        if (ray.dir.y >= -parallel && ray.dir.y <= parallel)
             return -1;
 
         // if the ray is not parallel to XZ plane
-        double t = (corner1.y - ray->start->y) / ray->dir->y;
-        if (t < -EPSILON)
+        Real t = ((Real)corner1.y - ray.start.y) / ray.dir.y;
+        if (t < -epsilon)
             return -1;
 
-        Point *intersection = ray->getPoint(t);
-        if (intersection->x >= corner1.x && intersection->x <= corner2.x && intersection->z >= corner1.z && intersection->z <= corner2.z)
+        Vec3<Real> intersection = ray.getPoint(t);
+        if (intersection.x >= corner1.x && intersection.x <= corner2.x && intersection.z >= corner1.z && intersection.z <= corner2.z)
             return t;
     }
 
@@ -705,12 +1189,106 @@ double Rect::calcIntersection(Ray *ray)
 
 /////////////////////////////// BOARD ///////////////////////////////
 
+void Board::drawGeometry()
+{
+    drawTiles(-tileCount / 2, tileCount / 2, -tileCount / 2, tileCount / 2);
+}
+
+Board::Board()
+{
+    checkerTexture = 0;
+}
+
+Board::~Board()
+{
+    if (checkerTexture != 0)
+        glDeleteTextures(1, &checkerTexture);
+}
+
+// one display list per chunk of CHUNK_TILES x CHUNK_TILES tiles, only the chunks in view are replayed
+// a chunk is a single quad with a repeating 2x2 checker texture, the software rasterizer is bound
+// by the number of primitives rather than by the pixels they cover
 void Board::draw()
+{
+    if (!retainedPreview)
+    {
+        drawGeometry();
+        return;
+    }
+
+    Frustum frustum;
+    frustum.fromGL();
+
+    if (checkerTexture == 0)
+    {
+        // texel (s, t) is white when s + t is even, like tile (i, j)
+        unsigned char texels[2 * 2 * 3] = {255, 255, 255, 0, 0, 0, 0, 0, 0, 255, 255, 255};
+        glGenTextures(1, &checkerTexture);
+        glBindTexture(GL_TEXTURE_2D, checkerTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2, 2, 0, GL_RGB, GL_UNSIGNED_BYTE, texels);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, checkerTexture);
+    glColor3f(1, 1, 1);
+    // the axes lie in the board plane, keep them in front of the big quads
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(1, 1);
+
+    int chunks = (tileCount + CHUNK_TILES - 1) / CHUNK_TILES;
+    if (chunkLists.size() != chunks * chunks)
+        chunkLists = vector<DisplayList>(chunks * chunks);
+
+    for (int ci = 0; ci < chunks; ci++)
+    {
+        int iBegin = -tileCount / 2 + ci * CHUNK_TILES, iEnd = min(iBegin + CHUNK_TILES, tileCount / 2);
+        for (int cj = 0; cj < chunks; cj++)
+        {
+            int jBegin = -tileCount / 2 + cj * CHUNK_TILES, jEnd = min(jBegin + CHUNK_TILES, tileCount / 2);
+            double lo[3] = {(double)iBegin * tileWidth, (double)jBegin * tileHeight, 0};
+            double hi[3] = {(double)iEnd * tileWidth, (double)jEnd * tileHeight, 0};
+            if (!frustum.intersectsBox(lo, hi))
+                continue;
+
+            DisplayList &list = chunkLists[ci * chunks + cj];
+            if (!list.ready())
+            {
+                list.begin();
+                drawChunk(iBegin, iEnd, jBegin, jEnd);
+                list.end();
+            }
+            list.call();
+        }
+    }
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_TEXTURE_2D);
+}
+
+// tile i covers texture coordinates [i / 2, (i + 1) / 2)
+void Board::drawChunk(int iBegin, int iEnd, int jBegin, int jEnd)
+{
+    glBegin(GL_QUADS);
+    glTexCoord2f(iBegin / 2.0f, jBegin / 2.0f);
+    glVertex3f(iBegin * tileWidth, jBegin * tileHeight, 0);
+    glTexCoord2f(iEnd / 2.0f, jBegin / 2.0f);
+    glVertex3f(iEnd * tileWidth, jBegin * tileHeight, 0);
+    glTexCoord2f(iEnd / 2.0f, jEnd / 2.0f);
+    glVertex3f(iEnd * tileWidth, jEnd * tileHeight, 0);
+    glTexCoord2f(iBegin / 2.0f, jEnd / 2.0f);
+    glVertex3f(iBegin * tileWidth, jEnd * tileHeight, 0);
+    glEnd();
+}
+
+void Board::drawTiles(int iBegin, int iEnd, int jBegin, int jEnd)
 {
     // draw in infinite checker board with given size and coeff
-    for (int i = -tileCount/2; i < tileCount/2; i++)
+    for (int i = iBegin; i < iEnd; i++)
     {
-        for (int j = -tileCount/2; j < tileCount/2; j++)
+        for (int j = jBegin; j < jEnd; j++)
         {
             if ((i + j) % 2 == 0)
                 glColor3f(1, 1, 1);
@@ -729,22 +1307,29 @@ void Board::draw()
 }
 
 double Board::handleIntersecttion(Ray *ray)
+{
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Board::intersect(const RayT<Real> &ray)
 {
     // check if the ray intersects with the board
     // board is on the XY plane
     // double t = Rect(Point(-tileCount/2 * width, -tileCount/2 * height, 0), Point(tileCount/2 * width, tileCount/2 * height, 0)).calcIntersection(ray);
     // return t;
 
-    Point *normal = new Point(0, 0, 1);
-    if (normal->dot(ray->dir) >= -EPSILON && normal->dot(ray->dir) <= EPSILON)
+    // the normal is (0, 0, 1)
+    const Real parallel = Tolerance<Real>::epsilon(1);
+    if (ray.dir.z >= -parallel && ray.dir.z <= parallel)
         return -1;
 
-    double t = (0 - ray->start->z) / ray->dir->z;
-    if (t < -EPSILON)
+    Real t = (0 - ray.start.z) / ray.dir.z;
+    if (t < -Tolerance<Real>::epsilon(tileWidth))
         return -1;
 
-    Point *intersection = ray->getPoint(t);
-    if (intersection->x >= -tileCount/2 * tileWidth && intersection->x <= tileCount/2 * tileWidth && intersection->y >= -tileCount/2 * tileHeight && intersection->y <= tileCount/2 * tileHeight)
+    Vec3<Real> intersection = ray.getPoint(t);
+    if (intersection.x >= -tileCount/2 * tileWidth && intersection.x <= tileCount/2 * tileWidth && intersection.y >= -tileCount/2 * tileHeight && intersection.y <= tileCount/2 * tileHeight)
         return t;
 
     return -1;
@@ -754,7 +1339,8 @@ Point *Board::getNormal(Point *p, Point *rayDir)
 {
     // check if the point is on the board
     // board is on the XY plane
-    if (p->z >= -EPSILON && p->z <= EPSILON)
+    double epsilon = surfaceEpsilon(p);
+    if (p->z >= -epsilon && p->z <= epsilon)
     {
         if (rayDir->z < EPSILON)
             return new Point(0, 0, -1);
@@ -780,34 +1366,24 @@ Color *Board::getColorAt(Point *p)
         return new Color(0, 0, 0);
 }
 
-Color *Board::getTextureAt(Point *p)
+Color Board::getTextureAt(Point *p, Point *rayDir, double t)
 {
-    if (!showTexture)
-        return NULL;
-
     int x = (int)floor((p->x) / tileWidth);
     int y = (int)floor((p->y) / tileHeight);
 
-    if ((x + y) % 2 == 0)
-    {
-        int cellX = ((p->x / tileWidth) - floor(p->x / tileWidth)) * (blackTileColorBuffer[0].size() - 1);
-        int cellY = ((p->y / tileHeight) - floor(p->y / tileHeight)) * (blackTileColorBuffer.size() - 1);
+    // width of the pixel cone where it meets the board, stretched at grazing angles
+    double pixelAngle = 2 * tan((fovY / 2) * (M_PI / 180)) / imageHeight;
+    double footprint = t * pixelAngle / max(fabs(rayDir->z), 0.05) / tileWidth;
 
-        assert(cellX >= 0 && cellX < blackTileColorBuffer[0].size());
-        assert(cellY >= 0 && cellY < blackTileColorBuffer.size());
+    // the texture buffers used to be indexed [cellY][cellX] while being filled [x][y],
+    // so the y coordinate on the tile runs along the image width
+    double u = (p->y / tileHeight) - floor(p->y / tileHeight);
+    double v = (p->x / tileWidth) - floor(p->x / tileWidth);
 
-        return blackTileColorBuffer[cellY][cellX]->copy();
-    }
+    if ((x + y) % 2 == 0)
+        return blackTileTexture.sample(u, v, footprint);
     else
-    {
-        int cellX = ((p->x / tileWidth) - floor(p->x / tileWidth)) * (whiteTileColorBuffer[0].size() - 1);
-        int cellY = ((p->y / tileHeight) - floor(p->y / tileHeight)) * (whiteTileColorBuffer.size() - 1);
-
-        assert(cellX >= 0 && cellX < whiteTileColorBuffer[0].size());
-        assert(cellY >= 0 && cellY < whiteTileColorBuffer.size());
-
-        return whiteTileColorBuffer[cellY][cellX]->copy();
-    }
+        return whiteTileTexture.sample(u, v, footprint);
 }
 
 /////////////////////////////// PYRAMID ///////////////////////////////
@@ -830,7 +1406,11 @@ void Pyramid::calculateAllSides()
 
     bottomRect = new Rect(*bottom1, *bottom3);
 
-    delete bottom1, bottom2, bottom3, bottom4, top;
+    delete bottom1;
+    delete bottom2;
+    delete bottom3;
+    delete bottom4;
+    delete top;
 }
 
 void drawTriangle()
@@ -844,7 +1424,7 @@ void drawTriangle()
     glPopMatrix();
 }
 
-void Pyramid::draw()
+void Pyramid::drawGeometry()
 {
     glPushMatrix();
     {
@@ -874,22 +1454,29 @@ void Pyramid::draw()
 }
 
 double Pyramid::handleIntersecttion(Ray *ray)
+{
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Pyramid::intersect(const RayT<Real> &ray)
 {
     calculateAllSides();
+    const Real epsilon = Tolerance<Real>::epsilon(max(width, height));
 
     // apply barrycentric coordinates
     // for each triangle, check if the ray intersects
-    double tMin = -1;
+    Real tMin = -1;
     for (Triangle *triangle : sideTriangles)
     {
-        double t = triangle->calcIntersection(ray);
-        if (t > -EPSILON && (tMin < 0 || t < tMin))
+        Real t = triangle->intersect(ray);
+        if (t > -epsilon && (tMin < 0 || t < tMin))
             tMin = t;
     }
 
     // check if the ray intersects with the bottom Rect
-    double t = bottomRect->calcIntersection(ray);
-    if (t > -EPSILON && (tMin < 0 || t < tMin)) {
+    Real t = bottomRect->intersect(ray);
+    if (t > -epsilon && (tMin < 0 || t < tMin)) {
         cout << "bottom rect" << endl;
         tMin = t;
     }
@@ -901,8 +1488,10 @@ Point *Pyramid::getNormal(Point *p, Point *rayDir)
 {
     calculateAllSides();
 
+    double epsilon = surfaceEpsilon(p);
+
     // check if the point is on the bottom Rect
-    if (p->z >= lowest.z - EPSILON && p->z <= lowest.z + EPSILON)
+    if (p->z >= lowest.z - epsilon && p->z <= lowest.z + epsilon)
         return new Point(0, 0, -1);
     /*&& p->x >= lowest.x - width / sqrt(2) && p->x <= lowest.x + width / sqrt(2) && p->y >= lowest.y - width / sqrt(2) && p->y <= lowest.y + width / sqrt(2)*/
 
@@ -913,7 +1502,7 @@ Point *Pyramid::getNormal(Point *p, Point *rayDir)
         Point *normal = triangle->getNormal(p);
         Point *pToA = p->subtract(&triangle->a);
         double dot = normal->dot(pToA);
-        if (dot >= -EPSILON && dot <= EPSILON)
+        if (dot >= -epsilon && dot <= epsilon)
         {
             if (normal->dot(rayDir) < EPSILON)
             {
@@ -924,7 +1513,8 @@ Point *Pyramid::getNormal(Point *p, Point *rayDir)
             return normal;
         }
 
-        delete normal, pToA;
+        delete normal;
+        delete pToA;
     }
 
     return NULL;
@@ -1016,9 +1606,13 @@ void Sphere::drawSide(int subdivision = 5)
         }
     }
     glEnd();
+
+    for (int i = 0; i < pointsPerRow; ++i)
+        delete[] points[i];
+    delete[] points;
 }
 
-void Sphere::draw()
+void Sphere::drawGeometry()
 {
     glPushMatrix();
     {
@@ -1043,22 +1637,32 @@ void Sphere::draw()
 // intersection calculation
 double Sphere::handleIntersecttion(Ray *ray)
 {
-    Point *centerToStart = ray->start->subtract(&center);
-    double a = 1; // ray->dir->dot(ray->dir)
-    double b = 2 * ray->dir->dot(centerToStart);
-    double c = centerToStart->dot(centerToStart) - radius * radius;
-    double discriminant = b * b - 4 * a * c;
-    if (discriminant < EPSILON)
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Sphere::intersect(const RayT<Real> &ray)
+{
+    // b and c are of the order of radius^2, t of the order of radius
+    const Real epsilon = Tolerance<Real>::epsilon(radius);
+    const Real discriminantEpsilon = Tolerance<Real>::epsilon(radius * radius);
+
+    Vec3<Real> centerToStart = ray.start - Vec3<Real>(center);
+    Real a = 1; // ray->dir->dot(ray->dir)
+    Real b = 2 * ray.dir.dot(centerToStart);
+    Real c = centerToStart.dot(centerToStart) - (Real)(radius * radius);
+    Real discriminant = b * b - 4 * a * c;
+    if (discriminant < discriminantEpsilon)
         return -1;
 
-    double t1 = (-b + sqrt(discriminant)) / (2 * a);
-    double t2 = (-b - sqrt(discriminant)) / (2 * a);
+    Real t1 = (-b + sqrt(discriminant)) / (2 * a);
+    Real t2 = (-b - sqrt(discriminant)) / (2 * a);
 
-    if (t1 < EPSILON && t2 < EPSILON)
+    if (t1 < epsilon && t2 < epsilon)
         return -1;
-    else if (t1 < EPSILON)
+    else if (t1 < epsilon)
         return t2;
-    else if (t2 < EPSILON)
+    else if (t2 < epsilon)
         return t1;
     else
         return min(t1, t2);
@@ -1069,7 +1673,8 @@ Point *Sphere::getNormal(Point *p, Point *rayDir)
     // check if the point is on the sphere
     Point *centerToP = p->subtract(&center);
     double dif = centerToP->magnitude() - radius;
-    if (dif >= -EPSILON && dif <= EPSILON)
+    double epsilon = surfaceEpsilon(p);
+    if (dif >= -epsilon && dif <= epsilon)
     {
         centerToP->normalize();
         if (centerToP->dot(rayDir) < EPSILON)
@@ -1082,7 +1687,7 @@ Point *Sphere::getNormal(Point *p, Point *rayDir)
 
 /////////////////////////////// CUBE ///////////////////////////////
 
-void Cube::draw()
+void Cube::drawGeometry()
 {
     glPushMatrix();
     // {
@@ -1134,25 +1739,30 @@ void Cube::draw()
 }
 
 double Cube::handleIntersecttion(Ray *ray)
+{
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Cube::intersect(const RayT<Real> &ray)
 {
     // divide the cube in 6 rectangles
-    vector<Rect *> rects;
-    rects.push_back(new Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z)));
-    rects.push_back(new Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x, bottomLeftFront.y + side, bottomLeftFront.z + side)));
-    rects.push_back(new Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y, bottomLeftFront.z + side)));
-    rects.push_back(new Rect(Point(bottomLeftFront.x + side, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side)));
-    rects.push_back(new Rect(Point(bottomLeftFront.x, bottomLeftFront.y + side, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side)));
-    rects.push_back(new Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z + side), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side)));
+    Rect rects[] = {
+        Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z)),
+        Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x, bottomLeftFront.y + side, bottomLeftFront.z + side)),
+        Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y, bottomLeftFront.z + side)),
+        Rect(Point(bottomLeftFront.x + side, bottomLeftFront.y, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side)),
+        Rect(Point(bottomLeftFront.x, bottomLeftFront.y + side, bottomLeftFront.z), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side)),
+        Rect(Point(bottomLeftFront.x, bottomLeftFront.y, bottomLeftFront.z + side), Point(bottomLeftFront.x + side, bottomLeftFront.y + side, bottomLeftFront.z + side))};
+    const Real epsilon = Tolerance<Real>::epsilon(side);
 
     // for each rectangle, check if the ray intersects
-    double tMin = -1;
-    for (Rect *rect : rects)
+    Real tMin = -1;
+    for (Rect &rect : rects)
     {
-        double t = rect->calcIntersection(ray);
-        if (t > -EPSILON && (tMin < 0 || t < tMin))
+        Real t = rect.intersect(ray);
+        if (t > -epsilon && (tMin < 0 || t < tMin))
             tMin = t;
-
-        delete rect;
     }
 
     return tMin;
@@ -1161,24 +1771,25 @@ double Cube::handleIntersecttion(Ray *ray)
 Point *Cube::getNormal(Point *p, Point *rayDir)
 {
     Point *normal = NULL;
+    double epsilon = surfaceEpsilon(p);
     // check which face the point is on
     // if the point is on the bottom face
-    if (bottomLeftFront.z - EPSILON <= p->z && p->z <= bottomLeftFront.z + EPSILON)
+    if (bottomLeftFront.z - epsilon <= p->z && p->z <= bottomLeftFront.z + epsilon)
         normal = new Point(0, 0, -1);
     // if the point is on the top face
-    else if (bottomLeftFront.z + side - EPSILON <= p->z && p->z <= bottomLeftFront.z + side + EPSILON)
+    else if (bottomLeftFront.z + side - epsilon <= p->z && p->z <= bottomLeftFront.z + side + epsilon)
         normal = new Point(0, 0, 1);
     // if the point is on the left face
-    else if (bottomLeftFront.x - EPSILON <= p->x && p->x <= bottomLeftFront.x + EPSILON)
+    else if (bottomLeftFront.x - epsilon <= p->x && p->x <= bottomLeftFront.x + epsilon)
         normal = new Point(-1, 0, 0);
     // if the point is on the right face
-    else if (bottomLeftFront.x + side - EPSILON <= p->x && p->x <= bottomLeftFront.x + side + EPSILON)
+    else if (bottomLeftFront.x + side - epsilon <= p->x && p->x <= bottomLeftFront.x + side + epsilon)
         normal = new Point(1, 0, 0);
     // if the point is on the back face
-    else if (bottomLeftFront.y - EPSILON <= p->y && p->y <= bottomLeftFront.y + EPSILON)
+    else if (bottomLeftFront.y - epsilon <= p->y && p->y <= bottomLeftFront.y + epsilon)
         normal = new Point(0, -1, 0);
     // if the point is on the front face
-    else if (bottomLeftFront.y + side - EPSILON <= p->y && p->y <= bottomLeftFront.y + side + EPSILON)
+    else if (bottomLeftFront.y + side - epsilon <= p->y && p->y <= bottomLeftFront.y + side + epsilon)
         normal = new Point(0, 1, 0);
 
     // check if the normal is pointing towards the ray
@@ -1188,12 +1799,983 @@ Point *Cube::getNormal(Point *p, Point *rayDir)
     return normal;
 }
 
+/////////////////////////////// MESH ///////////////////////////////
+
+Mesh::Mesh()
+{
+    scale = 1;
+}
+
+// reads v and f records, polygons are split into triangle fans
+boolean Mesh::load()
+{
+    PROFILE_SCOPE("mesh load");
+    auto begin = chrono::steady_clock::now();
+
+    uint64_t key = cacheKey();
+    if (useMeshCache && loadCache(key))
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        cout << "mesh: " << fileName << " - " << vertices.size() << " vertices, " << triangleCount() << " triangles, "
+             << bvhText() << ", mapped from " << cachePath(key) << " in " << seconds << "s" << endl;
+        return true;
+    }
+
+    ifstream input(fileName);
+    if (!input)
+    {
+        cout << "mesh: could not open " << fileName << endl;
+        return false;
+    }
+
+    vertices.clear();
+    indices.clear();
+
+    string line;
+    vector<int> face;
+    while (getline(input, line))
+    {
+        if (line.size() < 2)
+            continue;
+
+        if (line[0] == 'v' && line[1] == ' ')
+        {
+            Point v;
+            char *cursor = &line[2];
+            v.x = strtod(cursor, &cursor);
+            v.y = strtod(cursor, &cursor);
+            v.z = strtod(cursor, &cursor);
+            vertices.push_back(Point(offset.x + v.x * scale, offset.y + v.y * scale, offset.z + v.z * scale));
+        }
+        else if (line[0] == 'f' && line[1] == ' ')
+        {
+            face.clear();
+            stringstream ss(line.substr(2));
+            string token;
+            while (ss >> token)
+            {
+                // only the vertex index of v/vt/vn is used, negative indices count from the end
+                int index = atoi(token.c_str());
+                face.push_back(index < 0 ? vertices.size() + index : index - 1);
+            }
+
+            for (int i = 1; i + 1 < face.size(); i++)
+            {
+                indices.push_back(face[0]);
+                indices.push_back(face[i]);
+                indices.push_back(face[i + 1]);
+            }
+        }
+    }
+    input.close();
+
+    for (int index : indices)
+    {
+        if (index < 0 || index >= vertices.size())
+        {
+            cout << "mesh: " << fileName << " has a face with an invalid vertex index" << endl;
+            return false;
+        }
+    }
+
+    buildBvh();
+    string binaryText = bvhText();
+    if (bvhLayout == WIDE_BVH && !buildWide())
+        cout << "mesh: " << fileName << " has a leaf too large for the wide bvh, keeping the binary one" << endl;
+    if (useMeshCache)
+        saveCache(key);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << "mesh: " << fileName << " - " << vertices.size() << " vertices, " << triangleCount() << " triangles, "
+         << (wideNodes.empty() ? binaryText : binaryText + " collapsed to " + bvhText()) << ", loaded in " << seconds << "s" << endl;
+    return true;
+}
+
+// the entry in the description holds the file name, offset, scale and material; the layout picks
+// which of the two trees the file holds
+uint64_t Mesh::cacheKey()
+{
+    return hashText(string(MESH_CACHE_MAGIC) + "\n" + bvhLayoutName() + "\n" + source + "\n" + fileStamp(fileName));
+}
+
+boolean Mesh::loadCache(uint64_t key)
+{
+    shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(cachePath(key)) || file->size < sizeof(MeshCacheHeader))
+        return false;
+
+    MeshCacheHeader header;
+    memcpy(&header, file->bytes, sizeof(header));
+    uint64_t elementSizes[MeshCacheHeader::ARRAYS] = {sizeof(Point), sizeof(int), sizeof(Point), sizeof(Point), sizeof(MeshNode),
+                                                      sizeof(WideNode)};
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.key != key)
+        return false;
+    for (int k = 0; k < MeshCacheHeader::ARRAYS; k++)
+    {
+        if (header.elementSizes[k] != elementSizes[k] || header.offsets[k] > file->size ||
+            header.counts[k] > (file->size - header.offsets[k]) / elementSizes[k])
+        {
+            cout << "mesh: " << cachePath(key) << " is damaged, rebuilding" << endl;
+            return false;
+        }
+    }
+
+    vertices.map((Point *)(file->bytes + header.offsets[0]), header.counts[0]);
+    indices.map((int *)(file->bytes + header.offsets[1]), header.counts[1]);
+    edges.map((Point *)(file->bytes + header.offsets[2]), header.counts[2]);
+    normals.map((Point *)(file->bytes + header.offsets[3]), header.counts[3]);
+    nodes.map((MeshNode *)(file->bytes + header.offsets[4]), header.counts[4]);
+    wideNodes.map((WideNode *)(file->bytes + header.offsets[5]), header.counts[5]);
+    cacheFile = file;
+    return true;
+}
+
+// written next to its final name and renamed, so a crash never leaves half a cache file
+void Mesh::saveCache(uint64_t key)
+{
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.key = key;
+
+    const char *arrays[MeshCacheHeader::ARRAYS] = {(char *)vertices.data(), (char *)indices.data(), (char *)edges.data(),
+                                                   (char *)normals.data(), (char *)nodes.data(), (char *)wideNodes.data()};
+    uint64_t elementSizes[MeshCacheHeader::ARRAYS] = {sizeof(Point), sizeof(int), sizeof(Point), sizeof(Point), sizeof(MeshNode),
+                                                      sizeof(WideNode)};
+    uint64_t counts[MeshCacheHeader::ARRAYS] = {vertices.size(), indices.size(), edges.size(), normals.size(), nodes.size(),
+                                               wideNodes.size()};
+    uint64_t offset = sizeof(header);
+    for (int k = 0; k < MeshCacheHeader::ARRAYS; k++)
+    {
+        offset = (offset + 63) & ~(uint64_t)63;
+        header.elementSizes[k] = elementSizes[k];
+        header.counts[k] = counts[k];
+        header.offsets[k] = offset;
+        offset += counts[k] * elementSizes[k];
+    }
+
+    makeCacheDirectory();
+    string path = cachePath(key), temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == NULL)
+        return;
+
+    boolean written = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t position = sizeof(header);
+    char padding[64] = {0};
+    for (int k = 0; k < MeshCacheHeader::ARRAYS && written; k++)
+    {
+        written = fwrite(padding, 1, header.offsets[k] - position, file) == header.offsets[k] - position;
+        size_t bytes = counts[k] * elementSizes[k];
+        written = written && (bytes == 0 || fwrite(arrays[k], 1, bytes, file) == bytes);
+        position = header.offsets[k] + bytes;
+    }
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        cout << "mesh: could not write " << path << endl;
+        remove(temporary.c_str());
+    }
+}
+
+// offset + v * scale -> offset' + v * scale' is an affine map with a positive factor,
+// so the vertices, edges and binary node boxes map exactly and the tree stays valid
+void Mesh::refit(Mesh *old)
+{
+    PROFILE_SCOPE("bvh refit");
+    vertices.swap(old->vertices);
+    indices.swap(old->indices);
+    edges.swap(old->edges);
+    normals.swap(old->normals);
+    nodes.swap(old->nodes);
+    wideNodes.swap(old->wideNodes);
+    cacheFile.swap(old->cacheFile);
+
+    double k = scale / old->scale;
+    double from[3] = {old->offset.x, old->offset.y, old->offset.z};
+    double to[3] = {offset.x, offset.y, offset.z};
+    if (k == 1 && from[0] == to[0] && from[1] == to[1] && from[2] == to[2])
+        return;
+
+    for (Point &v : vertices)
+    {
+        v.x = to[0] + (v.x - from[0]) * k;
+        v.y = to[1] + (v.y - from[1]) * k;
+        v.z = to[2] + (v.z - from[2]) * k;
+    }
+    for (Point &e : edges)
+    {
+        e.x *= k;
+        e.y *= k;
+        e.z *= k;
+    }
+    for (MeshNode &node : nodes)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            node.lo[a] = to[a] + (node.lo[a] - from[a]) * k;
+            node.hi[a] = to[a] + (node.hi[a] - from[a]) * k;
+        }
+    }
+
+    // the quantized boxes do not map exactly, they are rebuilt bottom up instead
+    if (!wideNodes.empty())
+    {
+        double lo[3], hi[3];
+        refitWide(0, lo, hi);
+    }
+}
+
+// collapses the binary tree, then frees it
+boolean Mesh::buildWide()
+{
+    PROFILE_SCOPE("bvh collapse");
+    vector<WideNode> built;
+    built.reserve(nodes.size() / 2 + 1);
+    if (nodes.empty() || collapseNode(0, built) < 0)
+        return false;
+
+    wideNodes.swap(built);
+    MeshArray<MeshNode>().swap(nodes);
+    return true;
+}
+
+// a wide node takes the children of its widest inner child until it has 4, returns -1 if a leaf
+// is too large for the encoding
+int Mesh::collapseNode(int index, vector<WideNode> &built)
+{
+    auto area = [](MeshNode &node) {
+        double dx = node.hi[0] - node.lo[0], dy = node.hi[1] - node.lo[1], dz = node.hi[2] - node.lo[2];
+        return dx * dy + dy * dz + dz * dx;
+    };
+
+    int slots[WideNode::WIDTH] = {index};
+    int used = 1;
+    while (used < WideNode::WIDTH)
+    {
+        int widest = -1;
+        for (int k = 0; k < used; k++)
+            if (nodes[slots[k]].count == 0 && (widest < 0 || area(nodes[slots[k]]) > area(nodes[slots[widest]])))
+                widest = k;
+        if (widest < 0)
+            break;
+
+        int inner = slots[widest];
+        slots[widest] = inner + 1;
+        slots[used++] = nodes[inner].start;
+    }
+
+    int position = built.size();
+    built.push_back(WideNode());
+
+    WideNode node;
+    node.setGrid(nodes[index].lo, nodes[index].hi);
+    for (int k = 0; k < WideNode::WIDTH; k++)
+    {
+        if (k >= used)
+        {
+            node.clearChild(k);
+            continue;
+        }
+
+        MeshNode &child = nodes[slots[k]];
+        node.setChild(k, child.lo, child.hi);
+        if (child.count > 0)
+        {
+            if (child.count > 127 || child.start >= WideNode::MAX_LEAF_START)
+                return -1;
+            node.child[k] = WideNode::LEAF | (uint32_t)child.count << 24 | child.start;
+        }
+        else
+        {
+            int collapsed = collapseNode(slots[k], built);
+            if (collapsed < 0)
+                return -1;
+            node.child[k] = collapsed;
+        }
+    }
+    built[position] = node;
+    return position;
+}
+
+// recomputes the box of a child from its triangles and quantizes the nodes below it again
+void Mesh::refitWide(uint32_t child, double *lo, double *hi)
+{
+    for (int a = 0; a < 3; a++)
+        lo[a] = INFINITY, hi[a] = -INFINITY;
+
+    if (WideNode::isLeaf(child))
+    {
+        int start = WideNode::leafStart(child);
+        for (int i = 3 * start; i < 3 * (start + WideNode::leafCount(child)); i++)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = min(lo[a], axisOf(vertices[indices[i]], a));
+                hi[a] = max(hi[a], axisOf(vertices[indices[i]], a));
+            }
+        }
+        return;
+    }
+
+    WideNode &node = wideNodes[child];
+    double childLo[WideNode::WIDTH][3], childHi[WideNode::WIDTH][3];
+    for (int k = 0; k < WideNode::WIDTH; k++)
+    {
+        if (node.child[k] == WideNode::EMPTY)
+            continue;
+        refitWide(node.child[k], childLo[k], childHi[k]);
+        for (int a = 0; a < 3; a++)
+            lo[a] = min(lo[a], childLo[k][a]), hi[a] = max(hi[a], childHi[k][a]);
+    }
+
+    node.setGrid(lo, hi);
+    for (int k = 0; k < WideNode::WIDTH; k++)
+        if (node.child[k] != WideNode::EMPTY)
+            node.setChild(k, childLo[k], childHi[k]);
+}
+
+// largest extent of the root, scales the float tolerance
+double Mesh::wideExtent()
+{
+    WideNode &root = wideNodes[0];
+    double extent = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        float lo = INFINITY, hi = -INFINITY;
+        for (int k = 0; k < WideNode::WIDTH; k++)
+        {
+            if (root.child[k] == WideNode::EMPTY)
+                continue;
+            lo = min(lo, root.decode(a, root.lo[a][k]));
+            hi = max(hi, root.decode(a, root.hi[a][k]));
+        }
+        extent = max(extent, (double)hi - lo);
+    }
+    return extent;
+}
+
+string Mesh::bvhText()
+{
+    stringstream text;
+    if (wideNodes.empty())
+        text << nodes.size() << " bvh nodes (" << fixed << setprecision(1) << nodes.size() * sizeof(MeshNode) / 1048576.0 << " MB)";
+    else
+        text << wideNodes.size() << " wide bvh nodes (" << fixed << setprecision(1) << wideNodes.size() * sizeof(WideNode) / 1048576.0 << " MB)";
+    return text.str();
+}
+
+void Mesh::buildBvh()
+{
+    PROFILE_SCOPE("bvh build");
+    int count = triangleCount();
+
+    vector<int> order(count);
+    vector<Point> centroids(count);
+    for (int i = 0; i < count; i++)
+    {
+        Point &a = vertices[indices[3 * i]], &b = vertices[indices[3 * i + 1]], &c = vertices[indices[3 * i + 2]];
+        order[i] = i;
+        centroids[i] = Point((a.x + b.x + c.x) / 3, (a.y + b.y + c.y) / 3, (a.z + b.z + c.z) / 3);
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * count / LEAF_SIZE + 1);
+    if (count > 0)
+        buildNode(order, centroids, 0, count, 0);
+
+    // store the triangles in leaf order so every leaf is a contiguous range
+    vector<int> sortedIndices(indices.size());
+    edges.resize(2 * count);
+    normals.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        for (int k = 0; k < 3; k++)
+            sortedIndices[3 * i + k] = indices[3 * order[i] + k];
+
+        Point &a = vertices[sortedIndices[3 * i]], &b = vertices[sortedIndices[3 * i + 1]], &c = vertices[sortedIndices[3 * i + 2]];
+        edges[2 * i] = Point(b.x - a.x, b.y - a.y, b.z - a.z);
+        edges[2 * i + 1] = Point(c.x - a.x, c.y - a.y, c.z - a.z);
+
+        Point *normal = edges[2 * i].cross(&edges[2 * i + 1]);
+        if (normal->magnitude() > 0)
+            normal->normalize();
+        normals[i] = *normal;
+        delete normal;
+    }
+    indices.swap(sortedIndices);
+}
+
+// splits with a binned surface area heuristic along the widest centroid axis
+int Mesh::buildNode(vector<int> &order, vector<Point> &centroids, int begin, int end, int depth)
+{
+    const int BINS = 16;
+
+    int index = nodes.size();
+    nodes.push_back(MeshNode());
+
+    MeshNode node;
+    double centroidLo[3] = {INFINITY, INFINITY, INFINITY}, centroidHi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int k = 0; k < 3; k++)
+        node.lo[k] = INFINITY, node.hi[k] = -INFINITY;
+
+    for (int i = begin; i < end; i++)
+    {
+        for (int v = 0; v < 3; v++)
+        {
+            Point &p = vertices[indices[3 * order[i] + v]];
+            for (int k = 0; k < 3; k++)
+            {
+                node.lo[k] = min(node.lo[k], axisOf(p, k));
+                node.hi[k] = max(node.hi[k], axisOf(p, k));
+            }
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            centroidLo[k] = min(centroidLo[k], axisOf(centroids[order[i]], k));
+            centroidHi[k] = max(centroidHi[k], axisOf(centroids[order[i]], k));
+        }
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+        if (centroidHi[k] - centroidLo[k] > centroidHi[axis] - centroidLo[axis])
+            axis = k;
+
+    node.start = begin;
+    node.count = end - begin;
+    node.axis = axis;
+
+    double extent = centroidHi[axis] - centroidLo[axis];
+    if (end - begin <= LEAF_SIZE || extent <= 0 || depth == MAX_DEPTH)
+    {
+        nodes[index] = node;
+        return index;
+    }
+
+    // bin the triangles by centroid
+    int binCount[BINS] = {0};
+    double binLo[BINS][3], binHi[BINS][3];
+    for (int b = 0; b < BINS; b++)
+        for (int k = 0; k < 3; k++)
+            binLo[b][k] = INFINITY, binHi[b][k] = -INFINITY;
+
+    auto binOf = [&](int triangle) {
+        int b = (int)(BINS * (axisOf(centroids[triangle], axis) - centroidLo[axis]) / extent);
+        return min(b, BINS - 1);
+    };
+
+    for (int i = begin; i < end; i++)
+    {
+        int b = binOf(order[i]);
+        binCount[b]++;
+        for (int v = 0; v < 3; v++)
+        {
+            Point &p = vertices[indices[3 * order[i] + v]];
+            for (int k = 0; k < 3; k++)
+            {
+                binLo[b][k] = min(binLo[b][k], axisOf(p, k));
+                binHi[b][k] = max(binHi[b][k], axisOf(p, k));
+            }
+        }
+    }
+
+    auto area = [](double *lo, double *hi) {
+        double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return dx < 0 ? 0 : 2 * (dx * dy + dy * dz + dz * dx);
+    };
+
+    // sweep from the right to get the cost of every split plane
+    double rightArea[BINS];
+    int rightCount[BINS];
+    double lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int n = 0;
+    for (int b = BINS - 1; b > 0; b--)
+    {
+        n += binCount[b];
+        for (int k = 0; k < 3; k++)
+            lo[k] = min(lo[k], binLo[b][k]), hi[k] = max(hi[k], binHi[b][k]);
+        rightArea[b] = area(lo, hi);
+        rightCount[b] = n;
+    }
+
+    int bestSplit = -1;
+    double bestCost = INFINITY;
+    for (int k = 0; k < 3; k++)
+        lo[k] = INFINITY, hi[k] = -INFINITY;
+    n = 0;
+    for (int b = 0; b < BINS - 1; b++)
+    {
+        n += binCount[b];
+        for (int k = 0; k < 3; k++)
+            lo[k] = min(lo[k], binLo[b][k]), hi[k] = max(hi[k], binHi[b][k]);
+        if (n == 0 || rightCount[b + 1] == 0)
+            continue;
+
+        double cost = area(lo, hi) * n + rightArea[b + 1] * rightCount[b + 1];
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestSplit = b + 1;
+        }
+    }
+
+    int mid;
+    if (bestSplit < 0)
+    {
+        // everything fell in one bin, split at the median instead
+        mid = (begin + end) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int l, int r) {
+            return axisOf(centroids[l], axis) < axisOf(centroids[r], axis);
+        });
+    }
+    else
+    {
+        mid = partition(order.begin() + begin, order.begin() + end, [&](int triangle) {
+                  return binOf(triangle) < bestSplit;
+              }) - order.begin();
+    }
+
+    buildNode(order, centroids, begin, mid, depth + 1);
+    node.start = buildNode(order, centroids, mid, end, depth + 1);
+    node.count = 0;
+    nodes[index] = node;
+    return index;
+}
+
+template <typename Real>
+boolean Mesh::hitsBox(MeshNode &node, const RayT<Real> &ray, Real *invDir, Real tMax)
+{
+    Real tNear = 0, tFar = tMax;
+    for (int k = 0; k < 3; k++)
+    {
+        Real start = ray.start[k];
+        Real t1 = ((Real)node.lo[k] - start) * invDir[k];
+        Real t2 = ((Real)node.hi[k] - start) * invDir[k];
+        if (t1 > t2)
+            swap(t1, t2);
+        tNear = max(tNear, t1);
+        tFar = min(tFar, t2);
+        if (tNear > tFar)
+            return false;
+    }
+    return true;
+}
+
+void Mesh::drawGeometry()
+{
+    glColor3f(color.r, color.g, color.b);
+    glBegin(GL_TRIANGLES);
+    for (int i = 0; i < indices.size(); i++)
+    {
+        Point &v = vertices[indices[i]];
+        glVertex3f(v.x, v.y, v.z);
+    }
+    glEnd();
+}
+
+double Mesh::handleIntersecttion(Ray *ray)
+{
+    return intersectIn(this, ray);
+}
+
+template <typename Real>
+Real Mesh::intersect(const RayT<Real> &ray)
+{
+    if (!wideNodes.empty())
+        return intersectWide(ray);
+    if (nodes.empty())
+        return -1;
+
+    MeshNode &root = nodes[0];
+    const Real epsilon = Tolerance<Real>::epsilon(max(root.hi[0] - root.lo[0], max(root.hi[1] - root.lo[1], root.hi[2] - root.lo[2])));
+
+    WatertightRay<Real> wray(ray);
+    Real invDir[3] = {Real(1) / ray.dir.x, Real(1) / ray.dir.y, Real(1) / ray.dir.z};
+
+    Real tMin = -1;
+    int hitTriangle = -1;
+    int stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        int index = stack[--top];
+        MeshNode &node = nodes[index];
+        if (!hitsBox(node, ray, invDir, tMin < 0 ? (Real)INFINITY : tMin))
+            continue;
+
+        if (node.count > 0)
+        {
+            for (int i = node.start; i < node.start + node.count; i++)
+            {
+                Real t = wray.intersect(vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+                if (t > epsilon && (tMin < 0 || t < tMin))
+                    tMin = t, hitTriangle = i;
+            }
+            continue;
+        }
+
+        // visit the child on the near side of the split first
+        int left = index + 1, right = node.start;
+        if (ray.dir[node.axis] < 0)
+        {
+            stack[top++] = left;
+            stack[top++] = right;
+        }
+        else
+        {
+            stack[top++] = right;
+            stack[top++] = left;
+        }
+    }
+
+    if (hitTriangle >= 0)
+        recentMeshHits.add(this, hitTriangle);
+    return tMin;
+}
+
+// same hits as the binary traversal: the boxes are only ever larger and the triangle test is the same
+template <typename Real>
+Real Mesh::intersectWide(const RayT<Real> &ray)
+{
+    const Real epsilon = Tolerance<Real>::epsilon(wideExtent());
+
+    WatertightRay<Real> wray(ray);
+    WideRay wideRay(ray);
+
+    class Entry
+    {
+    public:
+        uint32_t child;
+        float tNear;
+    };
+
+    Real tMin = -1;
+    int hitTriangle = -1;
+    Entry stack[WIDE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = {0, 0};
+
+    while (top > 0)
+    {
+        Entry entry = stack[--top];
+        float tMax = tMin < 0 ? INFINITY : (float)tMin;
+        if (entry.tNear > tMax * WIDE_BVH_GROW)
+            continue;
+
+        if (WideNode::isLeaf(entry.child))
+        {
+            int start = WideNode::leafStart(entry.child);
+            for (int i = start; i < start + WideNode::leafCount(entry.child); i++)
+            {
+                Real t = wray.intersect(vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+                if (t > epsilon && (tMin < 0 || t < tMin))
+                    tMin = t, hitTriangle = i;
+            }
+            continue;
+        }
+
+        WideNode &node = wideNodes[entry.child];
+        float tNear[4];
+        int mask = hitChildren(node, wideRay, tMax, tNear);
+
+        // push far to near, so the nearest child is visited first
+        Entry hits[4];
+        int count = 0;
+        for (int k = 0; k < WideNode::WIDTH; k++)
+        {
+            if (!(mask >> k & 1) || node.child[k] == WideNode::EMPTY)
+                continue;
+            int j = count++;
+            for (; j > 0 && hits[j - 1].tNear < tNear[k]; j--)
+                hits[j] = hits[j - 1];
+            hits[j] = {node.child[k], tNear[k]};
+        }
+        for (int j = 0; j < count; j++)
+            stack[top++] = hits[j];
+    }
+
+    if (hitTriangle >= 0)
+        recentMeshHits.add(this, hitTriangle);
+    return tMin;
+}
+
+// the triangle of a recent hit on this thread that p lies on, the hit p came from; otherwise,
+// when too many rays hit meshes in between, the triangle whose plane passes closest to p
+Point *Mesh::getNormal(Point *p, Point *rayDir)
+{
+    if (nodes.empty() && wideNodes.empty())
+        return NULL;
+
+    double extent;
+    if (wideNodes.empty())
+    {
+        MeshNode &root = nodes[0];
+        extent = max(root.hi[0] - root.lo[0], max(root.hi[1] - root.lo[1], root.hi[2] - root.lo[2]));
+    }
+    else
+        extent = wideExtent();
+    double tolerance = 1e-6 * extent + surfaceEpsilon(p);
+
+    int best = -1;
+    double bestDistance = tolerance;
+    for (int k = 0; k < MeshHits::SIZE && best < 0; k++)
+        if (recentMeshHits.mesh[k] == this)
+            closerTriangle(p, recentMeshHits.triangle[k], best, bestDistance);
+    if (best < 0)
+        best = wideNodes.empty() ? nearestTriangle(p, tolerance) : nearestTriangleWide(p, tolerance);
+    if (best < 0)
+        return NULL;
+
+    Point *normal = normals[best].copy();
+    if (normal->dot(rayDir) < EPSILON)
+    {
+        Point *flipped = normal->multiply(-1);
+        delete normal;
+        return flipped;
+    }
+    return normal;
+}
+
+int Mesh::nearestTriangle(Point *p, double tolerance)
+{
+    int best = -1;
+    double bestDistance = INFINITY;
+    int stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        int index = stack[--top];
+        MeshNode &node = nodes[index];
+
+        boolean inside = true;
+        for (int k = 0; k < 3; k++)
+            if (axisOf(*p, k) < node.lo[k] - tolerance || axisOf(*p, k) > node.hi[k] + tolerance)
+                inside = false;
+        if (!inside)
+            continue;
+
+        if (node.count == 0)
+        {
+            stack[top++] = index + 1;
+            stack[top++] = node.start;
+            continue;
+        }
+
+        for (int i = node.start; i < node.start + node.count; i++)
+            closerTriangle(p, i, best, bestDistance);
+    }
+    return best;
+}
+
+int Mesh::nearestTriangleWide(Point *p, double tolerance)
+{
+    int best = -1;
+    double bestDistance = INFINITY;
+    uint32_t stack[WIDE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        uint32_t child = stack[--top];
+        if (WideNode::isLeaf(child))
+        {
+            int start = WideNode::leafStart(child);
+            for (int i = start; i < start + WideNode::leafCount(child); i++)
+                closerTriangle(p, i, best, bestDistance);
+            continue;
+        }
+
+        WideNode &node = wideNodes[child];
+        for (int k = 0; k < WideNode::WIDTH; k++)
+        {
+            if (node.child[k] == WideNode::EMPTY)
+                continue;
+
+            boolean inside = true;
+            for (int a = 0; a < 3; a++)
+                if (axisOf(*p, a) < node.decode(a, node.lo[a][k]) - tolerance || axisOf(*p, a) > node.decode(a, node.hi[a][k]) + tolerance)
+                    inside = false;
+            if (inside)
+                stack[top++] = node.child[k];
+        }
+    }
+    return best;
+}
+
+void Mesh::closerTriangle(Point *p, int i, int &best, double &bestDistance)
+{
+    Point &a = vertices[indices[3 * i]];
+    Point ap(p->x - a.x, p->y - a.y, p->z - a.z);
+    double distance = fabs(normals[i].dot(&ap));
+    if (distance >= bestDistance)
+        return;
+
+    // barycentric coordinates from the precomputed edges
+    Point &e1 = edges[2 * i], &e2 = edges[2 * i + 1];
+    double d11 = e1.dot(&e1), d12 = e1.dot(&e2), d22 = e2.dot(&e2);
+    double d1p = e1.dot(&ap), d2p = e2.dot(&ap);
+    double denom = d11 * d22 - d12 * d12;
+    if (denom == 0)
+        return;
+    double u = (d22 * d1p - d12 * d2p) / denom;
+    double v = (d11 * d2p - d12 * d1p) / denom;
+    if (u < -1e-6 || v < -1e-6 || u + v > 1 + 1e-6)
+        return;
+
+    best = i;
+    bestDistance = distance;
+}
+
+/////////////////////////////// INSTANCE ///////////////////////////////
+
+// assets by name, held by their instances and freed with the last of them
+map<string, weak_ptr<Object>> instanceAssets;
+
+// sphere, cube and pyramid are the unit shapes (radius 1 at the origin, side 1 from the origin,
+// width and height 1 from the origin), any other name is an OBJ file; NULL if it does not load
+shared_ptr<Object> instanceAsset(const string &name)
+{
+    shared_ptr<Object> asset = instanceAssets[name].lock();
+    if (asset)
+        return asset;
+
+    if (name == "sphere")
+    {
+        Sphere *sphere = new Sphere();
+        sphere->radius = 1;
+        asset.reset(sphere);
+    }
+    else if (name == "cube")
+    {
+        Cube *cube = new Cube();
+        cube->side = 1;
+        asset.reset(cube);
+    }
+    else if (name == "pyramid")
+    {
+        Pyramid *pyramid = new Pyramid();
+        pyramid->width = 1;
+        pyramid->height = 1;
+        pyramid->calculateAllSides();
+        asset.reset(pyramid);
+    }
+    else
+    {
+        Mesh *mesh = new Mesh();
+        mesh->fileName = name;
+        mesh->source = "instance asset " + name;
+        if (!mesh->load())
+        {
+            delete mesh;
+            return NULL;
+        }
+        asset.reset(mesh);
+    }
+
+    asset->objectType = name;
+    asset->id = -1; // not in objects
+    asset->color = Color(0.8, 0.8, 0.8); // the preview draws every instance in it
+    instanceAssets[name] = asset;
+    return asset;
+}
+
+boolean Instance::setTransform(double matrix[3][4])
+{
+    double (*m)[4] = matrix;
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (fabs(det) < 1e-12)
+        return false;
+
+    memcpy(toWorld, matrix, sizeof(toWorld));
+
+    // inverse of the linear part by cofactors, then the translation moved back through it
+    double (*inv)[4] = toObject;
+    inv[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+    inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+    inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+    inv[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) / det;
+    inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+    inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+    inv[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+    inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+    inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+    for (int r = 0; r < 3; r++)
+        inv[r][3] = -(inv[r][0] * m[0][3] + inv[r][1] * m[1][3] + inv[r][2] * m[2][3]);
+    return true;
+}
+
+// the asset's shared display list under the instance's transform
+void Instance::draw()
+{
+    GLdouble matrix[16] = {toWorld[0][0], toWorld[1][0], toWorld[2][0], 0,
+                           toWorld[0][1], toWorld[1][1], toWorld[2][1], 0,
+                           toWorld[0][2], toWorld[1][2], toWorld[2][2], 0,
+                           toWorld[0][3], toWorld[1][3], toWorld[2][3], 1};
+    glPushMatrix();
+    glMultMatrixd(matrix);
+    asset->draw();
+    glPopMatrix();
+}
+
+// t along the world ray: the asset sees a unit direction, its t is scaled back by the length
+// the direction had in object space
+double Instance::handleIntersecttion(Ray *ray)
+{
+    Point &o = *ray->start, &d = *ray->dir;
+    double (*m)[4] = toObject;
+    Point *start = new Point(m[0][0] * o.x + m[0][1] * o.y + m[0][2] * o.z + m[0][3],
+                             m[1][0] * o.x + m[1][1] * o.y + m[1][2] * o.z + m[1][3],
+                             m[2][0] * o.x + m[2][1] * o.y + m[2][2] * o.z + m[2][3]);
+    Point *dir = new Point(m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z,
+                           m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z,
+                           m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z);
+    double length = dir->magnitude();
+
+    Ray *local = new Ray(start, dir);
+    double t = asset->handleIntersecttion(local);
+    delete local;
+    return t > 0 ? t / length : t;
+}
+
+// normals go back through the transpose of the inverse, which keeps the side they face
+Point *Instance::getNormal(Point *p, Point *rayDir)
+{
+    double (*m)[4] = toObject;
+    Point local(m[0][0] * p->x + m[0][1] * p->y + m[0][2] * p->z + m[0][3],
+                m[1][0] * p->x + m[1][1] * p->y + m[1][2] * p->z + m[1][3],
+                m[2][0] * p->x + m[2][1] * p->y + m[2][2] * p->z + m[2][3]);
+    Point localDir(m[0][0] * rayDir->x + m[0][1] * rayDir->y + m[0][2] * rayDir->z,
+                   m[1][0] * rayDir->x + m[1][1] * rayDir->y + m[1][2] * rayDir->z,
+                   m[2][0] * rayDir->x + m[2][1] * rayDir->y + m[2][2] * rayDir->z);
+
+    Point *n = asset->getNormal(&local, &localDir);
+    if (n == NULL)
+        return NULL;
+
+    Point *normal = new Point(m[0][0] * n->x + m[1][0] * n->y + m[2][0] * n->z,
+                              m[0][1] * n->x + m[1][1] * n->y + m[2][1] * n->z,
+                              m[0][2] * n->x + m[1][2] * n->y + m[2][2] * n->z);
+    normal->normalize();
+    delete n;
+    return normal;
+}
+
 /////////////////////////// LIGHTSOURCE //////////////////////////////
 
 LightSource::LightSource(string lightType)
 {
     this->lightType = lightType;
     this->color = Color(1, 1, 1);
+    index = -1;
+    influenceRadius = INFINITY;
 }
 
 ///////////////////////// NORMAL LIGHTSOURCE /////////////////////////
@@ -1213,7 +2795,38 @@ void NormalLightSource::draw()
 
 ///////////////////////// SPOT LIGHTSOURCE /////////////////////////
 
-SpotLightSource::SpotLightSource() : LightSource("spot") {}
+SpotLightSource::SpotLightSource() : LightSource("spot")
+{
+    cutoffAngle = 180;
+    penumbraAngle = 0;
+    cosCutoff = cosInner = -1;
+}
+
+void SpotLightSource::prepare()
+{
+    direction.normalize();
+    penumbraAngle = max(0.0, min(penumbraAngle, cutoffAngle));
+    cosCutoff = cos(cutoffAngle * M_PI / 180);
+    cosInner = cos((cutoffAngle - penumbraAngle) * M_PI / 180);
+}
+
+double SpotLightSource::coneFactor(Point *p)
+{
+    double dx = p->x - position.x, dy = p->y - position.y, dz = p->z - position.z;
+    double length = sqrt(dx * dx + dy * dy + dz * dz);
+    if (length == 0)
+        return 1;
+
+    double cosAngle = (dx * direction.x + dy * direction.y + dz * direction.z) / length;
+    if (cosAngle < cosCutoff)
+        return 0;
+    if (cosAngle >= cosInner)
+        return 1;
+
+    // smoothstep across the penumbra
+    double s = (cosAngle - cosCutoff) / (cosInner - cosCutoff);
+    return s * s * (3 - 2 * s);
+}
 
 void SpotLightSource::draw()
 {
@@ -1224,4 +2837,239 @@ void SpotLightSource::draw()
         glutSolidSphere(3, 20, 20);
     }
     glPopMatrix();
-}
\ No newline at end of file
+}
+
+///////////////////////// AREA LIGHTSOURCE /////////////////////////
+
+AreaLightSource::AreaLightSource(Shape shape) : LightSource("area")
+{
+    this->shape = shape;
+    radius = 0;
+}
+
+void AreaLightSource::prepare()
+{
+    if (shape == RECTANGLE)
+    {
+        position.x = corner.x + (edgeU.x + edgeV.x) / 2;
+        position.y = corner.y + (edgeU.y + edgeV.y) / 2;
+        position.z = corner.z + (edgeU.z + edgeV.z) / 2;
+    }
+}
+
+Point AreaLightSource::samplePoint(Point *p, double u, double v)
+{
+    if (shape == RECTANGLE)
+        return Point(corner.x + edgeU.x * u + edgeV.x * v,
+                     corner.y + edgeU.y * u + edgeV.y * v,
+                     corner.z + edgeU.z * u + edgeV.z * v);
+
+    // a sphere looks like a disk from p, sample the disk and lift it onto the near side of the sphere
+    double w[3] = {p->x - position.x, p->y - position.y, p->z - position.z};
+    double length = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+    if (length == 0)
+        return position;
+    for (int k = 0; k < 3; k++)
+        w[k] /= length;
+
+    // a, b span the plane perpendicular to w
+    double a[3] = {0, 0, 0};
+    a[fabs(w[0]) < 0.9 ? 0 : 1] = 1;
+    double dot = a[0] * w[0] + a[1] * w[1] + a[2] * w[2];
+    for (int k = 0; k < 3; k++)
+        a[k] -= dot * w[k];
+    double aLength = sqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+    for (int k = 0; k < 3; k++)
+        a[k] /= aLength;
+    double b[3] = {w[1] * a[2] - w[2] * a[1], w[2] * a[0] - w[0] * a[2], w[0] * a[1] - w[1] * a[0]};
+
+    double r = radius * sqrt(u), phi = 2 * M_PI * v;
+    double lift = sqrt(max(0.0, radius * radius - r * r));
+    double ca = r * cos(phi), cb = r * sin(phi);
+    return Point(position.x + a[0] * ca + b[0] * cb + w[0] * lift,
+                 position.y + a[1] * ca + b[1] * cb + w[1] * lift,
+                 position.z + a[2] * ca + b[2] * cb + w[2] * lift);
+}
+
+// jitter inside a stratum, a hash of the point so that every thread, process and frame agrees
+static double sampleJitter(Point *p, int light, int sample)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ULL * (light + 1) + sample;
+    double coordinates[3] = {p->x, p->y, p->z};
+    for (double c : coordinates)
+    {
+        unsigned long long bits;
+        memcpy(&bits, &c, sizeof(bits));
+        h = (h ^ bits) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return (h >> 11) * (1.0 / (1ULL << 53));
+}
+
+extern int areaSamples;
+
+// share of the light that reaches p, from up to areaSamples stratified shadow rays
+// the corner strata go first as probes, the rest is only traced when the probes disagree
+double AreaLightSource::visibility(Object *receiver, Point *p, int &shadowRaysLeft)
+{
+    int n = max(1, (int)round(sqrt((double)areaSamples)));
+    int corners[4][2] = {{0, 0}, {n - 1, n - 1}, {0, n - 1}, {n - 1, 0}};
+    int probes = n == 1 ? 1 : 4;
+
+    int taken = 0, lit = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int k = 0; k < (pass == 0 ? probes : n * n); k++)
+        {
+            int a, b;
+            if (pass == 0)
+            {
+                a = corners[k][0];
+                b = corners[k][1];
+            }
+            else
+            {
+                a = k / n;
+                b = k % n;
+                if ((a == 0 || a == n - 1) && (b == 0 || b == n - 1))
+                    continue;
+            }
+
+            // the budget of the pixel caps the samples, but a light always gets one
+            if (taken > 0 && shadowRaysLeft <= 0)
+                return (double)lit / taken;
+
+            double u = (a + sampleJitter(p, index, 2 * (a * n + b))) / n;
+            double v = (b + sampleJitter(p, index, 2 * (a * n + b) + 1)) / n;
+            Point sample = samplePoint(p, u, v);
+            shadowRaysLeft--;
+            taken++;
+            if (!receiver->isShadowed(&sample, p))
+                lit++;
+        }
+
+        // fully lit or fully in shadow, no penumbra here
+        if (lit == 0 || lit == taken)
+            break;
+    }
+    return (double)lit / taken;
+}
+
+void AreaLightSource::draw()
+{
+    glColor3f(color.r, color.g, color.b);
+    if (shape == RECTANGLE)
+    {
+        glBegin(GL_QUADS);
+        glVertex3f(corner.x, corner.y, corner.z);
+        glVertex3f(corner.x + edgeU.x, corner.y + edgeU.y, corner.z + edgeU.z);
+        glVertex3f(corner.x + edgeU.x + edgeV.x, corner.y + edgeU.y + edgeV.y, corner.z + edgeU.z + edgeV.z);
+        glVertex3f(corner.x + edgeV.x, corner.y + edgeV.y, corner.z + edgeV.z);
+        glEnd();
+        return;
+    }
+
+    glPushMatrix();
+    {
+        glTranslatef(position.x, position.y, position.z);
+        glutSolidSphere(radius, 20, 20);
+    }
+    glPopMatrix();
+}
+
+///////////////////////////// LIGHT GRID /////////////////////////////
+
+// cutoff is the smallest attenuation exp(-d^2 falloff) that is still shaded, 0 keeps every light
+void LightGrid::build(vector<LightSource *> &lights, double cutoff)
+{
+    unbounded.clear();
+    cells.clear();
+    dims[0] = dims[1] = dims[2] = 0;
+
+    vector<LightSource *> bounded;
+    vector<double> radii;
+    for (int i = 0; i < lights.size(); i++)
+    {
+        LightSource *light = lights[i];
+        light->index = i;
+        if (cutoff > 0 && cutoff < 1 && light->falloff > 0)
+        {
+            light->influenceRadius = sqrt(-log(cutoff) / light->falloff);
+            bounded.push_back(light);
+            radii.push_back(light->influenceRadius);
+        }
+        else
+        {
+            light->influenceRadius = INFINITY;
+            unbounded.push_back(light);
+        }
+    }
+
+    if (bounded.empty())
+        return;
+
+    double hi[3];
+    for (int k = 0; k < 3; k++)
+    {
+        lo[k] = INFINITY;
+        hi[k] = -INFINITY;
+    }
+    for (LightSource *light : bounded)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = min(lo[k], axisOf(light->position, k) - light->influenceRadius);
+            hi[k] = max(hi[k], axisOf(light->position, k) + light->influenceRadius);
+        }
+    }
+
+    // cells about as big as a typical sphere of influence
+    nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+    double extent = max(hi[0] - lo[0], max(hi[1] - lo[1], hi[2] - lo[2]));
+    cellSize = max(radii[radii.size() / 2], extent / MAX_CELLS_PER_AXIS);
+    for (int k = 0; k < 3; k++)
+        dims[k] = max(1, min(MAX_CELLS_PER_AXIS, (int)ceil((hi[k] - lo[k]) / cellSize)));
+
+    // lights are inserted in order, so every cell lists them sorted by index
+    cells.resize(dims[0] * dims[1] * dims[2]);
+    for (LightSource *light : bounded)
+    {
+        int from[3], to[3];
+        for (int k = 0; k < 3; k++)
+        {
+            from[k] = max(0, (int)floor((axisOf(light->position, k) - light->influenceRadius - lo[k]) / cellSize));
+            to[k] = min(dims[k] - 1, (int)floor((axisOf(light->position, k) + light->influenceRadius - lo[k]) / cellSize));
+        }
+        for (int x = from[0]; x <= to[0]; x++)
+            for (int y = from[1]; y <= to[1]; y++)
+                for (int z = from[2]; z <= to[2]; z++)
+                    cells[(x * dims[1] + y) * dims[2] + z].push_back(light);
+    }
+}
+
+const vector<LightSource *> &LightGrid::cellAt(Point *p)
+{
+    if (cells.empty())
+        return none;
+
+    int cell[3];
+    for (int k = 0; k < 3; k++)
+    {
+        double offset = (axisOf(*p, k) - lo[k]) / cellSize;
+        if (offset < 0 || offset >= dims[k])
+            return none;
+        cell[k] = min(dims[k] - 1, (int)offset);
+    }
+    return cells[(cell[0] * dims[1] + cell[1]) * dims[2] + cell[2]];
+}
+
+boolean LightGrid::reaches(LightSource *light, Point *p)
+{
+    if (light->influenceRadius == INFINITY)
+        return true;
+
+    double dx = p->x - light->position.x, dy = p->y - light->position.y, dz = p->z - light->position.z;
+    return dx * dx + dy * dy + dz * dz <= light->influenceRadius * light->influenceRadius;
+}
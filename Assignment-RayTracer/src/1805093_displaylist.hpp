@@ -0,0 +1,88 @@
+// retained geometry for the OpenGL preview: every object is compiled into a display list
+// the first time it is drawn and replayed after that, the board in chunks of tiles that are
+// culled against the view frustum; display lists are GL 1.0, so Mesa's software rasterizer
+// runs them as well as any driver
+// --immediate draws everything in immediate mode every frame, as before, to compare
+
+#include <cstring>
+
+using namespace std;
+
+boolean retainedPreview = true;
+
+// one display list, compiled on first use; needs a current GL context
+class DisplayList
+{
+public:
+    DisplayList() : list(0) {}
+    ~DisplayList() { release(); }
+
+    boolean ready() { return list != 0; }
+    void begin()
+    {
+        list = glGenLists(1);
+        glNewList(list, GL_COMPILE);
+    }
+    void end() { glEndList(); }
+    void call() { glCallList(list); }
+    void release()
+    {
+        if (list != 0)
+            glDeleteLists(list, 1);
+        list = 0;
+    }
+
+private:
+    GLuint list;
+
+    DisplayList(const DisplayList &);
+    DisplayList &operator=(const DisplayList &);
+};
+
+// clip planes of the current projection and modelview matrices
+class Frustum
+{
+public:
+    void fromGL()
+    {
+        double projection[16], modelview[16], clip[16];
+        glGetDoublev(GL_PROJECTION_MATRIX, projection);
+        glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+
+        // column major, clip = projection * modelview
+        for (int column = 0; column < 4; column++)
+            for (int row = 0; row < 4; row++)
+            {
+                clip[column * 4 + row] = 0;
+                for (int k = 0; k < 4; k++)
+                    clip[column * 4 + row] += projection[k * 4 + row] * modelview[column * 4 + k];
+            }
+
+        // w + x, w - x, w + y, w - y, w + z, w - z
+        for (int p = 0; p < 6; p++)
+        {
+            int axis = p / 2;
+            double sign = p % 2 == 0 ? 1 : -1;
+            for (int column = 0; column < 4; column++)
+                planes[p][column] = clip[column * 4 + 3] + sign * clip[column * 4 + axis];
+        }
+    }
+
+    // false only if the box is entirely outside one plane
+    boolean intersectsBox(const double lo[3], const double hi[3])
+    {
+        for (int p = 0; p < 6; p++)
+        {
+            // the corner furthest along the plane normal
+            double distance = planes[p][3];
+            for (int k = 0; k < 3; k++)
+                distance += planes[p][k] * (planes[p][k] >= 0 ? hi[k] : lo[k]);
+            if (distance < 0)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    double planes[6][4]; // a x + b y + c z + d >= 0 inside
+};
@@ -0,0 +1,407 @@
+// render farm: a coordinator forks N worker processes and hands them bands of rows
+// over a unix socket pair each, a worker that dies has its band queued again
+// POSIX only, the workers inherit the loaded scene from the fork
+
+#ifndef _WIN32
+
+#include <deque>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+using namespace std;
+
+// rows [rowBegin, rowEnd) of one frame
+class FarmJob
+{
+public:
+    int frame;
+    int rowBegin, rowEnd;
+};
+
+// sent back by a worker, followed by the RGB bytes of the rows
+class FarmResult
+{
+public:
+    FarmJob job;
+    double seconds; // CPU time the worker spent tracing the job
+};
+
+class FarmWorker
+{
+public:
+    pid_t pid;
+    int socket;
+    boolean busy;
+    FarmJob job;
+    int jobsDone;
+};
+
+// blocking read/write of exactly size bytes, false if the other side is gone
+boolean readAll(int socket, void *data, size_t size)
+{
+    char *bytes = (char *)data;
+    while (size > 0)
+    {
+        ssize_t n = read(socket, bytes, size);
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+boolean writeAll(int socket, const void *data, size_t size)
+{
+    const char *bytes = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t n = write(socket, bytes, size);
+        if (n <= 0)
+            return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+#ifdef RAY_STATS
+
+// the counters of a worker since its last job and the time of every pixel of the job,
+// sent after its pixels and then cleared, so that every count reaches the coordinator once
+boolean writeStats(int socket, FarmJob &job)
+{
+    RayStats &stats = threadStats();
+    stats.cacheMisses = frameCacheMisses.read();
+    frameCacheMisses.start();
+    long long counters[9] = {stats.primaryRays, stats.shadowRays, stats.reflectionRays, stats.triangleTests, stats.rectTests,
+                             stats.culledLights, stats.sortedReflections, stats.sortedReflectionsUsed, stats.cacheMisses};
+    stats.objectTests.resize(objects.size(), 0);
+    stats.objectHits.resize(objects.size(), 0);
+    double *cost = &pixelCost[job.rowBegin * imageWidth];
+    int pixels = (job.rowEnd - job.rowBegin) * imageWidth;
+
+    boolean written = writeAll(socket, counters, sizeof(counters)) &&
+                      writeAll(socket, stats.objectTests.data(), objects.size() * sizeof(long long)) &&
+                      writeAll(socket, stats.objectHits.data(), objects.size() * sizeof(long long)) &&
+                      writeAll(socket, cost, pixels * sizeof(double));
+    stats.reset();
+    fill(cost, cost + pixels, 0.0);
+    return written;
+}
+
+boolean readStats(int socket, FarmJob &job, RayStats &stats, vector<double> &cost)
+{
+    long long counters[9];
+    stats.objectTests.resize(objects.size());
+    stats.objectHits.resize(objects.size());
+    cost.resize((job.rowEnd - job.rowBegin) * imageWidth);
+    if (!readAll(socket, counters, sizeof(counters)) ||
+        !readAll(socket, stats.objectTests.data(), objects.size() * sizeof(long long)) ||
+        !readAll(socket, stats.objectHits.data(), objects.size() * sizeof(long long)) ||
+        !readAll(socket, cost.data(), cost.size() * sizeof(double)))
+        return false;
+
+    stats.primaryRays = counters[0];
+    stats.shadowRays = counters[1];
+    stats.reflectionRays = counters[2];
+    stats.triangleTests = counters[3];
+    stats.rectTests = counters[4];
+    stats.culledLights = counters[5];
+    stats.sortedReflections = counters[6];
+    stats.sortedReflectionsUsed = counters[7];
+    stats.cacheMisses = max(0LL, counters[8]); // -1 without a counter
+    return true;
+}
+
+#endif
+
+class RenderFarm
+{
+public:
+    RenderFarm(int workerCount, int bandHeight);
+    // path may be NULL to render the current camera as a single frame
+    void run(CameraPath *path);
+
+private:
+    int workerCount, bandHeight;
+    CameraPath *path;
+    vector<FarmWorker> workers;
+    deque<FarmJob> queue;
+    vector<GBufferEntry> entries; // primary hits of the job, in a worker
+
+    void spawn(FarmWorker &worker);
+    void workerLoop(int socket);
+    void renderJob(FarmJob &job, vector<unsigned char> &pixels);
+    boolean dispatch(FarmWorker &worker);
+    void bury(FarmWorker &worker);
+};
+
+RenderFarm::RenderFarm(int workerCount, int bandHeight)
+{
+    this->workerCount = workerCount;
+    this->bandHeight = bandHeight;
+    path = NULL;
+}
+
+void RenderFarm::spawn(FarmWorker &worker)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+    {
+        perror("farm: socketpair");
+        worker.pid = -1;
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sockets[0]);
+        // the sockets of the other workers were inherited too, drop them
+        for (FarmWorker &other : workers)
+            if (&other != &worker && other.pid > 0)
+                close(other.socket);
+        workerLoop(sockets[1]);
+        _exit(0);
+    }
+
+    close(sockets[1]);
+    worker.pid = pid;
+    worker.socket = sockets[0];
+    worker.busy = false;
+    worker.jobsDone = 0;
+    if (pid < 0)
+    {
+        perror("farm: fork");
+        close(worker.socket);
+    }
+}
+
+void RenderFarm::renderJob(FarmJob &job, vector<unsigned char> &pixels)
+{
+    if (path != NULL)
+        path->apply(job.frame);
+    RenderView view = captureView(imageWidth, imageHeight);
+
+    PixelRect rect = {0, job.rowBegin, imageWidth, job.rowEnd - job.rowBegin};
+    pixels.resize(rect.width * rect.height * 3);
+    renderRect(view, rect, entries, pixels.data());
+}
+
+// runs in the child, until the coordinator closes the socket
+void RenderFarm::workerLoop(int socket)
+{
+    vector<unsigned char> pixels;
+    FarmResult result;
+#ifdef RAY_STATS
+    // what was counted before the fork belongs to the coordinator
+    threadStats().reset();
+#endif
+    STATS_FRAME_BEGIN(imageWidth * imageHeight);
+    while (readAll(socket, &result.job, sizeof(FarmJob)))
+    {
+        // CPU time, so that workers sharing a core do not count their waiting as work
+        timespec begin, end;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin);
+        renderJob(result.job, pixels);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+        result.seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9;
+
+        if (!writeAll(socket, &result, sizeof(FarmResult)) || !writeAll(socket, pixels.data(), pixels.size()))
+            break;
+#ifdef RAY_STATS
+        if (!writeStats(socket, result.job))
+            break;
+#endif
+    }
+    close(socket);
+    // the coordinator's trace.json only has its own events
+    writeTrace("trace-" + to_string(getpid()) + ".json");
+}
+
+boolean RenderFarm::dispatch(FarmWorker &worker)
+{
+    if (queue.empty())
+        return true;
+
+    worker.job = queue.front();
+    if (!writeAll(worker.socket, &worker.job, sizeof(FarmJob)))
+        return false;
+
+    queue.pop_front();
+    worker.busy = true;
+    return true;
+}
+
+// the job a dead worker was holding goes back to the front of the queue
+void RenderFarm::bury(FarmWorker &worker)
+{
+    int status;
+    close(worker.socket);
+    waitpid(worker.pid, &status, 0);
+
+    cout << "farm: worker " << worker.pid << " died";
+    if (worker.busy)
+    {
+        queue.push_front(worker.job);
+        cout << ", frame " << worker.job.frame << " rows " << worker.job.rowBegin << "-" << worker.job.rowEnd << " queued again";
+    }
+    cout << endl;
+
+    worker.pid = -1;
+    worker.busy = false;
+}
+
+void RenderFarm::run(CameraPath *path)
+{
+    this->path = path;
+    int frames = path == NULL ? 1 : path->frameCount();
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        for (int row = 0; row < imageHeight; row += bandHeight)
+        {
+            FarmJob job;
+            job.frame = frame;
+            job.rowBegin = row;
+            job.rowEnd = min(row + bandHeight, imageHeight);
+            queue.push_back(job);
+        }
+    }
+
+    // writing to a dead worker must fail instead of killing the coordinator
+    signal(SIGPIPE, SIG_IGN);
+
+    // the workers add their counts to these as they finish jobs
+    STATS_FRAME_BEGIN(imageWidth * imageHeight);
+    auto begin = chrono::steady_clock::now();
+
+    workers.assign(workerCount, FarmWorker());
+    for (FarmWorker &worker : workers)
+    {
+        worker.pid = -1;
+        spawn(worker);
+    }
+
+    cout << "farm: " << queue.size() << " jobs, workers";
+    for (FarmWorker &worker : workers)
+        cout << " " << worker.pid;
+    cout << endl;
+
+    vector<vector<unsigned char>> images(frames); // allocated when the first band of a frame arrives
+    vector<int> rowsDone(frames, 0);
+    int framesDone = 0;
+    double workSeconds = 0;
+    vector<unsigned char> pixels;
+    vector<double> jobCost;
+
+    while (framesDone < frames)
+    {
+        // hand out work and collect the live workers
+        vector<pollfd> fds;
+        vector<int> owners;
+        for (int w = 0; w < workers.size(); w++)
+        {
+            FarmWorker &worker = workers[w];
+            if (worker.pid < 0)
+                continue;
+            if (!worker.busy && !dispatch(worker))
+            {
+                bury(worker);
+                continue;
+            }
+            if (worker.busy)
+            {
+                fds.push_back({worker.socket, POLLIN, 0});
+                owners.push_back(w);
+            }
+        }
+
+        if (fds.empty())
+        {
+            cout << "farm: no workers left, " << frames - framesDone << " frames unfinished" << endl;
+            break;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            perror("farm: poll");
+            break;
+        }
+
+        for (int k = 0; k < fds.size(); k++)
+        {
+            if (fds[k].revents == 0)
+                continue;
+
+            FarmWorker &worker = workers[owners[k]];
+            FarmResult result;
+            int rows = worker.job.rowEnd - worker.job.rowBegin;
+            pixels.resize(rows * imageWidth * 3);
+
+            boolean received = readAll(worker.socket, &result, sizeof(FarmResult)) && readAll(worker.socket, pixels.data(), pixels.size());
+#ifdef RAY_STATS
+            RayStats jobStats;
+            received = received && readStats(worker.socket, worker.job, jobStats, jobCost);
+#endif
+            if (!received)
+            {
+                bury(worker);
+                continue;
+            }
+
+            worker.busy = false;
+            worker.jobsDone++;
+            workSeconds += result.seconds;
+
+            FarmJob &job = result.job;
+            images[job.frame].resize(imageWidth * imageHeight * 3);
+            memcpy(&images[job.frame][job.rowBegin * imageWidth * 3], pixels.data(), pixels.size());
+            rowsDone[job.frame] += rows;
+#ifdef RAY_STATS
+            // summed over the frames of a path
+            threadStats().add(jobStats);
+            for (int k = 0; k < jobCost.size(); k++)
+                pixelCost[job.rowBegin * imageWidth + k] += jobCost[k];
+#endif
+
+            if (rowsDone[job.frame] == imageHeight)
+            {
+                string imageName = path == NULL ? nextImageName() : "images/frame" + to_string(job.frame + 1) + ".bmp";
+                saveBmp(images[job.frame], imageWidth, imageHeight, imageName);
+                vector<unsigned char>().swap(images[job.frame]);
+                framesDone++;
+                cout << "farm: " << imageName << " saved (" << framesDone << "/" << frames << ")" << endl;
+            }
+        }
+    }
+
+    // closing the sockets ends the worker loops
+    int alive = 0;
+    for (FarmWorker &worker : workers)
+    {
+        if (worker.pid < 0)
+            continue;
+        alive++;
+        close(worker.socket);
+        waitpid(worker.pid, NULL, 0);
+    }
+
+    // the sum of the job times is what a single worker would have needed
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    double speedup = workSeconds / seconds;
+    cout << "farm: " << framesDone << " frames in " << seconds << "s on " << workerCount << " workers ("
+         << alive << " alive at the end), " << workSeconds << "s of tracing, speedup " << speedup
+         << "x, efficiency " << 100 * speedup / workerCount << "%" << endl;
+    for (FarmWorker &worker : workers)
+        if (worker.pid >= 0)
+            cout << "farm: worker " << worker.pid << " did " << worker.jobsDone << " jobs" << endl;
+    STATS_REPORT(path == NULL ? "images/heat" + to_string(imageCount - 1) + ".bmp" : string("images/heat-frames.bmp"));
+}
+
+#endif
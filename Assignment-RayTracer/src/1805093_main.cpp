@@ -1,33 +1,59 @@
+#include <cstring>
 #include "1805093_def.hpp"
 #include "1805093_utils.hpp"
+#include "1805093_camera.hpp"
+#include "1805093_preview.hpp"
+#include "1805093_animation.hpp"
+#include "1805093_farm.hpp"
+#include "1805093_buckets.hpp"
+#include "1805093_reload.hpp"
 
 int nearPlane, farPlane, fovY, fovX, aspectRatio;
 int recursionLevel, imageWidth, imageHeight;
 vector<Object *> objects;
 vector<LightSource *> lights;
-
-Point* pos; // position of the eye
-Point* look;   // look/forward direction
-Point* r8;   // r8 direction - dynamically updated in the display function
-Point* up;   // up direction
-Point* center;   // center of the scene - temp use
+LightGrid lightGrid;
+double lightCutoff = 1.0 / 1024; // lights attenuated below this are not shaded
+int areaSamples = 16;     // shadow rays of an area light in a penumbra
+int shadowRayBudget = 64; // shadow rays of one pixel, over all its lights and reflections
+
+Camera camera;
+CameraControls cameraControls; // what the held keys ask for
+Point* pos = &camera.eye;   // position of the eye
+Point* look = &camera.look; // look/forward direction
+Point* r8 = &camera.right;  // r8 direction - dynamically updated in the display function
+Point* up = &camera.up;     // up direction
 
 boolean showTexture = false;
-vector< vector<Color*> > whiteTileColorBuffer;
-vector< vector<Color*> > blackTileColorBuffer;
+Texture whiteTileTexture;
+Texture blackTileTexture;
 
-void init()
+ProgressiveRender preview;
+
+// --frame-time prints the average time of a preview frame, waiting for GL to finish each one
+boolean timeFrames = false;
+int framesTimed = 0;
+double frameSeconds = 0;
+
+// frame time overlay, 'f' toggles it
+boolean showOverlay = true;
+chrono::steady_clock::time_point lastFrame = chrono::steady_clock::now();
+double drawSeconds = 0;     // time display() took for the previous frame
+double smoothedInterval = 0; // between frames drawn back to back
+SceneWatcher sceneWatcher;
+
+// camera and scene, everything that does not need a GL context
+void initScene()
 {
-    pos = new Point(0, 100, 100);
-    look = new Point(0, -1, -1);
-    look->normalize();
-    r8 = new Point(-20, 0, 0);
-    r8->normalize();
-    up = r8->cross(look);
-    center = new Point();
+    camera.reset();
 
     getInputs();
-    getTextureInputs(whiteTileColorBuffer, blackTileColorBuffer);
+    getTextureInputs(whiteTileTexture, blackTileTexture);
+}
+
+void init()
+{
+    initScene();
 
     glClearColor(0, 0, 0, 0);
     glMatrixMode(GL_PROJECTION);
@@ -38,25 +64,11 @@ void init()
 
 void clearMem()
 {
-    delete pos;
-    delete look;
-    delete r8;
-    delete up;
-    delete center;
-
     for (Object *object : objects)
         delete object;
 
     for (LightSource *light : lights)
         delete light;
-
-    for (vector<Color*> row : whiteTileColorBuffer)
-        for (Color* color : row)
-            delete color;
-
-    for (vector<Color*> row : blackTileColorBuffer)
-        for (Color* color : row)
-            delete color;
 }
 
 void drawAxes()
@@ -81,15 +93,53 @@ void drawAxes()
     glEnd();
 }
 
+// draw time of the last frame and, while the view is redrawn continuously, the frame rate
+void drawOverlay(double elapsed)
+{
+    // a gap of more than a quarter second means nothing was moving
+    if (elapsed < 0.25)
+        smoothedInterval = smoothedInterval == 0 ? elapsed : 0.9 * smoothedInterval + 0.1 * elapsed;
+
+    char text[64];
+    if (elapsed < 0.25 && smoothedInterval > 0)
+        snprintf(text, sizeof(text), "%.1f ms draw  %.0f fps", drawSeconds * 1000, 1 / smoothedInterval);
+    else
+        snprintf(text, sizeof(text), "%.1f ms draw", drawSeconds * 1000);
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, glutGet(GLUT_WINDOW_WIDTH), 0, glutGet(GLUT_WINDOW_HEIGHT));
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+
+    glColor3f(1, 1, 0);
+    glRasterPos2i(8, glutGet(GLUT_WINDOW_HEIGHT) - 20);
+    for (char *c = text; *c != 0; c++)
+        glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *c);
+
+    glEnable(GL_DEPTH_TEST);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
 /*  Handler for window-repaint event. Call back when the window first appears and
     whenever the window needs to be re-painted. */
 void display()
 {
-    // update r8, up, look
-    r8 = look->cross(up);
-    r8->normalize();
-    up = r8->cross(look);
-    up->normalize();
+    auto frameBegin = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(frameBegin - lastFrame).count();
+    lastFrame = frameBegin;
+
+    // update r8, up, look, and keep drawing while a movement key is held
+    if (camera.advance(elapsed, cameraControls))
+        glutPostRedisplay();
+    else
+        camera.orthonormalize();
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glMatrixMode(GL_MODELVIEW);
@@ -111,6 +161,26 @@ void display()
         light->draw();
     }
 
+    preview.draw();
+
+    if (showOverlay)
+        drawOverlay(elapsed);
+
+    if (timeFrames)
+    {
+        glFinish();
+        frameSeconds += chrono::duration<double>(chrono::steady_clock::now() - frameBegin).count();
+        if (++framesTimed == 100)
+        {
+            cout << "preview: " << frameSeconds * 1000 / framesTimed << "ms per frame ("
+                 << (retainedPreview ? "display lists" : "immediate mode") << ")" << endl;
+            framesTimed = 0;
+            frameSeconds = 0;
+        }
+        glutPostRedisplay();
+    }
+    drawSeconds = chrono::duration<double>(chrono::steady_clock::now() - frameBegin).count();
+
     glutSwapBuffers();
 }
 
@@ -127,136 +197,91 @@ void reshapeListener(GLsizei width, GLsizei height)
     gluPerspective(fovY, aspect, nearPlane, farPlane);
 }
 
-void keyboardListener(unsigned char key, int x, int y)
+// keeps the window repainting while the preview is being traced
+void previewTimer(int value)
 {
-    double v = 0.25;
-    double rate = 0.05;
-    double s;
-
-    center->x = pos->x + look->x;
-    center->y = pos->y + look->y;
-    center->z = pos->z + look->z;
+    glutPostRedisplay();
+    if (preview.isRunning())
+        glutTimerFunc(50, previewTimer, 0);
+}
 
-    switch (key)
+// with --watch, reloads the description when it is saved and traces it again
+void watchTimer(int value)
+{
+    if (sceneWatcher.changed())
     {
-    // control translation
-    case '1':
-        r8->x = r8->x * cos(rate) + look->x * sin(rate);
-        r8->y = r8->y * cos(rate) + look->y * sin(rate);
-        r8->z = r8->z * cos(rate) + look->z * sin(rate);
-
-        look->x = look->x * cos(rate) - r8->x * sin(rate);
-        look->y = look->y * cos(rate) - r8->y * sin(rate);
-        look->z = look->z * cos(rate) - r8->z * sin(rate);
-        break;
-
-    case '2':
-        r8->x = r8->x * cos(-rate) + look->x * sin(-rate);
-        r8->y = r8->y * cos(-rate) + look->y * sin(-rate);
-        r8->z = r8->z * cos(-rate) + look->z * sin(-rate);
+        preview.cancel();
+        ReloadReport report = reloadScene("description.txt");
+        printReload(report);
+        reshapeListener(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
 
-        look->x = look->x * cos(-rate) - r8->x * sin(-rate);
-        look->y = look->y * cos(-rate) - r8->y * sin(-rate);
-        look->z = look->z * cos(-rate) - r8->z * sin(-rate);
-        break;
-
-    case '3':
-        look->x = look->x * cos(rate) + up->x * sin(rate);
-        look->y = look->y * cos(rate) + up->y * sin(rate);
-        look->z = look->z * cos(rate) + up->z * sin(rate);
-
-        up->x = up->x * cos(rate) - look->x * sin(rate);
-        up->y = up->y * cos(rate) - look->y * sin(rate);
-        up->z = up->z * cos(rate) - look->z * sin(rate);
-        break;
-
-    case '4':
-        look->x = look->x * cos(-rate) + up->x * sin(-rate);
-        look->y = look->y * cos(-rate) + up->y * sin(-rate);
-        look->z = look->z * cos(-rate) + up->z * sin(-rate);
-
-        up->x = up->x * cos(-rate) - look->x * sin(-rate);
-        up->y = up->y * cos(-rate) - look->y * sin(-rate);
-        up->z = up->z * cos(-rate) - look->z * sin(-rate);
-        break;
+        preview.start();
+        glutTimerFunc(50, previewTimer, 0);
+    }
+    glutTimerFunc(250, watchTimer, 0);
+}
 
-    case '5':
-        up->x = up->x * cos(rate) + r8->x * sin(rate);
-        up->y = up->y * cos(rate) + r8->y * sin(rate);
-        up->z = up->z * cos(rate) + r8->z * sin(rate);
+// movement keys only set what is held, display() moves the camera by the time that passed
+void setControl(unsigned char key, int value)
+{
+    switch (key)
+    {
+    case '1': cameraControls.yaw = value; break;
+    case '2': cameraControls.yaw = -value; break;
+    case '3': cameraControls.pitch = value; break;
+    case '4': cameraControls.pitch = -value; break;
+    case '5': cameraControls.roll = value; break;
+    case '6': cameraControls.roll = -value; break;
+    case 'w': cameraControls.orbitUp = value; break;
+    case 's': cameraControls.orbitUp = -value; break;
+    case 'a': cameraControls.orbitAround = value; break;
+    case 'd': cameraControls.orbitAround = -value; break;
+    }
+}
 
-        r8->x = r8->x * cos(rate) - up->x * sin(rate);
-        r8->y = r8->y * cos(rate) - up->y * sin(rate);
-        r8->z = r8->z * cos(rate) - up->z * sin(rate);
-        break;
+void setSpecialControl(int key, int value)
+{
+    switch (key)
+    {
+    case GLUT_KEY_UP: cameraControls.forward = value; break;
+    case GLUT_KEY_DOWN: cameraControls.forward = -value; break;
+    case GLUT_KEY_RIGHT: cameraControls.sideways = value; break;
+    case GLUT_KEY_LEFT: cameraControls.sideways = -value; break;
+    case GLUT_KEY_PAGE_UP: cameraControls.lift = value; break;
+    case GLUT_KEY_PAGE_DOWN: cameraControls.lift = -value; break;
+    }
+}
 
-    case '6':
-        up->x = up->x * cos(-rate) + r8->x * sin(-rate);
-        up->y = up->y * cos(-rate) + r8->y * sin(-rate);
-        up->z = up->z * cos(-rate) + r8->z * sin(-rate);
+// the camera only moves from the first frame after a key goes down
+void startMoving()
+{
+    if (!cameraControls.any())
+        lastFrame = chrono::steady_clock::now();
+}
 
-        r8->x = r8->x * cos(-rate) - up->x * sin(-rate);
-        r8->y = r8->y * cos(-rate) - up->y * sin(-rate);
-        r8->z = r8->z * cos(-rate) - up->z * sin(-rate);
-        break;
+void keyboardListener(unsigned char key, int x, int y)
+{
+    // moving the camera makes the preview stale
+    // strchr would also match the terminating '\0' of the string
+    if (key != 0 && strchr("123456wsad", key) != NULL)
+    {
+        preview.cancel();
+        startMoving();
+        setControl(key, 1);
+    }
 
+    switch (key)
+    {
     case '0':
-        // start raytracing
-        // and output a bmp
-        generateBmp();
-        break;
-
-    // control viewing (or camera)
-    case 'w':
-        // move up without changing reference point
-        pos->x += v * up->x;
-        pos->y += v * up->y;
-        pos->z += v * up->z;
-
-        look->x = center->x - pos->x;
-        look->y = center->y - pos->y;
-        look->z = center->z - pos->z;
-        look->normalize();
-
-        break;
-
-    case 's':
-        // move down without changing reference point
-        pos->x -= v * up->x;
-        pos->y -= v * up->y;
-        pos->z -= v * up->z;
-
-        look->x = center->x - pos->x;
-        look->y = center->y - pos->y;
-        look->z = center->z - pos->z;
-        look->normalize();
-
-        break;
-
-    case 'a':
-        // rotate the object in the clockwise direction about its own axis
-        pos->x += v * (-up->y*look->y);
-        pos->y += v * (look->x*up->y);
-
-        look->x = center->x - pos->x;
-        look->y = center->y - pos->y;
-        look->normalize();
-
-        break;
-
-    case 'd':
-        // rotate the object in the anti-clockwise direction about its own axis
-        pos->x += v * (up->y*look->y);
-        pos->y += v * (-look->x*up->y);
-
-        look->x = center->x - pos->x;
-        look->y = center->y - pos->y;
-        look->normalize();
-
+        // start raytracing in the background
+        // and output a bmp when the last pass is done
+        preview.start();
+        glutTimerFunc(50, previewTimer, 0);
         break;
 
     case ' ':
-        // toggle texture mode
+        // toggle texture mode, the preview worker reads it so stop that first
+        preview.cancel();
         showTexture = !showTexture;
         if (showTexture)
             cout << "Texture mode ON" << endl;
@@ -264,8 +289,14 @@ void keyboardListener(unsigned char key, int x, int y)
             cout << "Texture mode OFF" << endl;
         break;
 
+    case 'f':
+        // toggle the frame time overlay
+        showOverlay = !showOverlay;
+        break;
+
     // control exit
     case 27:     // ESC key
+        preview.cancel();
         exit(0); // Exit window
         break;
 
@@ -276,56 +307,194 @@ void keyboardListener(unsigned char key, int x, int y)
     glutPostRedisplay(); // Post a paint request to activate display()
 }
 
+void keyboardUpListener(unsigned char key, int x, int y)
+{
+    setControl(key, 0);
+}
+
 /* Callback handler for special-key event */
 void specialKeyListener(int key, int x, int y)
 {
-    double v = 2;
+    preview.cancel();
+    startMoving();
+    setSpecialControl(key, 1);
 
-    switch (key)
+    glutPostRedisplay(); // Post a paint request to activate display()
+}
+
+void specialKeyUpListener(int key, int x, int y)
+{
+    setSpecialControl(key, 0);
+}
+
+/* Main function: GLUT runs as a console application starting at main()  */
+int main(int argc, char **argv)
+{
+    // --animate keyframes.txt (--out video.y4m | --pipe "encoder command") [--reproject] [--compare]
+    // renders the camera path headless, without creating a window
+    // --farm N [--band rows] renders the current camera, or with --animate every frame of the
+    // path, on N worker processes and saves the frames as BMPs
+    string animationFile, target = "images/animation.y4m";
+    boolean pipe = false, reproject = false, compare = false;
+    int farmWorkers = 0, bandHeight = 16, soak = 0, bmpBench = 0, pyramidBench = 0;
+    boolean precisionDiff = false, bvhCompare = false, watch = false, kernelReport = false;
+    // --render [--resume] [--crop x y width height] [--bucket size] renders the starting camera
+    // headless in buckets, with a checkpoint to resume from
+    boolean bucketRender = false, resume = false;
+    PixelRect crop = {0, 0, INT_MAX, INT_MAX};
+    int bucketSize = 32;
+    for (int i = 1; i < argc; i++)
     {
-    case GLUT_KEY_UP:
-        pos->x += look->x * 2;
-        pos->y += look->y * 2;
-        pos->z += look->z * 2;
-        break;
-    case GLUT_KEY_DOWN:
-        pos->x -= look->x * 2;
-        pos->y -= look->y * 2;
-        pos->z -= look->z * 2;
-        break;
+        if (strcmp(argv[i], "--reproject") == 0)
+            reproject = true;
+        else if (strcmp(argv[i], "--watch") == 0)
+            watch = true;
+        else if (strcmp(argv[i], "--render") == 0)
+            bucketRender = true;
+        else if (strcmp(argv[i], "--resume") == 0)
+            bucketRender = resume = true;
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            useMeshCache = false;
+        else if (strcmp(argv[i], "--no-ray-sort") == 0)
+            sortReflections = false;
+        else if (strcmp(argv[i], "--immediate") == 0)
+            retainedPreview = false;
+        else if (strcmp(argv[i], "--frame-time") == 0)
+            timeFrames = true;
+        else if (strcmp(argv[i], "--precision-diff") == 0)
+            precisionDiff = true;
+        else if (strcmp(argv[i], "--bvh-compare") == 0)
+            bvhCompare = true;
+        else if (strcmp(argv[i], "--pixel-kernels") == 0)
+            kernelReport = true;
+        else if (strcmp(argv[i], "--compare") == 0)
+            compare = true;
+        else if (i + 1 == argc)
+            break;
+        else if (strcmp(argv[i], "--animate") == 0)
+            animationFile = argv[++i];
+        else if (strcmp(argv[i], "--out") == 0)
+            target = argv[++i], pipe = false;
+        else if (strcmp(argv[i], "--pipe") == 0)
+            target = argv[++i], pipe = true;
+        else if (strcmp(argv[i], "--farm") == 0)
+            farmWorkers = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bucket") == 0)
+            bucketSize = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--crop") == 0 && i + 4 < argc)
+        {
+            crop = PixelRect{atoi(argv[i + 1]), atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4])};
+            bucketRender = true;
+            i += 4;
+        }
+        else if (strcmp(argv[i], "--band") == 0)
+            bandHeight = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--soak") == 0)
+            soak = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bmp-bench") == 0)
+            bmpBench = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--pyramid-bench") == 0)
+            pyramidBench = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--light-cutoff") == 0)
+            lightCutoff = atof(argv[++i]);
+        else if (strcmp(argv[i], "--area-samples") == 0)
+            areaSamples = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--shadow-rays") == 0)
+            shadowRayBudget = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--kernels") == 0)
+        {
+            if (!use_pixel_kernels(argv[++i]))
+                cout << "kernels: " << argv[i] << " does not run here, using " << pixel_kernels().name << endl;
+        }
+        else if (strcmp(argv[i], "--bvh") == 0)
+            bvhLayout = strcmp(argv[++i], "binary") == 0 ? BINARY_BVH : WIDE_BVH;
+        else if (strcmp(argv[i], "--precision") == 0)
+            tracePrecision = strcmp(argv[++i], "float") == 0 ? FLOAT_PRECISION : DOUBLE_PRECISION;
+    }
 
-    case GLUT_KEY_RIGHT:
-        pos->x += r8->x * 2;
-        pos->y += r8->y * 2;
-        pos->z += r8->z * 2;
-        break;
-    case GLUT_KEY_LEFT:
-        pos->x -= r8->x * 2;
-        pos->y -= r8->y * 2;
-        pos->z -= r8->z * 2;
-        break;
+    // --bmp-bench N times saving and loading an N x N BMP, no scene needed
+    if (bmpBench > 0)
+    {
+        bmpBenchmark(bmpBench);
+        return 0;
+    }
 
-    case GLUT_KEY_PAGE_UP:
-        pos->x += up->x * 2;
-        pos->y += up->y * 2;
-        pos->z += up->z * 2;
-        break;
-    case GLUT_KEY_PAGE_DOWN:
-        pos->x -= up->x * 2;
-        pos->y -= up->y * 2;
-        pos->z -= up->z * 2;
-        break;
+    // --pyramid-bench N times building every level of an N x N image pyramid
+    if (pyramidBench > 0)
+    {
+        pyramidBenchmark(pyramidBench);
+        return 0;
+    }
 
-    default:
-        break;
+    // --pixel-kernels checks the SIMD pixel kernels against the scalar ones and times them
+    if (kernelReport)
+    {
+        pixelKernelReport();
+        return 0;
     }
 
-    glutPostRedisplay(); // Post a paint request to activate display()
-}
+    // --precision-diff renders the starting camera in both precisions and compares them
+    if (precisionDiff)
+    {
+        initScene();
+        precisionReport();
+        writeTrace("trace.json");
+        clearMem();
+        return 0;
+    }
+
+    if (bucketRender)
+    {
+        initScene();
+        BucketRender(bucketSize, crop).run(resume);
+        writeTrace("trace.json");
+        clearMem();
+        return 0;
+    }
+
+    // --bvh-compare traces the same rays through every mesh in both BVH layouts
+    if (bvhCompare)
+    {
+        initScene();
+        bvhReport();
+        writeTrace("trace.json");
+        clearMem();
+        return 0;
+    }
+
+    // --soak N renders the starting camera N times and prints the memory use
+    if (soak > 0)
+    {
+        initScene();
+        soakRenders(soak);
+        writeTrace("trace.json");
+        clearMem();
+        return 0;
+    }
+
+    if (farmWorkers > 0)
+    {
+#ifdef _WIN32
+        cout << "farm: only supported on POSIX systems" << endl;
+#else
+        initScene();
+        CameraPath path;
+        if (animationFile.empty() || path.load(animationFile))
+            RenderFarm(farmWorkers, bandHeight).run(animationFile.empty() ? NULL : &path);
+        writeTrace("trace.json");
+        clearMem();
+#endif
+        return 0;
+    }
+
+    if (!animationFile.empty())
+    {
+        initScene();
+        renderAnimation(animationFile, target, pipe, reproject, compare);
+        clearMem();
+        return 0;
+    }
 
-/* Main function: GLUT runs as a console application starting at main()  */
-int main(int argc, char **argv)
-{
     glutInit(&argc, argv);
     glutInitWindowSize(650, 650);
     glutInitWindowPosition(1100, 100);
@@ -334,8 +503,13 @@ int main(int argc, char **argv)
     glutDisplayFunc(display);
     glutReshapeFunc(reshapeListener);
     glutKeyboardFunc(keyboardListener);
+    glutKeyboardUpFunc(keyboardUpListener);
     glutSpecialFunc(specialKeyListener);
+    glutSpecialUpFunc(specialKeyUpListener);
+    glutIgnoreKeyRepeat(1);
     init();
+    if (watch && sceneWatcher.start("description.txt"))
+        glutTimerFunc(250, watchTimer, 0);
     glutMainLoop();
     clearMem();
     return 0;
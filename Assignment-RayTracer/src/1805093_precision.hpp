@@ -0,0 +1,107 @@
+// scalar type of the intersection code, picked at run time with --precision float|double
+// the primitives convert the ray once and intersect with Vec3<Real> values, shading stays in double
+// double keeps the old absolute EPSILON so it renders exactly as before, float uses tolerances
+// relative to the size of the primitive and to the magnitude of the hit point
+
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+
+enum PrecisionMode
+{
+    DOUBLE_PRECISION,
+    FLOAT_PRECISION
+};
+
+PrecisionMode tracePrecision = DOUBLE_PRECISION;
+
+template <typename Real>
+class Vec3
+{
+public:
+    Real x, y, z;
+
+    Vec3() : x(0), y(0), z(0) {}
+    Vec3(Real x, Real y, Real z) : x(x), y(y), z(z) {}
+    // from Point, or from the other precision
+    template <typename P>
+    explicit Vec3(const P &p) : x((Real)p.x), y((Real)p.y), z((Real)p.z) {}
+
+    Vec3 operator+(const Vec3 &v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+    Vec3 operator-(const Vec3 &v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+    Vec3 operator*(Real s) const { return Vec3(x * s, y * s, z * s); }
+    Real dot(const Vec3 &v) const { return x * v.x + y * v.y + z * v.z; }
+    Real operator[](int k) const { return k == 0 ? x : (k == 1 ? y : z); }
+};
+
+template <typename Real>
+class RayT
+{
+public:
+    Vec3<Real> start, dir;
+
+    template <typename R>
+    explicit RayT(const R *ray) : start(*ray->start), dir(*ray->dir) {}
+    Vec3<Real> getPoint(Real t) const { return start + dir * t; }
+};
+
+// tolerances of one scalar type, scale is the size of the primitive being tested
+template <typename Real>
+class Tolerance;
+
+template <>
+class Tolerance<double>
+{
+public:
+    static double epsilon(double scale) { return 0.00001; }
+    // distance a secondary ray starts away from the surface it leaves
+    static double offset(double magnitude) { return 2 * 0.00001; }
+};
+
+template <>
+class Tolerance<float>
+{
+public:
+    static float epsilon(double scale) { return (float)(64 * FLT_EPSILON * max(1.0, scale)); }
+    // a float hit point is only known to a few ulps of its largest coordinate
+    static float offset(double magnitude) { return (float)(256 * FLT_EPSILON * max(1.0, magnitude)); }
+};
+
+// calls shape->intersect<Real>() in the precision that was picked
+template <typename Shape, typename R>
+double intersectIn(Shape *shape, R *ray)
+{
+    if (tracePrecision == FLOAT_PRECISION)
+        return shape->template intersect<float>(RayT<float>(ray));
+    return shape->template intersect<double>(RayT<double>(ray));
+}
+
+template <typename P>
+double largestCoordinate(const P *p)
+{
+    return max(fabs(p->x), max(fabs(p->y), fabs(p->z)));
+}
+
+// how far from a surface a hit point on it may lie, for getNormal()
+template <typename P>
+double surfaceEpsilon(const P *p)
+{
+    if (tracePrecision == FLOAT_PRECISION)
+        return Tolerance<float>::offset(largestCoordinate(p));
+    return Tolerance<double>::epsilon(0);
+}
+
+// how far a secondary ray starts from the hit point it leaves
+template <typename P>
+double rayOffset(const P *p)
+{
+    if (tracePrecision == FLOAT_PRECISION)
+        return Tolerance<float>::offset(largestCoordinate(p));
+    return Tolerance<double>::offset(largestCoordinate(p));
+}
+
+const char *precisionName()
+{
+    return tracePrecision == FLOAT_PRECISION ? "float" : "double";
+}
@@ -0,0 +1,268 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+using namespace std;
+
+// traces the image on a background thread, coarse blocks first and then
+// interleaved refinement passes, so the window shows an estimate right away;
+// the last pass goes through the G-buffer like a headless render, so the primary
+// hits are reused when only the shading changed since the previous preview
+class ProgressiveRender
+{
+public:
+    ProgressiveRender();
+    ~ProgressiveRender();
+
+    void start();  // snapshot the camera and begin rendering
+    void cancel(); // stop the worker and drop the estimate
+    boolean isActive();
+    boolean isRunning();
+    void draw(); // blit the current estimate over the whole window
+
+private:
+    static const int COARSE_BLOCK = 16;
+
+    thread worker;
+    atomic<bool> cancelled;
+    atomic<bool> running;
+    boolean active;
+
+    mutex bufferLock;
+    vector<unsigned char> pixels; // RGB, row 0 is the top of the image
+    boolean dirty;
+    int width, height;
+
+    GLuint texture;
+
+    void run(RenderView view);
+    void renderPass(RenderView &view, int step, boolean firstPass);
+    void finalPass(RenderView &view);
+    void save();
+};
+
+ProgressiveRender::ProgressiveRender()
+{
+    cancelled = false;
+    running = false;
+    active = false;
+    dirty = false;
+    width = height = 0;
+    texture = 0;
+}
+
+ProgressiveRender::~ProgressiveRender()
+{
+    cancel();
+}
+
+void ProgressiveRender::start()
+{
+    cancel();
+
+    width = imageWidth;
+    height = imageHeight;
+    pixels.assign(width * height * 3, 0);
+    dirty = true;
+    active = true;
+
+    cancelled = false;
+    running = true;
+    worker = thread(&ProgressiveRender::run, this, captureView(width, height));
+}
+
+void ProgressiveRender::cancel()
+{
+    boolean wasRunning = running;
+
+    cancelled = true;
+    if (worker.joinable())
+        worker.join();
+
+    if (wasRunning)
+        cout << "preview cancelled" << endl;
+
+    active = false;
+}
+
+boolean ProgressiveRender::isActive()
+{
+    return active;
+}
+
+boolean ProgressiveRender::isRunning()
+{
+    return running;
+}
+
+void ProgressiveRender::run(RenderView view)
+{
+    // every pass halves the block size, the last one shades single pixels
+    boolean firstPass = true;
+    for (int step = COARSE_BLOCK; step > 1 && !cancelled; step /= 2)
+    {
+        renderPass(view, step, firstPass);
+        firstPass = false;
+    }
+    if (!cancelled)
+        finalPass(view);
+
+    if (!cancelled)
+    {
+        save();
+        cout << "image generated" << endl;
+        STATS_REPORT("images/heat" + to_string(imageCount - 1) + ".bmp");
+        writeTrace("trace.json");
+    }
+
+    running = false;
+}
+
+void ProgressiveRender::renderPass(RenderView &view, int step, boolean firstPass)
+{
+    PROFILE_SCOPE("preview pass");
+    vector<unsigned char> row(width * 3);
+
+    for (int i = 0; i < height && !cancelled; i += step)
+    {
+        // samples on the grid of the previous pass are already traced
+        boolean oldRow = !firstPass && i % (2 * step) == 0;
+        ArenaScope arenaScope;
+
+        int traced = 0;
+        for (int j = 0; j < width && !cancelled; j += step)
+        {
+            if (oldRow && j % (2 * step) == 0)
+                continue;
+
+            Ray *ray = primaryRay(view, i, j);
+            Color *color = traceRay(ray);
+            color->adjust();
+            row[j * 3] = 255 * color->r;
+            row[j * 3 + 1] = 255 * color->g;
+            row[j * 3 + 2] = 255 * color->b;
+            delete color;
+            delete ray;
+            traced++;
+        }
+
+        if (cancelled || traced == 0)
+            continue;
+
+        // fill the block under every new sample until a finer pass replaces it
+        lock_guard<mutex> guard(bufferLock);
+        for (int j = 0; j < width; j += step)
+        {
+            if (oldRow && j % (2 * step) == 0)
+                continue;
+
+            for (int y = i; y < min(i + step, height); y++)
+            {
+                for (int x = j; x < min(j + step, width); x++)
+                {
+                    unsigned char *pixel = &pixels[(y * width + x) * 3];
+                    pixel[0] = row[j * 3];
+                    pixel[1] = row[j * 3 + 1];
+                    pixel[2] = row[j * 3 + 2];
+                }
+            }
+        }
+        dirty = true;
+    }
+
+    if (!cancelled)
+        cout << "preview pass " << step << "x" << step << " done" << endl;
+}
+
+// every pixel, a band of rows at a time so that a cancel does not wait for the whole frame
+void ProgressiveRender::finalPass(RenderView &view)
+{
+    PROFILE_SCOPE("preview pass");
+    STATS_FRAME_BEGIN(width * height);
+
+    boolean reuse = gBuffer.matches(view);
+    if (reuse)
+    {
+        gBuffer.reusedPixels += gBuffer.entries.size();
+        gBuffer.savedSeconds += gBuffer.traceSeconds;
+    }
+
+    vector<unsigned char> band(width * REFLECTION_BAND * 3);
+    for (int i = 0; i < height && !cancelled; i += REFLECTION_BAND)
+    {
+        int end = min(i + REFLECTION_BAND, height);
+        if (!reuse)
+            gBuffer.fillRows(view, i, end);
+        shadeRect(view, PixelRect{0, i, width, end - i}, &gBuffer.entries[i * width], band.data());
+
+        lock_guard<mutex> guard(bufferLock);
+        memcpy(&pixels[i * width * 3], band.data(), (end - i) * width * 3);
+        dirty = true;
+    }
+
+    if (!cancelled)
+    {
+        cout << "preview pass 1x1 done" << endl;
+        gBuffer.report();
+    }
+}
+
+void ProgressiveRender::save()
+{
+    lock_guard<mutex> guard(bufferLock);
+    saveBmp(pixels, width, height, nextImageName());
+}
+
+void ProgressiveRender::draw()
+{
+    if (!active)
+        return;
+
+    if (texture == 0)
+        glGenTextures(1, &texture);
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    {
+        lock_guard<mutex> guard(bufferLock);
+        if (dirty)
+        {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+            dirty = false;
+        }
+    }
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, 1, 0, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glColor3f(1, 1, 1);
+
+    // texture row 0 is the top of the image
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 1);
+    glVertex2f(0, 0);
+    glTexCoord2f(1, 1);
+    glVertex2f(1, 0);
+    glTexCoord2f(1, 0);
+    glVertex2f(1, 1);
+    glTexCoord2f(0, 0);
+    glVertex2f(0, 1);
+    glEnd();
+
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_DEPTH_TEST);
+
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
@@ -0,0 +1,117 @@
+// scoped timers for chrome://tracing (or ui.perfetto.dev), compiled in only with -DRAY_PROFILE
+// every thread writes its events into its own ring buffer without locking,
+// writeTrace() dumps all buffers in the Chrome trace_event JSON format
+// without RAY_PROFILE PROFILE_SCOPE expands to nothing
+
+#ifdef RAY_PROFILE
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+
+using namespace std;
+
+class TraceEvent
+{
+public:
+    const char *name;
+    long long start;    // microseconds since the program started
+    long long duration; // microseconds
+};
+
+class TraceBuffer
+{
+public:
+    static const int CAPACITY = 1 << 16; // the oldest events are overwritten
+
+    int threadId;
+    atomic<unsigned long long> head; // only the owning thread moves it
+    TraceEvent events[CAPACITY];
+
+    TraceBuffer(int threadId) : threadId(threadId), head(0) {}
+
+    void push(const char *name, long long start, long long duration)
+    {
+        unsigned long long index = head.load(memory_order_relaxed);
+        TraceEvent &event = events[index % CAPACITY];
+        event.name = name;
+        event.start = start;
+        event.duration = duration;
+        head.store(index + 1, memory_order_release);
+    }
+};
+
+mutex traceBuffersLock;
+vector<TraceBuffer *> traceBuffers;
+
+long long profilerNow()
+{
+    static chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - epoch).count();
+}
+
+TraceBuffer &threadTraceBuffer()
+{
+    thread_local TraceBuffer *buffer = NULL;
+    if (buffer == NULL)
+    {
+        // registered once per thread and never freed, so it can be dumped after the thread ends
+        lock_guard<mutex> guard(traceBuffersLock);
+        buffer = new TraceBuffer(traceBuffers.size());
+        traceBuffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+class ScopedTimer
+{
+    const char *name;
+    long long start;
+
+public:
+    ScopedTimer(const char *name) : name(name), start(profilerNow()) {}
+    ~ScopedTimer() { threadTraceBuffer().push(name, start, profilerNow() - start); }
+};
+
+// events still being written by a running thread may be torn, so dump while the workers are idle
+void writeTrace(string fileName)
+{
+    ofstream output(fileName);
+    output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+
+    lock_guard<mutex> guard(traceBuffersLock);
+    boolean first = true;
+    for (TraceBuffer *buffer : traceBuffers)
+    {
+        unsigned long long head = buffer->head.load(memory_order_acquire);
+        unsigned long long begin = head > TraceBuffer::CAPACITY ? head - TraceBuffer::CAPACITY : 0;
+
+        output << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+               << ",\"args\":{\"name\":\"" << (buffer->threadId == 0 ? "main" : "worker " + to_string(buffer->threadId)) << "\"}}";
+        first = false;
+
+        for (unsigned long long i = begin; i < head; i++)
+        {
+            TraceEvent &event = buffer->events[i % TraceBuffer::CAPACITY];
+            output << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+                   << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+        }
+    }
+
+    output << "\n]}" << endl;
+    output.close();
+    cout << "trace saved to " << fileName << endl;
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ScopedTimer PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+inline void writeTrace(string fileName) {}
+
+#endif
@@ -0,0 +1,240 @@
+// hot reload of the scene description: the file is parsed again and compared entry by entry
+// with the live scene, unchanged objects and lights are kept as they are, a mesh that only
+// moved or was scaled keeps its BVH (refit) and the light grid is only rebuilt if a light changed
+// the watcher uses inotify and is Linux only, reloadScene() itself works everywhere
+
+#ifndef _WIN32
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+using namespace std;
+
+class ReloadReport
+{
+public:
+    int kept, changed, added, removed;
+    int meshesRefit, meshesLoaded;
+    boolean lightsChanged;
+    double seconds;
+};
+
+// index of an unused entry of candidates with the same source, -1 if there is none
+template <typename T>
+int findSame(vector<T *> &candidates, vector<boolean> &used, const string &source)
+{
+    for (int k = 0; k < candidates.size(); k++)
+        if (!used[k] && candidates[k]->source == source)
+            return k;
+    return -1;
+}
+
+// the scene must not be in use by a render while this runs
+ReloadReport reloadScene(const char *fileName)
+{
+    PROFILE_SCOPE("reload");
+    auto begin = chrono::steady_clock::now();
+    ReloadReport report = {0, 0, 0, 0, 0, 0, false, 0};
+
+    // the camera settings of the description, a change of any of them moves the primary rays
+    int oldCamera[] = {nearPlane, farPlane, fovY, aspectRatio, imageWidth};
+
+    vector<Object *> freshObjects;
+    vector<LightSource *> freshLights;
+    readDescription(fileName, freshObjects, freshLights, false);
+
+    int newCamera[] = {nearPlane, farPlane, fovY, aspectRatio, imageWidth};
+    boolean cameraChanged = !equal(oldCamera, oldCamera + 5, newCamera);
+
+    // objects: keep the old one if its entry did not change
+    vector<boolean> used(objects.size(), false);
+    vector<Object *> nextObjects;
+    vector<Object *> pendingMeshes; // changed meshes, matched once every unchanged object has its match
+    for (Object *&fresh : freshObjects)
+    {
+        int k = findSame(objects, used, fresh->source);
+        if (k >= 0)
+        {
+            used[k] = true;
+            delete fresh;
+            fresh = objects[k];
+            report.kept++;
+        }
+        else if (fresh->objectType == "mesh")
+            pendingMeshes.push_back(fresh);
+    }
+
+    // a changed mesh of a file that is already loaded takes over that geometry
+    for (Object *object : pendingMeshes)
+    {
+        Mesh *mesh = (Mesh *)object;
+        Mesh *old = NULL;
+        for (int k = 0; k < objects.size() && old == NULL; k++)
+        {
+            if (used[k] || objects[k]->objectType != "mesh")
+                continue;
+            Mesh *candidate = (Mesh *)objects[k];
+            if (candidate->fileName == mesh->fileName && candidate->scale > 0 && mesh->scale > 0)
+            {
+                used[k] = true;
+                old = candidate;
+            }
+        }
+
+        if (old != NULL)
+        {
+            mesh->refit(old);
+            report.meshesRefit++;
+        }
+        else if (mesh->load())
+            report.meshesLoaded++;
+        else
+            mesh->objectType = ""; // dropped below
+    }
+
+    boolean idsMoved = false;
+    for (Object *fresh : freshObjects)
+    {
+        if (fresh->objectType.empty())
+        {
+            delete fresh;
+            continue;
+        }
+        int oldId = fresh->id;
+        addObject(nextObjects, fresh);
+        idsMoved = idsMoved || fresh->id != oldId;
+    }
+
+    for (int k = 0; k < objects.size(); k++)
+    {
+        if (used[k])
+            continue;
+        delete objects[k];
+        report.removed++;
+    }
+    // an entry that replaced one, or a refit mesh, counts as changed rather than as added and removed
+    int notKept = nextObjects.size() - report.kept;
+    report.changed = min(notKept, report.removed + report.meshesRefit);
+    report.added = notKept - report.changed;
+    report.removed -= report.changed - report.meshesRefit;
+    objects.swap(nextObjects);
+
+    // lights: the same, but any difference means a new light grid
+    vector<boolean> lightUsed(lights.size(), false);
+    report.lightsChanged = freshLights.size() != lights.size();
+    for (LightSource *&fresh : freshLights)
+    {
+        int k = findSame(lights, lightUsed, fresh->source);
+        if (k < 0)
+        {
+            report.lightsChanged = true;
+            continue;
+        }
+        lightUsed[k] = true;
+        delete fresh;
+        fresh = lights[k];
+    }
+    for (int k = 0; k < lights.size(); k++)
+        if (!lightUsed[k])
+            delete lights[k];
+    lights.swap(freshLights);
+
+    if (report.lightsChanged)
+        lightGrid.build(lights, lightCutoff);
+
+    // the primary hits (and so the G-buffer) only depend on the objects and the camera,
+    // a reload that only changed lights is shaded again from the G-buffer
+    if (cameraChanged || idsMoved || report.changed > 0 || report.added > 0 || report.removed > 0 || report.meshesRefit > 0)
+        sceneVersion++;
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    return report;
+}
+
+void printReload(ReloadReport &report)
+{
+    cout << "reload: " << report.kept << " objects kept, " << report.changed << " changed, " << report.added
+         << " added, " << report.removed << " removed, " << report.meshesRefit << " meshes refit, "
+         << report.meshesLoaded << " loaded, light grid " << (report.lightsChanged ? "rebuilt" : "kept")
+         << ", " << report.seconds * 1000 << "ms" << endl;
+}
+
+// reports when the description has been written, polled from the GLUT loop
+class SceneWatcher
+{
+public:
+    SceneWatcher();
+    ~SceneWatcher();
+
+    boolean start(const char *fileName); // false if the file cannot be watched
+    boolean changed();                   // does not block
+
+private:
+    int fd;
+    string fileName;
+};
+
+SceneWatcher::SceneWatcher()
+{
+    fd = -1;
+}
+
+SceneWatcher::~SceneWatcher()
+{
+#ifndef _WIN32
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+boolean SceneWatcher::start(const char *fileName)
+{
+#ifdef _WIN32
+    cout << "watch: only supported on Linux" << endl;
+    return false;
+#else
+    this->fileName = fileName;
+    fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0)
+    {
+        perror("watch: inotify_init1");
+        return false;
+    }
+
+    // the directory is watched, editors often save by writing a new file and renaming it
+    if (inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        perror("watch: inotify_add_watch");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    cout << "watch: reloading " << fileName << " whenever it is saved" << endl;
+    return true;
+#endif
+}
+
+boolean SceneWatcher::changed()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if (fd < 0)
+        return false;
+
+    boolean found = false;
+    char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(inotify_event))));
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *cursor = buffer; cursor < buffer + length;)
+        {
+            inotify_event *event = (inotify_event *)cursor;
+            if (event->len > 0 && fileName == event->name)
+                found = true;
+            cursor += sizeof(inotify_event) + event->len;
+        }
+    }
+    return found;
+#endif
+}
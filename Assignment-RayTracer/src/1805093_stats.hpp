@@ -0,0 +1,156 @@
+// ray statistics, compiled in only with -DRAY_STATS
+// every thread counts into its own RayStats, the summary adds them up
+// without RAY_STATS all the macros below expand to nothing
+
+#ifdef RAY_STATS
+
+#include <mutex>
+#include <chrono>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+class RayStats
+{
+public:
+    long long primaryRays, shadowRays, reflectionRays;
+    long long triangleTests, rectTests;
+    long long culledLights; // lights skipped by the light grid without a shadow ray
+    long long sortedReflections, sortedReflectionsUsed; // first reflections traced ahead, and shaded
+    long long cacheMisses; // counted by other processes, the farm workers
+    vector<long long> objectTests; // indexed by object id
+    vector<long long> objectHits;
+
+    RayStats() { reset(); }
+
+    void reset()
+    {
+        primaryRays = shadowRays = reflectionRays = 0;
+        triangleTests = rectTests = 0;
+        culledLights = 0;
+        sortedReflections = sortedReflectionsUsed = 0;
+        cacheMisses = 0;
+        objectTests.clear();
+        objectHits.clear();
+    }
+
+    void add(RayStats &other)
+    {
+        primaryRays += other.primaryRays;
+        shadowRays += other.shadowRays;
+        reflectionRays += other.reflectionRays;
+        triangleTests += other.triangleTests;
+        rectTests += other.rectTests;
+        culledLights += other.culledLights;
+        sortedReflections += other.sortedReflections;
+        sortedReflectionsUsed += other.sortedReflectionsUsed;
+        cacheMisses += other.cacheMisses;
+        addCounts(objectTests, other.objectTests);
+        addCounts(objectHits, other.objectHits);
+    }
+
+    void addCounts(vector<long long> &counts, vector<long long> &other)
+    {
+        if (other.size() > counts.size())
+            counts.resize(other.size(), 0);
+        for (int id = 0; id < other.size(); id++)
+            counts[id] += other[id];
+    }
+
+    void countObject(vector<long long> &counts, int id)
+    {
+        if (id < 0)
+            return;
+        if (id >= counts.size())
+            counts.resize(id + 1, 0);
+        counts[id]++;
+    }
+};
+
+// hardware cache misses of the thread that renders a frame and of the threads it starts,
+// where the kernel exposes the counter; the counts of those threads are added as they exit
+class CacheMissCounter
+{
+public:
+    CacheMissCounter() : fd(-1) {}
+
+    // the counter belongs to the thread that opens it, a frame may be rendered on another
+    // thread than the last one, so it is opened again every time
+    void start()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.inherit = 1;
+        fd = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+    }
+
+    // -1 if there is no counter
+    long long read()
+    {
+        long long count = -1;
+#ifdef __linux__
+        if (fd >= 0 && ::read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+#endif
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+CacheMissCounter frameCacheMisses;
+
+mutex rayStatsLock;
+vector<RayStats *> allRayStats;
+
+// per pixel render time in seconds, row major
+vector<double> pixelCost;
+
+RayStats &threadStats()
+{
+    thread_local RayStats *stats = NULL;
+    if (stats == NULL)
+    {
+        // never freed, the summary may read it after the thread is gone
+        stats = new RayStats();
+        lock_guard<mutex> guard(rayStatsLock);
+        allRayStats.push_back(stats);
+    }
+    return *stats;
+}
+
+#define STATS_COUNT(field) (threadStats().field++)
+#define STATS_OBJECT_TEST(id) (threadStats().countObject(threadStats().objectTests, (id)))
+#define STATS_OBJECT_HIT(id) (threadStats().countObject(threadStats().objectHits, (id)))
+#define STATS_PIXEL_BEGIN() chrono::steady_clock::time_point statsPixelBegin = chrono::steady_clock::now()
+#define STATS_PIXEL_END(index) (pixelCost[(index)] += chrono::duration<double>(chrono::steady_clock::now() - statsPixelBegin).count())
+#define STATS_FRAME_BEGIN(pixels) (pixelCost.assign((pixels), 0.0), frameCacheMisses.start())
+// reportStats comes with the rendering code, after this header
+#define STATS_REPORT(heatmapName) reportStats(heatmapName)
+
+#else
+
+#define STATS_COUNT(field) ((void)0)
+#define STATS_OBJECT_TEST(id) ((void)0)
+#define STATS_OBJECT_HIT(id) ((void)0)
+#define STATS_PIXEL_BEGIN() ((void)0)
+#define STATS_PIXEL_END(index) ((void)0)
+#define STATS_FRAME_BEGIN(pixels) ((void)0)
+#define STATS_REPORT(heatmapName) ((void)0)
+
+#endif
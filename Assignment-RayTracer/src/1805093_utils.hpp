@@ -1,6 +1,9 @@
 #include <fstream>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <random>
+#include <functional>
 #include "bitmap_image.hpp"
 
 using namespace std;
@@ -9,26 +12,56 @@ extern int nearPlane, farPlane, fovY, fovX, aspectRatio;
 extern int recursionLevel, imageWidth, imageHeight;
 extern vector<Object *> objects;
 extern vector<LightSource *> lights;
+extern LightGrid lightGrid;
+extern double lightCutoff;
 
 extern Point *pos;    // position of the eye
 extern Point *look;   // look/forward direction
 extern Point *r8;     // right direction - dynamically updated in the display function
 extern Point *up;     // up direction
-extern Point *center; // center of the scene - temp use
 
 extern boolean showTexture;
-extern vector<vector<Color *>> whiteTileColorBuffer;
-extern vector<vector<Color *>> blackTileColorBuffer;
+extern Texture whiteTileTexture;
+extern Texture blackTileTexture;
 
-void getInputs()
+// bumped whenever objects change, so cached primary hits are not reused
+int sceneVersion = 0;
+
+// the text of the entry that started at begin with its whitespace collapsed, a reload compares it
+string entryText(const string &text, istream &input, streampos begin)
+{
+    streampos end = input.tellg();
+    if (begin == streampos(-1))
+        return "";
+    size_t stop = end == streampos(-1) ? text.size() : (size_t)end;
+    istringstream words(text.substr(begin, stop - begin));
+    string word, collapsed;
+    while (words >> word)
+        collapsed += (collapsed.empty() ? "" : " ") + word;
+    return collapsed;
+}
+
+void addObject(vector<Object *> &sceneObjects, Object *object)
 {
-    ifstream input("description.txt");
+    object->id = sceneObjects.size();
+    sceneObjects.push_back(object);
+}
+
+// parses a scene description into sceneObjects and sceneLights, the camera and render
+// settings go straight to the globals; meshes are only read from disk if loadMeshes
+void readDescription(const char *fileName, vector<Object *> &sceneObjects, vector<LightSource *> &sceneLights, boolean loadMeshes)
+{
+    ifstream file(fileName);
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    istringstream input(text);
+    streampos begin;
 
     input >> nearPlane >> farPlane >> fovY >> aspectRatio;
     fovX = fovY * aspectRatio;
     input >> recursionLevel >> imageWidth;
     imageHeight = imageWidth;
 
+    begin = input.tellg();
     Board *board = new Board();
     board->objectType = "board";
     input >> board->tileWidth;
@@ -38,13 +71,15 @@ void getInputs()
     board->color = Color(1, 1, 1);
     board->shininess = 0;
     board->tileCount = 200;
-    objects.push_back(board);
+    board->source = entryText(text, input, begin);
+    addObject(sceneObjects, board);
 
     int noOfObjects;
     input >> noOfObjects;
 
     for (int i = 0; i < noOfObjects; i++)
     {
+        begin = input.tellg();
         string objectType;
         input >> objectType;
 
@@ -57,7 +92,8 @@ void getInputs()
             input >> sphere->color.r >> sphere->color.g >> sphere->color.b;
             input >> sphere->lightCoefficients.ambient >> sphere->lightCoefficients.diffuse >> sphere->lightCoefficients.specular >> sphere->lightCoefficients.reflection;
             input >> sphere->shininess;
-            objects.push_back(sphere);
+            sphere->source = entryText(text, input, begin);
+            addObject(sceneObjects, sphere);
         }
         else if (objectType == "pyramid")
         {
@@ -68,7 +104,9 @@ void getInputs()
             input >> pyramid->color.r >> pyramid->color.g >> pyramid->color.b;
             input >> pyramid->lightCoefficients.ambient >> pyramid->lightCoefficients.diffuse >> pyramid->lightCoefficients.specular >> pyramid->lightCoefficients.reflection;
             input >> pyramid->shininess;
-            objects.push_back(pyramid);
+            pyramid->calculateAllSides();
+            pyramid->source = entryText(text, input, begin);
+            addObject(sceneObjects, pyramid);
         }
         else if (objectType == "cube")
         {
@@ -79,7 +117,48 @@ void getInputs()
             input >> cube->color.r >> cube->color.g >> cube->color.b;
             input >> cube->lightCoefficients.ambient >> cube->lightCoefficients.diffuse >> cube->lightCoefficients.specular >> cube->lightCoefficients.reflection;
             input >> cube->shininess;
-            objects.push_back(cube);
+            cube->source = entryText(text, input, begin);
+            addObject(sceneObjects, cube);
+        }
+        else if (objectType == "mesh")
+        {
+            Mesh *mesh = new Mesh();
+            mesh->objectType = objectType;
+            input >> mesh->fileName;
+            input >> mesh->offset.x >> mesh->offset.y >> mesh->offset.z;
+            input >> mesh->scale;
+            input >> mesh->color.r >> mesh->color.g >> mesh->color.b;
+            input >> mesh->lightCoefficients.ambient >> mesh->lightCoefficients.diffuse >> mesh->lightCoefficients.specular >> mesh->lightCoefficients.reflection;
+            input >> mesh->shininess;
+            mesh->source = entryText(text, input, begin);
+            if (!loadMeshes || mesh->load())
+                addObject(sceneObjects, mesh);
+            else
+                delete mesh;
+        }
+        else if (objectType == "instance")
+        {
+            Instance *instance = new Instance();
+            instance->objectType = objectType;
+            input >> instance->assetName;
+            double matrix[3][4];
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 4; c++)
+                    input >> matrix[r][c];
+            input >> instance->color.r >> instance->color.g >> instance->color.b;
+            input >> instance->lightCoefficients.ambient >> instance->lightCoefficients.diffuse >> instance->lightCoefficients.specular >> instance->lightCoefficients.reflection;
+            input >> instance->shininess;
+            instance->source = entryText(text, input, begin);
+
+            // assets are shared, so even a reload only reads an OBJ file the first time
+            instance->asset = instanceAsset(instance->assetName);
+            boolean invertible = instance->setTransform(matrix);
+            if (!invertible)
+                cout << "instance: the transform of " << instance->assetName << " is singular, skipped" << endl;
+            if (instance->asset && invertible)
+                addObject(sceneObjects, instance);
+            else
+                delete instance;
         }
     }
 
@@ -88,11 +167,13 @@ void getInputs()
 
     for (int i = 0; i < noOfNormalLights; i++)
     {
+        begin = input.tellg();
         NormalLightSource *normal = new NormalLightSource();
         normal->lightType = "normal";
         input >> normal->position.x >> normal->position.y >> normal->position.z;
         input >> normal->falloff;
-        lights.push_back(normal);
+        normal->source = entryText(text, input, begin);
+        sceneLights.push_back(normal);
     }
 
     int noOfSpotLights;
@@ -100,6 +181,7 @@ void getInputs()
 
     for (int i = 0; i < noOfSpotLights; i++)
     {
+        begin = input.tellg();
         SpotLightSource *spot = new SpotLightSource();
         spot->lightType = "spot";
         input >> spot->position.x >> spot->position.y >> spot->position.z;
@@ -110,142 +192,1122 @@ void getInputs()
         spot->direction.normalize();
         delete temp;
         input >> spot->cutoffAngle;
-        lights.push_back(spot);
+        // an optional penumbra angle may follow on the same line
+        string rest;
+        getline(input, rest);
+        istringstream(rest) >> spot->penumbraAngle;
+        spot->prepare();
+        spot->source = entryText(text, input, begin);
+        sceneLights.push_back(spot);
     }
 
-    input.close();
+    // area lights are optional, older scene files end after the spot lights
+    int noOfAreaLights = 0;
+    if (!(input >> noOfAreaLights))
+        noOfAreaLights = 0;
+
+    for (int i = 0; i < noOfAreaLights; i++)
+    {
+        begin = input.tellg();
+        string shape;
+        input >> shape;
+        AreaLightSource *area;
+        if (shape == "rectangle")
+        {
+            area = new AreaLightSource(AreaLightSource::RECTANGLE);
+            input >> area->corner.x >> area->corner.y >> area->corner.z;
+            input >> area->falloff;
+            input >> area->edgeU.x >> area->edgeU.y >> area->edgeU.z;
+            input >> area->edgeV.x >> area->edgeV.y >> area->edgeV.z;
+        }
+        else
+        {
+            area = new AreaLightSource(AreaLightSource::SPHERE);
+            input >> area->position.x >> area->position.y >> area->position.z;
+            input >> area->falloff;
+            input >> area->radius;
+        }
+        area->prepare();
+        area->source = entryText(text, input, begin);
+        sceneLights.push_back(area);
+    }
+}
+
+void getInputs()
+{
+    PROFILE_SCOPE("getInputs");
+    auto begin = chrono::steady_clock::now();
+    readDescription("description.txt", objects, lights, true);
+    lightGrid.build(lights, lightCutoff);
+
+    // meshes are what makes a scene slow to read, so that is when the time is worth printing
+    for (Object *object : objects)
+    {
+        if (object->objectType == "mesh")
+        {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+            cout << "scene: read in " << seconds << "s" << (useMeshCache ? "" : " (mesh cache off)") << endl;
+            break;
+        }
+    }
 }
 
-void generateBmp()
+// pixels of the frame, x to the right and y down from the top left
+class PixelRect
 {
-    static int imgCount = 1;
+public:
+    int x, y, width, height;
+};
 
-    Point *nearMidpoint = pos->add(look->multiply(nearPlane));
+// snapshot of the eye and the near plane grid, so a render is not affected
+// when the camera moves while it is running
+class RenderView
+{
+public:
+    Point eye;
+    Point topLeft; // center of the top left pixel on the near plane
+    Point right;   // step from one pixel to the next one in a row
+    Point down;    // step from one row to the next one
+    int width, height;
+};
 
-    double height = 2 * nearPlane * tan((fovY / 2) * (M_PI / 180));
-    double width = 2 * nearPlane * tan((fovX / 2) * (M_PI / 180));
+RenderView captureView(int width, int height)
+{
+    RenderView view;
+    view.eye = *pos;
+    view.width = width;
+    view.height = height;
 
-    // declare pointBuffer
-    vector<vector<Point *>> pointBuffer;
-    double dx = width / (double)imageWidth;
-    double dy = height / (double)imageHeight;
+    double planeHeight = 2 * nearPlane * tan((fovY / 2) * (M_PI / 180));
+    double planeWidth = 2 * nearPlane * tan((fovX / 2) * (M_PI / 180));
+    double dx = planeWidth / (double)width;
+    double dy = planeHeight / (double)height;
 
-    // get the bottom left mid point
-    Point *topLeftMid = nearMidpoint->subtract(r8->multiply(width / 2.0));
-    topLeftMid = topLeftMid->add(up->multiply(height / 2.0));
-    topLeftMid = topLeftMid->add(r8->multiply(dx / 2));
-    topLeftMid = topLeftMid->subtract(up->multiply(dy / 2));
+    // get the top left mid point
+    view.topLeft.x = pos->x + look->x * nearPlane - r8->x * (planeWidth / 2.0 - dx / 2) + up->x * (planeHeight / 2.0 - dy / 2);
+    view.topLeft.y = pos->y + look->y * nearPlane - r8->y * (planeWidth / 2.0 - dx / 2) + up->y * (planeHeight / 2.0 - dy / 2);
+    view.topLeft.z = pos->z + look->z * nearPlane - r8->z * (planeWidth / 2.0 - dx / 2) + up->z * (planeHeight / 2.0 - dy / 2);
 
-    for (int i = 0; i < imageHeight; i++)
+    view.right = Point(r8->x * dx, r8->y * dx, r8->z * dx);
+    view.down = Point(-up->x * dy, -up->y * dy, -up->z * dy);
+
+    return view;
+}
+
+Ray *primaryRay(RenderView &view, int i, int j)
+{
+    Point *point = new Point(view.topLeft.x + view.right.x * j + view.down.x * i,
+                             view.topLeft.y + view.right.y * j + view.down.y * i,
+                             view.topLeft.z + view.right.z * j + view.down.z * i);
+
+    return new Ray(point, point->subtract(&view.eye));
+}
+
+Object *findNearest(Ray *ray, double &tMin)
+{
+    tMin = -1;
+    Object *nearestObject = NULL;
+    for (int k = 0; k < objects.size(); k++)
     {
-        vector<Point *> row;
-        for (int j = 0; j < imageWidth; j++)
+        STATS_OBJECT_TEST(k);
+        double t = objects[k]->handleIntersecttion(ray);
+        if (t > 0 && (tMin < 0 || t < tMin))
+        {
+            tMin = t;
+            nearestObject = objects[k];
+        }
+    }
+
+    if (nearestObject != NULL)
+        STATS_OBJECT_HIT(nearestObject->id);
+    return nearestObject;
+}
+
+Color *traceRay(Ray *ray)
+{
+    double tMin;
+    Object *nearestObject = findNearest(ray, tMin);
+
+    if (nearestObject == NULL || tMin > farPlane) // no intersection or intersection beyond far plane
+        return new Color(0, 0, 0);
+
+    Point *intersectionPoint = ray->getPoint(tMin);
+    Color *color = nearestObject->recIntersection(ray, intersectionPoint, tMin, recursionLevel);
+    delete intersectionPoint;
+    return color;
+}
+
+/////////////////////////////// G-BUFFER ///////////////////////////////
+
+// primary hit of one pixel
+class GBufferEntry
+{
+public:
+    int objectId; // -1 if the ray hit nothing
+    Point hitPoint;
+    Point normal; // facing the eye, reprojection only reuses a pixel whose normal barely turned
+    double t;
+};
+
+// primary hits of the pixels of rect into entries, a row of rect after the other
+void tracePrimary(RenderView &view, PixelRect rect, GBufferEntry *entries)
+{
+    for (int i = rect.y; i < rect.y + rect.height; i++)
+    {
+        // the primary rays are generated here, one at a time
+        PROFILE_SCOPE("ray generation and primary hits");
+        ArenaScope arenaScope;
+        for (int j = rect.x; j < rect.x + rect.width; j++)
         {
-            Point *point = topLeftMid->add(r8->multiply(j * dx));
-            point = point->subtract(up->multiply(i * dy));
-            row.push_back(point);
+            STATS_PIXEL_BEGIN();
+            STATS_COUNT(primaryRays);
+            GBufferEntry &entry = entries[(i - rect.y) * rect.width + j - rect.x];
+            Ray *ray = primaryRay(view, i, j);
+
+            Object *nearestObject = findNearest(ray, entry.t);
+            entry.objectId = nearestObject == NULL ? -1 : nearestObject->id;
+            if (nearestObject != NULL)
+            {
+                Point *hitPoint = ray->getPoint(entry.t);
+                Point *toEye = ray->dir->multiply(-1);
+                Point *normal = nearestObject->getNormal(hitPoint, toEye);
+
+                entry.hitPoint = *hitPoint;
+                entry.normal = normal == NULL ? Point() : *normal;
+
+                delete hitPoint;
+                delete toEye;
+                delete normal;
+            }
+            delete ray;
+            STATS_PIXEL_END(i * view.width + j);
         }
-        pointBuffer.push_back(row);
     }
+}
+
+// primary hits of the last render, reused while the camera and the geometry
+// stay the same so that texture or light changes only redo the shading
+class GBuffer
+{
+public:
+    RenderView view;
+    int sceneVersion;
+    boolean valid;
+    vector<GBufferEntry> entries;
+    double traceSeconds; // time the primary pass took when it was filled
+
+    long long reusedPixels, tracedPixels;
+    double savedSeconds;
 
-    // declare colorBuffer
-    vector<vector<Color *>> colorBuffer(imageHeight, vector<Color *>(imageWidth));
+    GBuffer();
+    boolean matches(RenderView &view);
+    void fill(RenderView &view);
+    void fillRows(RenderView &view, int begin, int end);
+    void report();
+};
 
+GBuffer::GBuffer()
+{
+    valid = false;
+    sceneVersion = -1;
+    traceSeconds = 0;
+    reusedPixels = tracedPixels = 0;
+    savedSeconds = 0;
+}
+
+boolean samePoint(Point &a, Point &b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+boolean GBuffer::matches(RenderView &other)
+{
+    return valid && sceneVersion == ::sceneVersion &&
+           view.width == other.width && view.height == other.height &&
+           samePoint(view.eye, other.eye) && samePoint(view.topLeft, other.topLeft) &&
+           samePoint(view.right, other.right) && samePoint(view.down, other.down);
+}
+
+void GBuffer::fill(RenderView &view)
+{
+    fillRows(view, 0, view.height);
+}
+
+// traces rows [begin, end) of the view, in order from the top; the buffer is only valid
+// once the last row is in, so a render stopped half way leaves nothing to reuse
+void GBuffer::fillRows(RenderView &view, int begin, int end)
+{
+    auto start = chrono::steady_clock::now();
+
+    if (begin == 0)
+    {
+        this->view = view;
+        sceneVersion = ::sceneVersion;
+        valid = false;
+        entries.resize(view.width * view.height);
+        traceSeconds = 0;
+    }
+
+    tracePrimary(view, PixelRect{0, begin, view.width, end - begin}, &entries[begin * view.width]);
+
+    traceSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (end == view.height)
+    {
+        valid = true;
+        tracedPixels += entries.size();
+    }
+}
+
+void GBuffer::report()
+{
+    long long total = reusedPixels + tracedPixels;
+    cout << "g-buffer: " << reusedPixels << " of " << total << " primary hits reused ("
+         << fixed << setprecision(1) << (total == 0 ? 0 : 100.0 * reusedPixels / total) << "%), "
+         << setprecision(2) << savedSeconds << "s of primary tracing saved" << endl;
+    cout.unsetf(ios::fixed);
+}
+
+GBuffer gBuffer;
+
+#ifdef RAY_STATS
+
+// prints the counters of all threads, and of the farm workers, and saves the per pixel cost as a heatmap
+void reportStats(string heatmapName)
+{
+    RayStats total;
+    {
+        lock_guard<mutex> guard(rayStatsLock);
+        for (RayStats *stats : allRayStats)
+        {
+            total.add(*stats);
+            stats->reset();
+        }
+    }
+    total.objectTests.resize(objects.size(), 0);
+    total.objectHits.resize(objects.size(), 0);
+
+    cout << "---------------- ray statistics ----------------" << endl;
+    cout << left << setw(20) << "primary rays" << total.primaryRays << endl;
+    cout << setw(20) << "shadow rays" << total.shadowRays << endl;
+    cout << setw(20) << "reflection rays" << total.reflectionRays << endl;
+    cout << setw(20) << "triangle tests" << total.triangleTests << endl;
+    cout << setw(20) << "rect tests" << total.rectTests << endl;
+    cout << setw(20) << "culled lights" << total.culledLights << endl;
+    cout << setw(20) << "sorted reflections" << total.sortedReflections << " (" << total.sortedReflectionsUsed << " shaded)" << endl;
+    long long cacheMisses = frameCacheMisses.read();
+    if (cacheMisses >= 0)
+        cacheMisses += total.cacheMisses;
+    cout << setw(20) << "cache misses" << (cacheMisses < 0 ? string("no counter") : to_string(cacheMisses)) << endl;
+
+    // intersection tests by primitive type
+    vector<string> types;
+    for (Object *object : objects)
+        if (find(types.begin(), types.end(), object->objectType) == types.end())
+            types.push_back(object->objectType);
+
+    cout << setw(12) << "type" << setw(16) << "tests" << setw(16) << "hits" << endl;
+    for (string type : types)
+    {
+        long long tests = 0, hits = 0;
+        for (Object *object : objects)
+        {
+            if (object->objectType != type)
+                continue;
+            tests += total.objectTests[object->id];
+            hits += total.objectHits[object->id];
+        }
+        cout << setw(12) << type << setw(16) << tests << setw(16) << hits << endl;
+    }
+
+    cout << setw(12) << "object" << setw(16) << "tests" << setw(16) << "hits" << endl;
+    for (Object *object : objects)
+        cout << setw(12) << (to_string(object->id) + " " + object->objectType) << setw(16) << total.objectTests[object->id] << setw(16) << total.objectHits[object->id] << endl;
+    cout << right;
+
+    // per pixel time
+    if (pixelCost.size() != imageWidth * imageHeight)
+        return;
+
+    double maxCost = 0, sumCost = 0;
+    for (double cost : pixelCost)
+    {
+        maxCost = max(maxCost, cost);
+        sumCost += cost;
+    }
+
+    // a few very slow pixels should not wash out the rest of the heatmap
+    vector<double> sorted = pixelCost;
+    nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+    double scale = sorted[sorted.size() * 99 / 100];
+    if (scale <= 0)
+        scale = maxCost;
+
+    cout << fixed << setprecision(2) << "pixel time: average " << sumCost / pixelCost.size() * 1e6 << "us, 99th percentile "
+         << scale * 1e6 << "us, max " << maxCost * 1e6 << "us" << endl;
+    cout.unsetf(ios::fixed);
+
+    bitmap_image heatmap(imageWidth, imageHeight);
     for (int i = 0; i < imageHeight; i++)
     {
         for (int j = 0; j < imageWidth; j++)
         {
-            Ray *ray = new Ray(pointBuffer[i][j]->copy(), pointBuffer[i][j]->subtract(pos));
+            double cost = scale > 0 ? min(1.0, pixelCost[i * imageWidth + j] / scale) : 0;
+            rgb_store color = jet_colormap[min(999, (int)(cost * 999))];
+            heatmap.set_pixel(j, i, color.red, color.green, color.blue);
+        }
+    }
+    heatmap.save_image(heatmapName);
+    cout << "heatmap saved to " << heatmapName << endl;
+    cout << "------------------------------------------------" << endl;
+}
+
+#endif
+
+int imageCount = 1;
+
+string nextImageName()
+{
+    return "images/out" + to_string(imageCount++) + ".bmp";
+}
+
+// the pixels go straight into the mapped file, through a bitmap_image where it cannot be mapped;
+// BMP rows are BGR, the swap runs in the SIMD pixel kernels
+void saveBmp(vector<unsigned char> &pixels, int width, int height, string imageName)
+{
+    PROFILE_SCOPE("save bmp");
+    mapped_bitmap file;
+    if (file.create(imageName, width, height))
+    {
+        for (int i = 0; i < height; i++)
+            pixel_kernels().swap_outer(&pixels[i * width * 3], file.row(i), width);
+        return;
+    }
+
+    bitmap_image bmpFile(width, height);
+    for (int i = 0; i < height; i++)
+        pixel_kernels().swap_outer(&pixels[i * width * 3], bmpFile.row(i), width);
+
+    bmpFile.save_image(imageName);
+}
+
+// 8-bit BT.601 studio range planes of interleaved RGB pixels, a block at a time through the
+// SIMD pixel kernels: the weighted sums of the channels in [0, 1] in one pass, rounded to bytes
+void rgbToYCbCr(const unsigned char *pixels, unsigned char *Y, unsigned char *Cb, unsigned char *Cr, int count)
+{
+    const int BLOCK = 256;
+    static const pixel_transform bt601 = {{0, 1, 2}, 255.0,
+                                          {{65.481, 128.553, 24.966}, {-37.797, -74.203, 112.0}, {112.0, -93.786, -18.214}},
+                                          1.0, {16, 128, 128}, -INFINITY, INFINITY};
+    unsigned char *planes[3] = {Y, Cb, Cr};
+
+    const bitmap_kernels &kernels = pixel_kernels();
+    double values[3][BLOCK];
+    double *destination[3] = {values[0], values[1], values[2]};
+    for (int i = 0; i < count; i += BLOCK)
+    {
+        int n = min(BLOCK, count - i);
+        kernels.transform(pixels + i * 3, n, bt601, destination);
+        for (int p = 0; p < 3; p++)
+            kernels.from_double(values[p], planes[p] + i, n, 1.0, round_bytes);
+    }
+}
+
+//////////////////////////// SORTED REFLECTIONS ////////////////////////////
+
+// the first reflections off curved surfaces leave in every direction, traced in pixel order
+// every ray walks different objects and BVH nodes; instead the reflections of a band of rows
+// are traced ahead, sorted by direction octant and then by the Morton code of their start,
+// and the shading picks up the hits; --no-ray-sort traces them in pixel order while shading
+boolean sortReflections = true;
+const int REFLECTION_BAND = 16; // rows whose reflections are sorted together
+
+// spreads the low 10 bits of x out to every third bit
+uint32_t spreadBits(uint32_t x)
+{
+    x &= 0x3FF;
+    x = (x | x << 16) & 0x030000FF;
+    x = (x | x << 8) & 0x0300F00F;
+    x = (x | x << 4) & 0x030C30C3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+// traces the first reflections of the hits of rect into hits, one per pixel of rect; the walk
+// over the lights of every hit goes ahead up to the first lit one, the rays leave off the normal
+// facing that light exactly as recIntersection builds them, and pixels lit by none are skipped
+void traceReflections(RenderView &view, PixelRect rect, GBufferEntry *entries, vector<ReflectionHit> &hits)
+{
+    PROFILE_SCOPE("trace reflections");
+
+    class PendingRay
+    {
+    public:
+        uint32_t key;
+        int pixel; // in rect
+        Ray *ray;
+        Object *object; // that reflects it
+    };
+
+    vector<PendingRay> pending;
+    double lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    hits.assign(rect.width * rect.height, ReflectionHit{false, -1, -1, 0, 0, 0, 0});
+    for (int i = 0; i < rect.height; i++)
+    {
+        for (int j = 0; j < rect.width; j++)
+        {
+            int pixel = i * rect.width + j;
+            GBufferEntry &entry = entries[pixel];
+            if (entry.objectId < 0 || entry.t > farPlane || entry.t <= EPSILON)
+                continue;
+
+            Object *object = objects[entry.objectId];
+            LightSource *light = object->firstLitLight(&entry.hitPoint, hits[pixel]);
+            if (light == NULL)
+                continue;
 
-            double tMin = -1;
-            Object *nearestObject = NULL;
-            for (int k = 0; k < objects.size(); k++)
+            Point *toSource = light->position.subtract(&entry.hitPoint);
+            toSource->normalize();
+            Point *N = object->getNormal(&entry.hitPoint, toSource);
+            N->normalize();
+
+            Ray *ray = primaryRay(view, rect.y + i, rect.x + j);
+            Point *R = reflectDirection(ray->dir, N);
+            Ray *reflected = reflectedRayFrom(&entry.hitPoint, R);
+            pending.push_back(PendingRay{0, pixel, reflected, object});
+            for (int k = 0; k < 3; k++)
             {
-                double t = objects[k]->handleIntersecttion(ray);
-                if (t > 0 && (tMin < 0 || t < tMin))
-                {
-                    tMin = t;
-                    nearestObject = objects[k];
-                }
+                lo[k] = min(lo[k], axisOf(*reflected->start, k));
+                hi[k] = max(hi[k], axisOf(*reflected->start, k));
             }
+            delete R;
+            delete ray;
+            delete N;
+            delete toSource;
+        }
+    }
 
-            Color *color;
-            if (nearestObject == NULL || tMin > farPlane) // no intersection or intersection beyond far plane
+    // octant in the top bits, then the start on a 1024^3 grid over the band's reflection points
+    for (PendingRay &p : pending)
+    {
+        Point &dir = *p.ray->dir, &start = *p.ray->start;
+        uint32_t octant = (dir.x < 0) | (dir.y < 0) << 1 | (dir.z < 0) << 2;
+        uint32_t cell[3];
+        for (int k = 0; k < 3; k++)
+            cell[k] = hi[k] > lo[k] ? (uint32_t)(1023 * (axisOf(start, k) - lo[k]) / (hi[k] - lo[k])) : 0;
+        p.key = octant << 30 | spreadBits(cell[0]) | spreadBits(cell[1]) << 1 | spreadBits(cell[2]) << 2;
+    }
+    sort(pending.begin(), pending.end(), [](const PendingRay &a, const PendingRay &b) {
+        return a.key < b.key;
+    });
+
+    for (PendingRay &p : pending)
+    {
+        STATS_COUNT(sortedReflections);
+        ReflectionHit &hit = hits[p.pixel];
+        Object *nearestObject = p.object->nearestReflected(p.ray, hit.t);
+        hit.objectId = nearestObject == NULL ? -1 : nearestObject->id;
+        delete p.ray;
+    }
+}
+
+// shades the primary hit of pixel (i, j) into 3 RGB bytes, with its first reflection
+// already traced if reflection is not NULL
+void shadePixel(RenderView &view, int i, int j, GBufferEntry &entry, unsigned char *pixel, ReflectionHit *reflection = NULL)
+{
+    Color *color;
+    if (entry.objectId < 0 || entry.t > farPlane) // no intersection or intersection beyond far plane
+    {
+        color = new Color(0, 0, 0);
+    }
+    else
+    {
+        STATS_PIXEL_BEGIN();
+        Ray *ray = primaryRay(view, i, j);
+        Point *intersectionPoint = entry.hitPoint.copy();
+        preparedReflection = reflection;
+        color = objects[entry.objectId]->recIntersection(ray, intersectionPoint, entry.t, recursionLevel);
+        preparedReflection = NULL;
+        delete intersectionPoint;
+        delete ray;
+        STATS_PIXEL_END(i * view.width + j);
+    }
+
+    color->adjust();
+    pixel[0] = 255 * color->r;
+    pixel[1] = 255 * color->g;
+    pixel[2] = 255 * color->b;
+    delete color;
+}
+
+// shades the primary hits of rect into its RGB bytes, rows from the top; the first reflections
+// of every REFLECTION_BAND rows are traced ahead in sorted order
+void shadeRect(RenderView &view, PixelRect rect, GBufferEntry *entries, unsigned char *pixels)
+{
+    // with one level there are no reflections
+    boolean sorted = sortReflections && recursionLevel > 1;
+    vector<ReflectionHit> reflections;
+    int bandBegin = 0;
+
+    for (int i = 0; i < rect.height; i++)
+    {
+        if (sorted && i % REFLECTION_BAND == 0)
+        {
+            ArenaScope arenaScope;
+            bandBegin = i;
+            PixelRect band = {rect.x, rect.y + i, rect.width, min(REFLECTION_BAND, rect.height - i)};
+            traceReflections(view, band, &entries[i * rect.width], reflections);
+        }
+
+        PROFILE_SCOPE("shade");
+        ArenaScope arenaScope;
+        for (int j = 0; j < rect.width; j++)
+        {
+            int pixel = i * rect.width + j;
+            ReflectionHit *reflection = sorted ? &reflections[(i - bandBegin) * rect.width + j] : NULL;
+            shadePixel(view, rect.y + i, rect.x + j, entries[pixel], &pixels[pixel * 3], reflection);
+        }
+    }
+}
+
+// traces the pixels of rect into its RGB bytes, for renders that do not keep the primary hits
+void renderRect(RenderView &view, PixelRect rect, vector<GBufferEntry> &entries, unsigned char *pixels)
+{
+    entries.resize(rect.width * rect.height);
+    tracePrimary(view, rect, entries.data());
+    shadeRect(view, rect, entries.data(), pixels);
+}
+
+// traces one frame into RGB bytes, row 0 is the top of the image
+void renderFrame(RenderView &view, vector<unsigned char> &pixels, boolean showProgress)
+{
+    PROFILE_SCOPE("render frame");
+    STATS_FRAME_BEGIN(view.width * view.height);
+
+    // only the shading has to be redone if the primary hits are still valid
+    if (gBuffer.matches(view))
+    {
+        gBuffer.reusedPixels += gBuffer.entries.size();
+        gBuffer.savedSeconds += gBuffer.traceSeconds;
+    }
+    else
+    {
+        gBuffer.fill(view);
+    }
+
+    pixels.resize(view.width * view.height * 3);
+
+    for (int i = 0; i < view.height; i += REFLECTION_BAND)
+    {
+        int end = min(i + REFLECTION_BAND, view.height);
+        PixelRect band = {0, i, view.width, end - i};
+        shadeRect(view, band, &gBuffer.entries[i * view.width], &pixels[i * view.width * 3]);
+
+        for (int row = i; row < end && showProgress; row++)
+            if (row % 70 == 0)
+                cout << "generating: " << (row * 100) / view.height << "%" << endl;
+    }
+}
+
+// saves and loads a size x size BMP through the streams and through mmap and writev and prints
+// the best of a few passes of each; the file stays in the page cache, so this measures the
+// copies and the system calls rather than the disk
+// every load is followed by one pass over the pixels, a mapped file is only read when they are
+void bmpBenchmark(int size)
+{
+    const int PASSES = 5;
+    const string fileName = "images/bmp-bench.bmp";
+
+    vector<unsigned char> pixels(size * size * 3);
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            unsigned char *pixel = &pixels[(y * size + x) * 3];
+            pixel[0] = x * 7 + y;
+            pixel[1] = x ^ y;
+            pixel[2] = y * 3;
+        }
+    }
+    bitmap_image image(size, size);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            image.set_pixel(x, y, pixels[(y * size + x) * 3], pixels[(y * size + x) * 3 + 1], pixels[(y * size + x) * 3 + 2]);
+    double megabytes = (54 + (double)mapped_bitmap::padded_row_size(size) * size) / (1 << 20);
+
+    // the passes of the variants take turns, so the writeback of one does not slow only the next
+    typedef pair<const char *, function<void()>> Variant;
+    auto throughput = [&](vector<Variant> variants) {
+        vector<double> best(variants.size(), 1e30);
+        for (int pass = 0; pass < PASSES; pass++)
+        {
+            for (int v = 0; v < variants.size(); v++)
             {
-                color = new Color(0, 0, 0);
+                auto begin = chrono::steady_clock::now();
+                variants[v].second();
+                best[v] = min(best[v], chrono::duration<double>(chrono::steady_clock::now() - begin).count());
             }
-            else
+        }
+        for (int v = 0; v < variants.size(); v++)
+            cout << "  " << variants[v].first << ": " << megabytes / best[v] << " MB/s" << endl;
+    };
+
+    // the same pass for every loader
+    auto sumRows = [&](function<const unsigned char *(int)> row, int width, int height) {
+        uint64_t sum = 0;
+        for (int y = 0; y < height; y++)
+        {
+            const unsigned char *bytes = row(y);
+            for (int x = 0; x < 3 * width; x++)
+                sum += bytes[x];
+        }
+        return sum;
+    };
+
+    cout << "bmp: " << size << "x" << size << ", " << megabytes << " MB, best of " << PASSES << endl;
+    throughput({
+        Variant("save a bitmap_image, stream", [&]() { image.save_image(fileName, bitmap_image::stream_io); }),
+        Variant("save a bitmap_image, writev", [&]() { image.save_image(fileName, bitmap_image::system_io); }),
+        Variant("save RGB pixels, through a bitmap_image and stream", [&]() {
+            bitmap_image bmpFile(size, size);
+            for (int y = 0; y < size; y++)
+                for (int x = 0; x < size; x++)
+                    bmpFile.set_pixel(x, y, pixels[(y * size + x) * 3], pixels[(y * size + x) * 3 + 1], pixels[(y * size + x) * 3 + 2]);
+            bmpFile.save_image(fileName, bitmap_image::stream_io);
+        }),
+        Variant("save RGB pixels, into the mapped file (saveBmp)", [&]() { saveBmp(pixels, size, size, fileName); }),
+    });
+
+    uint64_t expected = sumRows([&](int y) { return image.row(y); }, size, size), sums[3];
+    bitmap_image streamed, mapped;
+    throughput({
+        Variant("load into a bitmap_image, stream", [&]() {
+            streamed.load_image(fileName, bitmap_image::stream_io);
+            sums[0] = sumRows([&](int y) { return streamed.row(y); }, streamed.width(), streamed.height());
+        }),
+        Variant("load into a bitmap_image, mmap", [&]() {
+            mapped.load_image(fileName, bitmap_image::system_io);
+            sums[1] = sumRows([&](int y) { return mapped.row(y); }, mapped.width(), mapped.height());
+        }),
+        Variant("load rows in place, mmap", [&]() {
+            mapped_bitmap file;
+            file.open(fileName);
+            sums[2] = sumRows([&](int y) { return file.row(y); }, file.width(), file.height());
+        }),
+    });
+
+    boolean same = sums[0] == expected && sums[1] == expected && sums[2] == expected &&
+                   memcmp(streamed.data(), image.data(), 3 * size * size) == 0 && memcmp(mapped.data(), image.data(), 3 * size * size) == 0;
+    cout << "bmp: every load " << (same ? "matches" : "DIFFERS FROM") << " the saved image" << endl;
+    remove(fileName.c_str());
+}
+
+// runs every kernel set this CPU has on the same inputs as the scalar kernels and compares the
+// results bit for bit, then times each set on a 1920x1080 frame; the inputs mix random values
+// with the edge cases: 0, -0, halves, the clamp bounds, huge values, infinities and NaN
+void pixelKernelReport()
+{
+    const int COUNT = 65536 + 37; // leaves a tail for the scalar loops after the vector ones
+    mt19937 random(1805093);
+    uniform_real_distribution<double> uniform(-0.5, 1.5);
+    const double special[] = {0.0, -0.0, 0.5, -0.5, 1.5, 2.5, 1.0 / 256, 255.0 / 256, 1.0, 255.0, 255.5, 256.0, -1.0,
+                              1e10, -1e10, 3e9, -3e9, INFINITY, -INFINITY, NAN, 1e-310};
+
+    vector<unsigned char> bytes(3 * COUNT);
+    vector<double> doubles(3 * COUNT);
+    vector<float> floats(3 * COUNT);
+    for (int i = 0; i < 3 * COUNT; i++)
+    {
+        bytes[i] = random();
+        doubles[i] = i % 7 == 0 ? special[random() % (sizeof(special) / sizeof(special[0]))] : uniform(random) * (i % 3 == 0 ? 256 : 1);
+        floats[i] = doubles[i];
+    }
+    const double gray[3] = {0.299, 0.587, 0.114}, ycbcr[3] = {-37.945, -74.494, 112.439};
+
+    // every kernel with every mode, the outputs of one set concatenated
+    auto run = [&](const bitmap_kernels &k) {
+        vector<unsigned char> out;
+        auto add = [&](const void *data, size_t size) {
+            out.insert(out.end(), (const unsigned char *)data, (const unsigned char *)data + size);
+        };
+        vector<unsigned char> planes(3 * COUNT), pixels(3 * COUNT);
+        vector<float> f(COUNT);
+        vector<double> d(COUNT);
+
+        k.deinterleave(bytes.data(), &planes[0], &planes[COUNT], &planes[2 * COUNT], COUNT);
+        add(planes.data(), planes.size());
+        k.interleave(&bytes[0], &bytes[COUNT], &bytes[2 * COUNT], pixels.data(), COUNT);
+        add(pixels.data(), pixels.size());
+        k.swap_outer(bytes.data(), pixels.data(), COUNT);
+        add(pixels.data(), pixels.size());
+        k.swap_outer(pixels.data(), pixels.data(), COUNT - 5);
+        add(pixels.data(), pixels.size());
+        for (double divisor : {1.0, 255.0, 256.0})
+        {
+            k.to_float(bytes.data(), f.data(), COUNT, divisor);
+            add(f.data(), f.size() * sizeof(float));
+            k.to_double(bytes.data(), d.data(), COUNT, divisor);
+            add(d.data(), d.size() * sizeof(double));
+        }
+        for (byte_conversion conversion : {wrap_bytes, clamp_bytes, round_bytes})
+        {
+            for (double scale : {1.0, 256.0})
             {
-                Point *intersectionPoint = ray->getPoint(tMin);
-                color = nearestObject->recIntersection(ray, intersectionPoint, tMin, recursionLevel);
-                delete intersectionPoint;
+                k.from_float(floats.data(), planes.data(), 3 * COUNT, scale, conversion);
+                add(planes.data(), planes.size());
+                k.from_double(doubles.data(), planes.data(), 3 * COUNT, scale, conversion);
+                add(planes.data(), planes.size());
             }
-            colorBuffer[i][j] = color;
-            delete ray;
         }
+        k.combine(&doubles[0], &doubles[COUNT], &doubles[2 * COUNT], d.data(), COUNT, gray, 1.0, 0.0, -INFINITY, INFINITY);
+        add(d.data(), d.size() * sizeof(double));
+        k.combine(&doubles[0], &doubles[COUNT], &doubles[2 * COUNT], d.data(), COUNT, ycbcr, 1.0 / 256, 128.0, 1.0, 254.0);
+        add(d.data(), d.size() * sizeof(double));
+        vector<double> t(3 * COUNT);
+        double *all[3] = {&t[0], &t[COUNT], &t[2 * COUNT]}, *first[3] = {&t[0], NULL, NULL};
+        const pixel_transform toYcbcr = {{2, 1, 0}, 1.0, {{65.738, 129.057, 25.064}, {-37.945, -74.494, 112.439}, {112.439, -94.154, -18.285}}, 1.0 / 256, {16, 128, 128}, 1.0, 254.0};
+        const pixel_transform toGray = {{1, 2, 0}, 255.0, {{0.299, 0.587, 0.114}, {0, 0, 0}, {0, 0, 0}}, 1.0, {0, 0, 0}, -INFINITY, INFINITY};
+        k.transform(bytes.data(), COUNT, toYcbcr, all);
+        k.transform(bytes.data(), COUNT - 3, toGray, first);
+        add(t.data(), t.size() * sizeof(double));
+        return out;
+    };
+
+    vector<const bitmap_kernels *> sets = supported_pixel_kernels();
+    const bitmap_kernels *picked = &pixel_kernels();
+    vector<unsigned char> expected = run(*sets[0]);
+    boolean allMatch = true;
+    for (int s = 1; s < sets.size(); s++)
+    {
+        vector<unsigned char> got = run(*sets[s]);
+        size_t differ = 0;
+        for (size_t i = 0; i < expected.size(); i++)
+            differ += got[i] != expected[i];
+        cout << "kernels: " << sets[s]->name << " " << (differ == 0 ? "matches" : "DIFFERS FROM") << " scalar";
+        if (differ > 0)
+            cout << " in " << differ << " of " << expected.size() << " bytes";
+        cout << endl;
+        allMatch = allMatch && differ == 0;
+    }
+    if (sets.size() == 1)
+        cout << "kernels: this CPU only runs the scalar kernels" << endl;
 
-        if (i % 70 == 0)
+    const int WIDTH = 1920, HEIGHT = 1080, PASSES = 5;
+    vector<unsigned char> frame(WIDTH * HEIGHT * 3), planes(frame.size());
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = random();
+    bitmap_image image(WIDTH, HEIGHT);
+    vector<double> y(WIDTH * HEIGHT), cb(WIDTH * HEIGHT), cr(WIDTH * HEIGHT);
+
+    auto megapixels = [&](function<void()> work) {
+        double best = 1e30;
+        for (int pass = 0; pass < PASSES; pass++)
         {
-            cout << "generating: " << (i * 100) / imageHeight << "%" << endl;
+            auto begin = chrono::steady_clock::now();
+            work();
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
         }
-    }
+        return WIDTH * HEIGHT / best / 1e6;
+    };
 
-    bitmap_image bmpFile(imageWidth, imageHeight);
-    for (int i = 0; i < imageHeight; i++)
+    cout << "kernels: Mpixels/s on a " << WIDTH << "x" << HEIGHT << " frame, best of " << PASSES << endl;
+    cout << "         swap RB   y4m planes   grayscale   export ycbcr   import ycbcr" << endl;
+    for (const bitmap_kernels *k : sets)
     {
-        for (int j = 0; j < imageWidth; j++)
+        use_pixel_kernels(k->name);
+        double swap = megapixels([&]() { pixel_kernels().swap_outer(frame.data(), image.row(0), WIDTH * HEIGHT); });
+        double y4m = megapixels([&]() { rgbToYCbCr(frame.data(), &planes[0], &planes[WIDTH * HEIGHT], &planes[2 * WIDTH * HEIGHT], WIDTH * HEIGHT); });
+        double grayscale = megapixels([&]() {
+            pixel_kernels().swap_outer(frame.data(), image.row(0), WIDTH * HEIGHT);
+            image.convert_to_grayscale();
+        });
+        double exportYcbcr = megapixels([&]() { image.export_ycbcr(y.data(), cb.data(), cr.data()); });
+        double importYcbcr = megapixels([&]() { image.import_ycbcr(y.data(), cb.data(), cr.data()); });
+        cout << fixed << setprecision(0) << "  " << left << setw(7) << k->name << right << setw(8) << swap << setw(13) << y4m
+             << setw(12) << grayscale << setw(15) << exportYcbcr << setw(15) << importYcbcr << endl;
+        cout.unsetf(ios::fixed);
+    }
+    use_pixel_kernels(picked->name);
+    cout << "kernels: " << picked->name << " in use" << (allMatch ? "" : ", the sets DISAGREE") << endl;
+}
+
+// builds every level of a size x size image pyramid the old way, a bitmap_image::subsample call
+// per level, and as an image_pyramid on one and on every hardware thread, prints the best of a
+// few passes of each and checks that the threads do not change a sample and that level 1 of the
+// box pyramid is what subsample gives
+void pyramidBenchmark(int size)
+{
+    const int PASSES = 5;
+    unsigned int threads = max(1u, thread::hardware_concurrency());
+
+    bitmap_image image(size, size);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            image.set_pixel(x, y, x * 7 + y, x ^ y, y * 3);
+
+    auto best = [&](function<void()> build) {
+        double seconds = 1e30;
+        for (int pass = 0; pass < PASSES; pass++)
         {
-            colorBuffer[i][j]->adjust();
-            bmpFile.set_pixel(j, i, 255 * colorBuffer[i][j]->r, 255 * colorBuffer[i][j]->g, 255 * colorBuffer[i][j]->b);
+            auto begin = chrono::steady_clock::now();
+            build();
+            seconds = min(seconds, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
         }
+        return seconds * 1000;
+    };
+
+    vector<bitmap_image> chain;
+    image_pyramid pyramids[4];
+    cout << "pyramid: " << size << "x" << size << " RGB, " << threads << " threads, best of " << PASSES << endl;
+    cout << "  subsample per level: " << best([&]() {
+        chain.assign(1, image);
+        while (chain.back().width() > 1 || chain.back().height() > 1)
+        {
+            chain.push_back(bitmap_image());
+            chain[chain.size() - 2].subsample(chain.back());
+        }
+    }) << " ms" << endl;
+    const char *names[4] = {"box, 1 thread", "box, every thread", "gaussian, 1 thread", "gaussian, every thread"};
+    for (int p = 0; p < 4; p++)
+    {
+        image_pyramid::filter_type filter = p < 2 ? image_pyramid::box_filter : image_pyramid::gaussian_filter;
+        cout << "  image_pyramid " << names[p] << ": " << best([&]() { pyramids[p].build(image, filter, 0, p % 2 == 0 ? 1 : threads); })
+             << " ms" << endl;
+    }
+    cout << "  " << pyramids[0].levels() << " levels, " << pyramids[0].size() * sizeof(float) / (1 << 20) << " MB in one allocation" << endl;
+
+    bitmap_image level1;
+    pyramids[0].export_level(1, level1);
+    boolean sameThreads = true;
+    for (int p = 0; p < 4; p += 2)
+        sameThreads = sameThreads && memcmp(pyramids[p].level(0), pyramids[p + 1].level(0), pyramids[p].size() * sizeof(float)) == 0;
+    boolean sameSubsample = level1.width() == chain[1].width() && level1.height() == chain[1].height() &&
+                            memcmp(level1.data(), chain[1].data(), 3 * level1.width() * level1.height()) == 0;
+    cout << "pyramid: the threads " << (sameThreads ? "give the same samples" : "CHANGE THE SAMPLES") << ", level 1 "
+         << (sameSubsample ? "matches" : "DIFFERS FROM") << " subsample" << endl;
+}
+
+// renders the starting camera again and again, tracing the primary rays every time,
+// and prints the resident memory, which should not grow after the first render
+void soakRenders(int renders)
+{
+    RenderView view = captureView(imageWidth, imageHeight);
+    vector<unsigned char> pixels;
+    long firstKb = 0;
+
+    for (int render = 1; render <= renders; render++)
+    {
+        gBuffer.valid = false;
+        renderFrame(view, pixels, false);
 
-        if (i % 200 == 0)
+        if (render == 1 || render % max(1, renders / 10) == 0)
         {
-            cout << "saving: " << (i * 100) / imageHeight << "%" << endl;
+            long kb = residentKb();
+            if (render == 1)
+                firstKb = kb;
+            cout << "render " << render << ": resident " << kb << " kB (" << showpos << kb - firstKb
+                 << noshowpos << " kB since the first render)" << endl;
         }
     }
+    cout << "arena: " << threadArena().peakBytes / 1024 << " kB at most for one band of " << REFLECTION_BAND << " rows" << endl;
+    // counters of all the renders, pixel times of the last one
+    STATS_REPORT("images/heat-soak.bmp");
+}
 
-    bmpFile.save_image("images/out" + to_string(imgCount) + ".bmp");
-    imgCount++;
+// renders the starting camera in double and in float and reports how far apart the images are,
+// the two renders and a heatmap of the difference are saved in images/
+void precisionReport()
+{
+    RenderView view = captureView(imageWidth, imageHeight);
+    PrecisionMode picked = tracePrecision;
+    vector<unsigned char> pixels[2];
+    double seconds[2];
+    PrecisionMode modes[2] = {DOUBLE_PRECISION, FLOAT_PRECISION};
 
-    cout << "image generated" << endl;
+    for (int m = 0; m < 2; m++)
+    {
+        tracePrecision = modes[m];
+        gBuffer.valid = false;
+        auto begin = chrono::steady_clock::now();
+        renderFrame(view, pixels[m], false);
+        seconds[m] = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        saveBmp(pixels[m], imageWidth, imageHeight, string("images/precision-") + precisionName() + ".bmp");
+    }
+    tracePrecision = picked;
+    gBuffer.valid = false;
+
+    int differentPixels = 0, maxDifference = 0;
+    double sumDifference = 0, squaredError = 0;
+    vector<int> difference(imageWidth * imageHeight);
+    for (int i = 0; i < imageWidth * imageHeight; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            int d = abs(pixels[0][i * 3 + c] - pixels[1][i * 3 + c]);
+            difference[i] = max(difference[i], d);
+            sumDifference += d;
+            squaredError += d * d;
+        }
+        differentPixels += difference[i] > 0;
+        maxDifference = max(maxDifference, difference[i]);
+    }
 
-    // free memory
+    bitmap_image heatmap(imageWidth, imageHeight);
     for (int i = 0; i < imageHeight; i++)
     {
         for (int j = 0; j < imageWidth; j++)
         {
-            delete pointBuffer[i][j];
-            delete colorBuffer[i][j];
+            int d = difference[i * imageWidth + j];
+            rgb_store color = d == 0 ? rgb_store{0, 0, 0} : jet_colormap[min(999, d * 999 / max(1, maxDifference))];
+            heatmap.set_pixel(j, i, color.red, color.green, color.blue);
+        }
+    }
+    heatmap.save_image("images/precision-diff.bmp");
+
+    double mse = squaredError / (3.0 * imageWidth * imageHeight);
+    cout << "---------------- precision ----------------" << endl;
+    cout << "double: " << seconds[0] << "s, float: " << seconds[1] << "s" << endl;
+    cout << "pixels that differ: " << differentPixels << " of " << imageWidth * imageHeight << " ("
+         << 100.0 * differentPixels / (imageWidth * imageHeight) << "%)" << endl;
+    cout << "largest difference: " << maxDifference << "/255, mean: " << sumDifference / (3.0 * imageWidth * imageHeight) << endl;
+    if (mse > 0)
+    {
+        cout << "psnr of float against double: " << 10 * log10(255.0 * 255.0 / mse) << "dB" << endl;
+
+        // the same at every level of a gaussian pyramid: single pixel noise fades on the way
+        // down, a difference in the shape of things stays
+        image_pyramid pyramids[2];
+        for (int m = 0; m < 2; m++)
+            pyramids[m].build(pixels[m].data(), imageWidth, imageHeight, 3, image_pyramid::gaussian_filter, 6);
+        cout << "psnr per level, full size first:";
+        for (int level = 0; level < pyramids[0].levels(); level++)
+        {
+            double psnr = pyramids[0].psnr(pyramids[1], level);
+            if (psnr < 1000000.0)
+                cout << " " << fixed << setprecision(1) << psnr;
+            else
+                cout << " equal";
         }
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6) << " dB" << endl;
     }
+    cout << "images/precision-double.bmp, images/precision-float.bmp and images/precision-diff.bmp saved" << endl;
 }
 
-void loadTextureIntoBuffer(vector< vector<Color*> > &buffer, string imageName)
+// builds every mesh in both BVH layouts and traces the same rays through each, half from the eye
+// and half between random points of the mesh's box, then reports the memory, the rays per second
+// and whether both layouts found the same hits
+void bvhReport()
 {
-    bitmap_image image(imageName);
-    assert(image);
+    const int RAYS = 1 << 20;
+    BvhLayout picked = bvhLayout;
+    BvhLayout layouts[2] = {BINARY_BVH, WIDE_BVH};
+
+    cout << "---------------- bvh ----------------" << endl;
+    for (Object *object : objects)
+    {
+        Mesh *mesh = dynamic_cast<Mesh *>(object);
+        if (mesh == NULL || mesh->triangleCount() == 0)
+            continue;
+
+        double lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (Point &v : mesh->vertices)
+            for (int k = 0; k < 3; k++)
+                lo[k] = min(lo[k], axisOf(v, k)), hi[k] = max(hi[k], axisOf(v, k));
+
+        mt19937 random(1805093);
+        uniform_real_distribution<double> unit(0, 1);
+        auto inBox = [&]() {
+            return Point(lo[0] + unit(random) * (hi[0] - lo[0]), lo[1] + unit(random) * (hi[1] - lo[1]), lo[2] + unit(random) * (hi[2] - lo[2]));
+        };
+        vector<Point> starts(RAYS), dirs(RAYS);
+        for (int i = 0; i < RAYS; i++)
+        {
+            starts[i] = i % 2 == 0 ? *pos : inBox();
+            Point target = inBox();
+            dirs[i] = Point(target.x - starts[i].x, target.y - starts[i].y, target.z - starts[i].z);
+            dirs[i].normalize();
+        }
+
+        class BenchRay
+        {
+        public:
+            Point *start, *dir;
+        };
 
-    const unsigned int height = image.height();
-    const unsigned int width = image.width();
+        vector<double> hits[2];
+        for (int m = 0; m < 2; m++)
+        {
+            bvhLayout = layouts[m];
+            Mesh copy;
+            copy.fileName = mesh->fileName;
+            copy.offset = mesh->offset;
+            copy.scale = mesh->scale;
+            copy.source = mesh->source;
+            if (!copy.load())
+                continue;
+
+            hits[m].resize(RAYS);
+            auto begin = chrono::steady_clock::now();
+            for (int i = 0; i < RAYS; i++)
+            {
+                BenchRay ray = {&starts[i], &dirs[i]};
+                hits[m][i] = intersectIn(&copy, &ray);
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+            cout << bvhLayoutName() << ": " << copy.bvhText() << ", " << RAYS / seconds / 1e6 << " Mrays/s" << endl;
+        }
 
-    buffer = vector< vector<Color*> >(width, vector<Color*>(height));
+        if (hits[0].size() == RAYS && hits[1].size() == RAYS)
+        {
+            int different = 0;
+            for (int i = 0; i < RAYS; i++)
+                different += hits[0][i] != hits[1][i];
+            cout << mesh->fileName << ": " << different << " of " << RAYS << " hits differ between the layouts" << endl;
+        }
+    }
+    bvhLayout = picked;
+}
 
-    for (int x = 0; x < width; ++x)
+// the texels are read from the rows where they lie in the mapped file, only a file that cannot
+// be mapped is loaded into a bitmap_image first
+void loadTexture(Texture &texture, string imageName)
+{
+    mapped_bitmap file;
+    bitmap_image image;
+    if (!file.open(imageName))
     {
-        for (int y = 0; y < height; ++y)
+        image.load_image(imageName, bitmap_image::stream_io);
+        if (!image)
         {
-            unsigned char red, green, blue;
-            image.get_pixel(x, y, red, green, blue);
+            cout << "texture: could not load " << imageName << endl;
+            return;
+        }
+    }
+
+    const unsigned int height = !file ? image.height() : file.height();
+    const unsigned int width = !file ? image.width() : file.width();
+
+    vector<float> texels(width * height * 3);
 
-            Color *color = new Color(red / 255.0, green / 255.0, blue / 255.0);
-            buffer[x][y] = color;
+    for (int y = 0; y < height; ++y)
+    {
+        // BGR either way
+        const unsigned char *row = !file ? image.row(y) : file.row(y);
+        for (int x = 0; x < width; ++x, row += 3)
+        {
+            float *texel = &texels[(y * width + x) * 3];
+            texel[0] = row[2] / 255.0f;
+            texel[1] = row[1] / 255.0f;
+            texel[2] = row[0] / 255.0f;
         }
     }
+
+    texture.build(width, height, texels);
 }
 
-void getTextureInputs(vector< vector<Color*> > &whiteBuffer, vector< vector<Color*> > &blackBuffer)
+void getTextureInputs(Texture &whiteTexture, Texture &blackTexture)
 {
-    loadTextureIntoBuffer(whiteBuffer, "assets/texture_w.bmp");
-    loadTextureIntoBuffer(blackBuffer, "assets/texture_b.bmp");
-}
\ No newline at end of file
+    PROFILE_SCOPE("getTextureInputs");
+    loadTexture(whiteTexture, "assets/texture_w.bmp");
+    loadTexture(blackTexture, "assets/texture_b.bmp");
+}
@@ -0,0 +1,190 @@
+// compressed 4-wide BVH for meshes: a node is one 64 byte cache line holding the boxes of up
+// to 4 children, each coordinate in 8 bits on a grid over the node's own box; traversal tests
+// the 4 boxes at once with SSE, falling back to a loop where SSE2 is not available
+// the boxes are decoded in float and rounded outwards, so they only ever grow; the triangles
+// are tested exactly as with the binary layout, so both find the same hits
+// --bvh binary keeps the binary tree of double precision boxes
+
+#include <cstdint>
+#include <cfloat>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+using namespace std;
+
+enum BvhLayout
+{
+    BINARY_BVH,
+    WIDE_BVH
+};
+
+BvhLayout bvhLayout = WIDE_BVH;
+
+const char *bvhLayoutName()
+{
+    return bvhLayout == WIDE_BVH ? "wide" : "binary";
+}
+
+class alignas(64) WideNode
+{
+public:
+    static const int WIDTH = 4;
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+    static const uint32_t LEAF = 0x80000000; // LEAF | count << 24 | first triangle
+    static const int MAX_LEAF_START = 1 << 24;
+
+    float origin[3];
+    float scale[3];           // a power of two
+    uint8_t lo[3][WIDTH];     // [axis][child]
+    uint8_t hi[3][WIDTH];
+    uint32_t child[WIDTH];    // EMPTY, a node index or a leaf
+
+    static boolean isLeaf(uint32_t child) { return child != EMPTY && (child & LEAF) != 0; }
+    static int leafStart(uint32_t child) { return child & (MAX_LEAF_START - 1); }
+    static int leafCount(uint32_t child) { return (child >> 24) & 0x7F; }
+
+    float decode(int axis, int q) const { return origin[axis] + (float)q * scale[axis]; }
+
+    // sets origin and scale so that the 0..255 grid covers [lo, hi] on every axis
+    void setGrid(const double lo[3], const double hi[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            float o = (float)lo[a];
+            if (o > lo[a])
+                o = nextafterf(o, -INFINITY);
+            origin[a] = o;
+
+            // 254 steps leave room for the rounding of the origin
+            double extent = max(hi[a] - o, 0.0);
+            int exponent;
+            frexp(extent / 254, &exponent);
+            scale[a] = extent > 0 ? (float)ldexp(1.0, exponent) : (float)ldexp(1.0, -100);
+        }
+    }
+
+    // the smallest grid box that contains [lo, hi], in the same float operations traversal uses
+    void setChild(int k, const double boxLo[3], const double boxHi[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            int qlo = (int)floor((boxLo[a] - origin[a]) / scale[a]);
+            qlo = max(0, min(255, qlo));
+            while (qlo > 0 && decode(a, qlo) > boxLo[a])
+                qlo--;
+
+            int qhi = (int)ceil((boxHi[a] - origin[a]) / scale[a]);
+            qhi = max(0, min(255, qhi));
+            while (qhi < 255 && decode(a, qhi) < boxHi[a])
+                qhi++;
+
+            lo[a][k] = qlo;
+            hi[a][k] = qhi;
+        }
+    }
+
+    void clearChild(int k)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a][k] = 255;
+            hi[a][k] = 0;
+        }
+        child[k] = EMPTY;
+    }
+};
+
+// a ray prepared for box tests in float
+class WideRay
+{
+public:
+    float start[3], invDir[3];
+    float margin; // the boxes grow by this much, for the rounding of the ray start to float
+
+    template <typename Real>
+    WideRay(const RayT<Real> &ray)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            start[a] = (float)ray.start[a];
+            invDir[a] = 1.0f / (float)ray.dir[a];
+        }
+        margin = 2 * FLT_EPSILON * max(fabs(start[0]), max(fabs(start[1]), fabs(start[2])));
+    }
+};
+
+// the float rounding of the slab distances, a few ulps
+const float WIDE_BVH_GROW = 1 + 8 * FLT_EPSILON;
+
+// bit k is set if the ray enters child k before tMax, tNear[k] is where
+int hitChildren(const WideNode &node, const WideRay &ray, float tMax, float tNear[4])
+{
+    const float grow = WIDE_BVH_GROW;
+
+#ifdef WIDE_BVH_SSE
+    __m128 nearT = _mm_setzero_ps();
+    __m128 farT = _mm_set1_ps(tMax * grow);
+    __m128i zero = _mm_setzero_si128();
+    for (int a = 0; a < 3; a++)
+    {
+        int loBytes, hiBytes;
+        memcpy(&loBytes, node.lo[a], 4);
+        memcpy(&hiBytes, node.hi[a], 4);
+        __m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(loBytes), zero), zero));
+        __m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hiBytes), zero), zero));
+
+        __m128 origin = _mm_set1_ps(node.origin[a]);
+        __m128 scale = _mm_set1_ps(node.scale[a]);
+        __m128 margin = _mm_set1_ps(ray.margin);
+        __m128 boxLo = _mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(qlo, scale)), margin);
+        __m128 boxHi = _mm_add_ps(_mm_add_ps(origin, _mm_mul_ps(qhi, scale)), margin);
+
+        __m128 start = _mm_set1_ps(ray.start[a]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[a]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(boxLo, start), invDir);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(boxHi, start), invDir);
+
+        // a NaN (0 * inf, the ray runs in the plane of a slab of an axis it is parallel to)
+        // makes that axis the whole line, min and max alone would pick whichever side is not NaN
+        __m128 parallel = _mm_cmpunord_ps(t1, t2);
+        __m128 slabNear = _mm_or_ps(_mm_andnot_ps(parallel, _mm_min_ps(t1, t2)), _mm_and_ps(parallel, _mm_set1_ps(-INFINITY)));
+        __m128 slabFar = _mm_or_ps(_mm_andnot_ps(parallel, _mm_max_ps(t1, t2)), _mm_and_ps(parallel, _mm_set1_ps(INFINITY)));
+        nearT = _mm_max_ps(slabNear, nearT);
+        farT = _mm_min_ps(slabFar, farT);
+    }
+    nearT = _mm_mul_ps(nearT, _mm_set1_ps(1 / grow));
+    farT = _mm_mul_ps(farT, _mm_set1_ps(grow));
+    _mm_storeu_ps(tNear, nearT);
+    return _mm_movemask_ps(_mm_cmple_ps(nearT, farT));
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        float nearT = 0, farT = tMax * grow;
+        for (int a = 0; a < 3; a++)
+        {
+            float boxLo = node.decode(a, node.lo[a][k]) - ray.margin;
+            float boxHi = node.decode(a, node.hi[a][k]) + ray.margin;
+            float t1 = (boxLo - ray.start[a]) * ray.invDir[a];
+            float t2 = (boxHi - ray.start[a]) * ray.invDir[a];
+            // as in the SSE version, a NaN slab (the ray runs in its plane) does not narrow the interval
+            if (isnan(t1) || isnan(t2))
+                continue;
+            if (t1 > t2)
+                swap(t1, t2);
+            if (t1 > nearT)
+                nearT = t1;
+            if (t2 < farT)
+                farT = t2;
+        }
+        nearT /= grow;
+        farT *= grow;
+        tNear[k] = nearT;
+        if (nearT <= farT)
+            mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
@@ -23,13 +23,1390 @@
 #define INCLUDE_BITMAP_IMAGE_HPP
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <limits>
 #include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define BITMAP_IMAGE_MMAP
+#endif
+
+
+/*
+   A 24-bit bottom-up bitmap file mapped into memory. The pixel rows are
+   used where they lie in the file (BGR, each row padded to 4 bytes), so
+   nothing is copied on load. open() maps an existing file read-only after
+   validating its headers, create() preallocates a new file of the full
+   size and maps it read-write so the rows can be written in place.
+   Where mmap is not available (Windows) both return false and the caller
+   falls back to bitmap_image's stream functions.
+*/
+class mapped_bitmap
+{
+public:
+
+   mapped_bitmap()
+   : file_(-1),
+     bytes_(0),
+     size_(0),
+     width_(0),
+     height_(0),
+     row_size_(0),
+     pixels_(0)
+   {}
+
+  ~mapped_bitmap()
+   {
+      close();
+   }
+
+   bool open(const std::string& file_name)
+   {
+      close();
+
+#ifdef BITMAP_IMAGE_MMAP
+      file_ = ::open(file_name.c_str(),O_RDONLY);
+
+      struct stat st;
+
+      if ((file_ < 0) || (0 != fstat(file_,&st)) || (st.st_size < header_size))
+      {
+         close();
+         return false;
+      }
+
+      size_ = static_cast<std::size_t>(st.st_size);
+
+      void* memory = mmap(0,size_,PROT_READ,MAP_PRIVATE,file_,0);
+
+      if (MAP_FAILED == memory)
+      {
+         bytes_ = 0;
+         close();
+         return false;
+      }
+
+      bytes_ = static_cast<unsigned char*>(memory);
+
+      // header fields are little endian whatever the machine
+      const unsigned int off_bits    = read_le(bytes_ + 10,4);
+      const unsigned int info_size   = read_le(bytes_ + 14,4);
+      const int          width       = static_cast<int>(read_le(bytes_ + 18,4));
+      const int          height      = static_cast<int>(read_le(bytes_ + 22,4));
+      const unsigned int planes      = read_le(bytes_ + 26,2);
+      const unsigned int bit_count   = read_le(bytes_ + 28,2);
+      const unsigned int compression = read_le(bytes_ + 30,4);
+
+      // negative heights are top-down files, the stream loader does not read them either
+      if (
+           (bytes_[0] != 'B') || (bytes_[1] != 'M') ||
+           (info_size < 40)   || (planes != 1)      ||
+           (bit_count != 24)  || (compression != 0) ||
+           (width <= 0)       || (height <= 0)      ||
+           !valid_size(width,height)                ||
+           (off_bits < 14ULL + info_size)
+         )
+      {
+         close();
+         return false;
+      }
+
+      width_    = static_cast<unsigned int>(width);
+      height_   = static_cast<unsigned int>(height);
+      row_size_ = padded_row_size(width_);
+
+      if (static_cast<unsigned long long>(off_bits) + static_cast<unsigned long long>(row_size_) * height_ > size_)
+      {
+         close();
+         return false;
+      }
+
+      pixels_ = bytes_ + off_bits;
+
+      madvise(bytes_,size_,MADV_SEQUENTIAL);
+
+      return true;
+#else
+      (void)file_name;
+      return false;
+#endif
+   }
+
+   bool create(const std::string& file_name, const unsigned int width, const unsigned int height)
+   {
+      close();
+
+#ifdef BITMAP_IMAGE_MMAP
+      if (!valid_size(width,height))
+         return false;
+
+      const unsigned long long size = header_size + static_cast<unsigned long long>(padded_row_size(width)) * height;
+
+      file_ = ::open(file_name.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
+
+      if ((file_ < 0) || (0 != ftruncate(file_,static_cast<off_t>(size))))
+      {
+         close();
+         return false;
+      }
+
+#ifdef __linux__
+      // reserves the blocks now, a full disk is an error here and not a SIGBUS while writing rows
+      if (0 != posix_fallocate(file_,0,static_cast<off_t>(size)))
+      {
+         close();
+         return false;
+      }
+#endif
+
+      void* memory = mmap(0,static_cast<std::size_t>(size),PROT_READ | PROT_WRITE,MAP_SHARED,file_,0);
+
+      if (MAP_FAILED == memory)
+      {
+         close();
+         return false;
+      }
+
+      bytes_    = static_cast<unsigned char*>(memory);
+      size_     = static_cast<std::size_t>(size);
+      width_    = width;
+      height_   = height;
+      row_size_ = padded_row_size(width);
+      pixels_   = bytes_ + header_size;
+
+      write_header(bytes_,width,height);
+
+      // the padding bytes of every row
+      if (row_size_ != 3 * width_)
+      {
+         for (unsigned int y = 0; y < height_; ++y)
+         {
+            std::memset(row(y) + 3 * width_,0,row_size_ - 3 * width_);
+         }
+      }
+
+      return true;
+#else
+      (void)file_name;
+      (void)width;
+      (void)height;
+      return false;
+#endif
+   }
+
+   // unmaps the file, the rows written into a created file are in it from then on
+   void close()
+   {
+#ifdef BITMAP_IMAGE_MMAP
+      if (0 != bytes_)
+      {
+         munmap(bytes_,size_);
+      }
+
+      if (file_ >= 0)
+      {
+         ::close(file_);
+      }
+#endif
+
+      file_     = -1;
+      bytes_    = 0;
+      size_     = 0;
+      width_    = 0;
+      height_   = 0;
+      row_size_ = 0;
+      pixels_   = 0;
+   }
+
+   inline bool operator!() const
+   {
+      return (0 == pixels_);
+   }
+
+   inline unsigned int width() const
+   {
+      return width_;
+   }
+
+   inline unsigned int height() const
+   {
+      return height_;
+   }
+
+   // bytes from one row to the next, 3 * width rounded up to 4
+   inline unsigned int row_size() const
+   {
+      return row_size_;
+   }
+
+   // row y counted from the top as in bitmap_image, BGR; the file stores the bottom row first
+   inline const unsigned char* row(const unsigned int y) const
+   {
+      return pixels_ + static_cast<std::size_t>(height_ - y - 1) * row_size_;
+   }
+
+   // only to be written after create()
+   inline unsigned char* row(const unsigned int y)
+   {
+      return pixels_ + static_cast<std::size_t>(height_ - y - 1) * row_size_;
+   }
+
+   enum { header_size = 54 };
+
+   // whether a 24-bit image of this size can be held, its padded rows and bitmap_image's
+   // unpadded pixels both indexed in 32 bits
+   static inline bool valid_size(const unsigned int width, const unsigned int height)
+   {
+      return (0 != width) && (0 != height) && (width <= 0x7FFFFFFF / 3) && (height <= 0x7FFFFFFF) &&
+             (header_size + static_cast<unsigned long long>(padded_row_size(width)) * height <= 0xFFFFFFFF);
+   }
+
+   static inline unsigned int padded_row_size(const unsigned int width)
+   {
+      return (3 * width + 3) & ~3u;
+   }
+
+   // the file and information headers of a 24-bit bottom-up file
+   static inline void write_header(unsigned char* bytes, const unsigned int width, const unsigned int height)
+   {
+      const unsigned int size_image = padded_row_size(width) * height;
+
+      std::memset(bytes,0,header_size);
+
+      bytes[0] = 'B';
+      bytes[1] = 'M';
+      write_le(bytes +  2,4,header_size + size_image);
+      write_le(bytes + 10,4,header_size);
+      write_le(bytes + 14,4,40);
+      write_le(bytes + 18,4,width);
+      write_le(bytes + 22,4,height);
+      write_le(bytes + 26,2,1);
+      write_le(bytes + 28,2,24);
+      write_le(bytes + 34,4,size_image);
+   }
+
+private:
+
+   mapped_bitmap(const mapped_bitmap&);
+   mapped_bitmap& operator=(const mapped_bitmap&);
+
+   static inline unsigned int read_le(const unsigned char* bytes, const int count)
+   {
+      unsigned int v = 0;
+
+      for (int i = count - 1; i >= 0; --i)
+      {
+         v = (v << 8) | bytes[i];
+      }
+
+      return v;
+   }
+
+   static inline void write_le(unsigned char* bytes, const int count, unsigned int v)
+   {
+      for (int i = 0; i < count; ++i, v >>= 8)
+      {
+         bytes[i] = static_cast<unsigned char>(v & 0xFF);
+      }
+   }
+
+   int            file_;
+   unsigned char* bytes_;
+   std::size_t    size_;
+   unsigned int   width_;
+   unsigned int   height_;
+   unsigned int   row_size_;
+   unsigned char* pixels_;
+};
+
+
+/*
+   Conversion kernels between interleaved 8-bit pixels, 8-bit planes and
+   float/double planes, used by bitmap_image's channel and color space
+   functions. Every kernel exists in a scalar version and, with GCC, Clang
+   or MSVC on x86, in SSE4.1 and AVX2 versions picked at run time for the
+   CPU. All versions give bit for bit the same results: the vector code
+   does the same operations in the same order, conversions to bytes keep
+   the low byte of the truncated 32-bit integer as x86 does (0 for NaN
+   and values out of the int range), and no multiply-add is fused as long
+   as FMA is not enabled for the whole build.
+*/
+#if defined(__GNUC__) && !defined(__clang__)
+#define BITMAP_IMAGE_EXACT __attribute__((optimize("fp-contract=off")))
+#else
+#define BITMAP_IMAGE_EXACT
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BITMAP_IMAGE_SIMD
+#define BITMAP_IMAGE_SSE4  __attribute__((target("sse4.1"))) BITMAP_IMAGE_EXACT
+#define BITMAP_IMAGE_AVX2  __attribute__((target("avx2"))) BITMAP_IMAGE_EXACT
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+// MSVC compiles the intrinsics of every set without target attributes, and /fp:precise
+// fuses no multiply-add unless /fp:contract is given
+#include <intrin.h>
+#include <immintrin.h>
+#define BITMAP_IMAGE_SIMD
+#define BITMAP_IMAGE_CPUID
+#define BITMAP_IMAGE_SSE4
+#define BITMAP_IMAGE_AVX2
+#endif
+
+// how a float or double becomes a byte: the truncated low byte, clamped to [0,255]
+// and truncated, or rounded half away from zero
+enum byte_conversion {
+                        wrap_bytes  = 0,
+                        clamp_bytes = 1,
+                        round_bytes = 2
+                     };
+
+// a 3x3 color matrix applied straight to interleaved pixels, for every pixel and every row j
+// with a destination: p[k] = pixel[order[k]] / divisor and
+// destination[j][i] = clamp(offset[j] + scale * ((weight[j][0] * p[0] + weight[j][1] * p[1]) + weight[j][2] * p[2]),lower,upper)
+struct pixel_transform
+{
+   int    order[3];
+   double divisor;
+   double weight[3][3];
+   double scale;
+   double offset[3];
+   double lower;
+   double upper;
+};
+
+struct bitmap_kernels
+{
+   const char* name;
+
+   // c0[i] = source[3i], c1[i] = source[3i + 1], c2[i] = source[3i + 2], and back
+   void (*deinterleave)(const unsigned char* source, unsigned char* c0, unsigned char* c1, unsigned char* c2, std::size_t count);
+   void (*interleave)(const unsigned char* c0, const unsigned char* c1, const unsigned char* c2, unsigned char* destination, std::size_t count);
+
+   // swaps the first and the third byte of every pixel, source may be destination
+   void (*swap_outer)(const unsigned char* source, unsigned char* destination, std::size_t count);
+
+   // destination[i] = source[i] / divisor
+   void (*to_float )(const unsigned char* source, float*  destination, std::size_t count, float  divisor);
+   void (*to_double)(const unsigned char* source, double* destination, std::size_t count, double divisor);
+
+   // destination[i] = byte of (scale * source[i])
+   void (*from_float )(const float*  source, unsigned char* destination, std::size_t count, float  scale, byte_conversion conversion);
+   void (*from_double)(const double* source, unsigned char* destination, std::size_t count, double scale, byte_conversion conversion);
+
+   // destination[i] = clamp(offset + scale * ((w[0] * a[i] + w[1] * b[i]) + w[2] * c[i]),lower,upper)
+   void (*combine)(const double* a, const double* b, const double* c, double* destination, std::size_t count,
+                   const double weight[3], double scale, double offset, double lower, double upper);
+
+   // one pass over the pixels for up to 3 outputs, a NULL destination is skipped
+   void (*transform)(const unsigned char* source, std::size_t count, const pixel_transform& t, double* destination[3]);
+};
+
+namespace bitmap_kernel_impl
+{
+   // what cvttss2si and cvttsd2si give for v, rounded first for round_bytes; a value that
+   // is out of the int range before rounding is out of it after as well
+   template <typename T, byte_conversion conversion>
+   inline unsigned char to_byte(T v)
+   {
+      if (clamp_bytes == conversion)
+      {
+         v = (v < T(0)) ? T(0) : ((v > T(255)) ? T(255) : v);
+      }
+
+      if (!((v > T(-2147483649.0)) && (v < T(2147483648.0))))
+         return 0;
+
+      long long t = static_cast<long long>(v);
+
+      if (round_bytes == conversion)
+      {
+         // without branches, which the fractions of real images would mispredict half the time
+         const T d = v - static_cast<T>(t);
+
+         t += static_cast<long long>(d >= T(0.5)) - static_cast<long long>(d <= T(-0.5));
+
+         if ((t < -2147483648LL) || (t > 2147483647LL))
+            return 0;
+      }
+
+      return static_cast<unsigned char>(t & 0xFF);
+   }
+
+   // dividing by a power of two is multiplying by its inverse, exactly, and a lot faster
+   template <typename T>
+   inline bool power_of_two(const T divisor)
+   {
+      int exponent;
+      return (divisor > T(0)) && (T(0.5) == std::frexp(divisor,&exponent));
+   }
+
+   inline void deinterleave_scalar(const unsigned char* source, unsigned char* c0, unsigned char* c1, unsigned char* c2, std::size_t count)
+   {
+      for (std::size_t i = 0; i < count; ++i, source += 3)
+      {
+         c0[i] = source[0];
+         c1[i] = source[1];
+         c2[i] = source[2];
+      }
+   }
+
+   inline void interleave_scalar(const unsigned char* c0, const unsigned char* c1, const unsigned char* c2, unsigned char* destination, std::size_t count)
+   {
+      for (std::size_t i = 0; i < count; ++i, destination += 3)
+      {
+         destination[0] = c0[i];
+         destination[1] = c1[i];
+         destination[2] = c2[i];
+      }
+   }
+
+   inline void swap_outer_scalar(const unsigned char* source, unsigned char* destination, std::size_t count)
+   {
+      for (std::size_t i = 0; i < count; ++i, source += 3, destination += 3)
+      {
+         unsigned char tmp = source[0];
+
+         destination[0] = source[2];
+         destination[1] = source[1];
+         destination[2] = tmp;
+      }
+   }
+
+   template <typename T>
+   inline void to_real_scalar(const unsigned char* source, T* destination, std::size_t count, T divisor)
+   {
+      if (power_of_two(divisor))
+      {
+         const T inverse = T(1) / divisor;
+
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            destination[i] = static_cast<T>(source[i]) * inverse;
+         }
+      }
+      else
+      {
+         for (std::size_t i = 0; i < count; ++i)
+         {
+            destination[i] = static_cast<T>(source[i]) / divisor;
+         }
+      }
+   }
+
+   template <typename T, byte_conversion conversion>
+   inline void from_real_scalar(const T* source, unsigned char* destination, std::size_t count, T scale)
+   {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+         destination[i] = to_byte<T,conversion>(scale * source[i]);
+      }
+   }
+
+   template <typename T>
+   inline void from_real_scalar(const T* source, unsigned char* destination, std::size_t count, T scale, byte_conversion conversion)
+   {
+      switch (conversion)
+      {
+         case clamp_bytes : from_real_scalar<T,clamp_bytes>(source,destination,count,scale); break;
+         case round_bytes : from_real_scalar<T,round_bytes>(source,destination,count,scale); break;
+         default          : from_real_scalar<T,wrap_bytes >(source,destination,count,scale); break;
+      }
+   }
+
+   BITMAP_IMAGE_EXACT inline void combine_scalar(const double* a, const double* b, const double* c, double* destination, std::size_t count,
+                              const double weight[3], double scale, double offset, double lower, double upper)
+   {
+      for (std::size_t i = 0; i < count; ++i)
+      {
+         double v = offset + scale * ((weight[0] * a[i] + weight[1] * b[i]) + weight[2] * c[i]);
+
+         destination[i] = (v < lower) ? lower : ((v > upper) ? upper : v);
+      }
+   }
+
+   // the transform in locals, which the double destinations cannot alias; multiplying by a
+   // scale of 1 and clamping to infinite bounds give every value back as it is, so only the
+   // division is picked outside the loop
+   template <bool multiply>
+   BITMAP_IMAGE_EXACT inline void transform_scalar(const unsigned char* source, std::size_t count, const pixel_transform& t, double* destination[3])
+   {
+      const int    o0 = t.order[0], o1 = t.order[1], o2 = t.order[2];
+      const double divisor = t.divisor;
+      const double inverse = 1.0 / t.divisor;
+      const double scale   = t.scale;
+      const double lower   = t.lower;
+      const double upper   = t.upper;
+
+      double w[3][3], offset[3];
+      std::memcpy(w,t.weight,sizeof(w));
+      std::memcpy(offset,t.offset,sizeof(offset));
+
+      for (std::size_t i = 0; i < count; ++i, source += 3)
+      {
+         const double p0 = multiply ? source[o0] * inverse : source[o0] / divisor;
+         const double p1 = multiply ? source[o1] * inverse : source[o1] / divisor;
+         const double p2 = multiply ? source[o2] * inverse : source[o2] / divisor;
+
+         for (int j = 0; j < 3; ++j)
+         {
+            if (0 == destination[j])
+               continue;
+
+            const double v = offset[j] + scale * ((w[j][0] * p0 + w[j][1] * p1) + w[j][2] * p2);
+
+            destination[j][i] = (v < lower) ? lower : ((v > upper) ? upper : v);
+         }
+      }
+   }
+
+   inline void transform_scalar(const unsigned char* source, std::size_t count, const pixel_transform& t, double* destination[3])
+   {
+      if (power_of_two(t.divisor))
+         transform_scalar<true>(source,count,t,destination);
+      else
+         transform_scalar<false>(source,count,t,destination);
+   }
+
+#ifdef BITMAP_IMAGE_SIMD
+
+   // the pshufb masks that gather channel k of 16 pixels from the 3 vectors holding them, and
+   // that scatter 16 pixels of channel k into those vectors; -1 lanes become 0
+   BITMAP_IMAGE_SSE4 inline __m128i gather_mask(const int k, const int v)
+   {
+      static const signed char masks[3][3][16] = {
+         {{ 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 1, 4, 7,10,13}},
+         {{ 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14}},
+         {{ 2, 5, 8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1, 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1}, {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15}}
+      };
+
+      return _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[k][v]));
+   }
+
+   BITMAP_IMAGE_SSE4 inline __m128i scatter_mask(const int v, const int k)
+   {
+      static const signed char masks[3][3][16] = {
+         {{ 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1, 5}, {-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1,-1}, {-1,-1, 0,-1,-1, 1,-1,-1, 2,-1,-1, 3,-1,-1, 4,-1}},
+         {{-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10,-1}, { 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1,10}, {-1, 5,-1,-1, 6,-1,-1, 7,-1,-1, 8,-1,-1, 9,-1,-1}},
+         {{-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1}, {-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1}, {10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15}}
+      };
+
+      return _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[v][k]));
+   }
+
+   // 16 pixels in a, b and c to their 3 channels
+   BITMAP_IMAGE_SSE4 inline void split_sse4(const __m128i a, const __m128i b, const __m128i c, __m128i channel[3])
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         channel[k] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a,gather_mask(k,0)),
+                                                _mm_shuffle_epi8(b,gather_mask(k,1))),
+                                                _mm_shuffle_epi8(c,gather_mask(k,2)));
+      }
+   }
+
+   BITMAP_IMAGE_SSE4 inline void join_sse4(const __m128i channel[3], __m128i out[3])
+   {
+      for (int v = 0; v < 3; ++v)
+      {
+         out[v] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(channel[0],scatter_mask(v,0)),
+                                            _mm_shuffle_epi8(channel[1],scatter_mask(v,1))),
+                                            _mm_shuffle_epi8(channel[2],scatter_mask(v,2)));
+      }
+   }
+
+   BITMAP_IMAGE_SSE4 inline void deinterleave_sse4(const unsigned char* source, unsigned char* c0, unsigned char* c1, unsigned char* c2, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16, source += 48)
+      {
+         __m128i channel[3];
+
+         split_sse4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source +  0)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 32)),
+                    channel);
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(c0 + i),channel[0]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(c1 + i),channel[1]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(c2 + i),channel[2]);
+      }
+
+      deinterleave_scalar(source,c0 + i,c1 + i,c2 + i,count - i);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void interleave_sse4(const unsigned char* c0, const unsigned char* c1, const unsigned char* c2, unsigned char* destination, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16, destination += 48)
+      {
+         __m128i channel[3], out[3];
+
+         channel[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c0 + i));
+         channel[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c1 + i));
+         channel[2] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c2 + i));
+
+         join_sse4(channel,out);
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination +  0),out[0]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16),out[1]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 32),out[2]);
+      }
+
+      interleave_scalar(c0 + i,c1 + i,c2 + i,destination,count - i);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void swap_outer_sse4(const unsigned char* source, unsigned char* destination, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16, source += 48, destination += 48)
+      {
+         __m128i channel[3], out[3];
+
+         split_sse4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source +  0)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 32)),
+                    channel);
+
+         std::swap(channel[0],channel[2]);
+         join_sse4(channel,out);
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination +  0),out[0]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16),out[1]);
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 32),out[2]);
+      }
+
+      swap_outer_scalar(source,destination,count - i);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void to_float_sse4(const unsigned char* source, float* destination, std::size_t count, float divisor)
+   {
+      const bool   multiply = power_of_two(divisor);
+      const __m128 d        = _mm_set1_ps(multiply ? 1.0f / divisor : divisor);
+      std::size_t i = 0;
+
+      for (; i + 4 <= count; i += 4)
+      {
+         int bytes;
+         std::memcpy(&bytes,source + i,4);
+         __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+         _mm_storeu_ps(destination + i,multiply ? _mm_mul_ps(v,d) : _mm_div_ps(v,d));
+      }
+
+      to_real_scalar<float>(source + i,destination + i,count - i,divisor);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void to_double_sse4(const unsigned char* source, double* destination, std::size_t count, double divisor)
+   {
+      const bool    multiply = power_of_two(divisor);
+      const __m128d d        = _mm_set1_pd(multiply ? 1.0 / divisor : divisor);
+      std::size_t i = 0;
+
+      for (; i + 4 <= count; i += 4)
+      {
+         int bytes;
+         std::memcpy(&bytes,source + i,4);
+         __m128i v  = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+         __m128d lo = _mm_cvtepi32_pd(v);
+         __m128d hi = _mm_cvtepi32_pd(_mm_srli_si128(v,8));
+         _mm_storeu_pd(destination + i    ,multiply ? _mm_mul_pd(lo,d) : _mm_div_pd(lo,d));
+         _mm_storeu_pd(destination + i + 2,multiply ? _mm_mul_pd(hi,d) : _mm_div_pd(hi,d));
+      }
+
+      to_real_scalar<double>(source + i,destination + i,count - i,divisor);
+   }
+
+   // scale * v rounded or clamped as asked, still as a float
+   BITMAP_IMAGE_SSE4 inline __m128 prepare_sse4(const __m128 v, const __m128 scale, const byte_conversion conversion)
+   {
+      __m128 x = _mm_mul_ps(scale,v);
+
+      if (clamp_bytes == conversion)
+      {
+         x = _mm_min_ps(_mm_set1_ps(255.0f),_mm_max_ps(_mm_setzero_ps(),x));
+      }
+      else if (round_bytes == conversion)
+      {
+         const __m128 one = _mm_set1_ps(1.0f);
+         __m128 t = _mm_round_ps(x,_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+         __m128 d = _mm_sub_ps(x,t);
+         t = _mm_add_ps(t,_mm_and_ps(_mm_cmpge_ps(d,_mm_set1_ps( 0.5f)),one));
+         x = _mm_sub_ps(t,_mm_and_ps(_mm_cmple_ps(d,_mm_set1_ps(-0.5f)),one));
+      }
+
+      return x;
+   }
+
+   BITMAP_IMAGE_SSE4 inline __m128d prepare_sse4(const __m128d v, const __m128d scale, const byte_conversion conversion)
+   {
+      __m128d x = _mm_mul_pd(scale,v);
+
+      if (clamp_bytes == conversion)
+      {
+         x = _mm_min_pd(_mm_set1_pd(255.0),_mm_max_pd(_mm_setzero_pd(),x));
+      }
+      else if (round_bytes == conversion)
+      {
+         const __m128d one = _mm_set1_pd(1.0);
+         __m128d t = _mm_round_pd(x,_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+         __m128d d = _mm_sub_pd(x,t);
+         t = _mm_add_pd(t,_mm_and_pd(_mm_cmpge_pd(d,_mm_set1_pd( 0.5)),one));
+         x = _mm_sub_pd(t,_mm_and_pd(_mm_cmple_pd(d,_mm_set1_pd(-0.5)),one));
+      }
+
+      return x;
+   }
+
+   // the low bytes of 16 integers
+   BITMAP_IMAGE_SSE4 inline __m128i pack_low_bytes_sse4(__m128i a, __m128i b, __m128i c, __m128i d)
+   {
+      const __m128i low = _mm_set1_epi32(0xFF);
+
+      a = _mm_and_si128(a,low);
+      b = _mm_and_si128(b,low);
+      c = _mm_and_si128(c,low);
+      d = _mm_and_si128(d,low);
+
+      return _mm_packus_epi16(_mm_packus_epi32(a,b),_mm_packus_epi32(c,d));
+   }
+
+   BITMAP_IMAGE_SSE4 inline void from_float_sse4(const float* source, unsigned char* destination, std::size_t count, float scale, byte_conversion conversion)
+   {
+      const __m128 s = _mm_set1_ps(scale);
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16)
+      {
+         __m128i q[4];
+
+         for (int k = 0; k < 4; ++k)
+         {
+            q[k] = _mm_cvttps_epi32(prepare_sse4(_mm_loadu_ps(source + i + 4 * k),s,conversion));
+         }
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i),pack_low_bytes_sse4(q[0],q[1],q[2],q[3]));
+      }
+
+      from_real_scalar<float>(source + i,destination + i,count - i,scale,conversion);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void from_double_sse4(const double* source, unsigned char* destination, std::size_t count, double scale, byte_conversion conversion)
+   {
+      const __m128d s = _mm_set1_pd(scale);
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16)
+      {
+         __m128i q[4];
+
+         for (int k = 0; k < 4; ++k)
+         {
+            __m128i lo = _mm_cvttpd_epi32(prepare_sse4(_mm_loadu_pd(source + i + 4 * k    ),s,conversion));
+            __m128i hi = _mm_cvttpd_epi32(prepare_sse4(_mm_loadu_pd(source + i + 4 * k + 2),s,conversion));
+            q[k] = _mm_unpacklo_epi64(lo,hi);
+         }
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i),pack_low_bytes_sse4(q[0],q[1],q[2],q[3]));
+      }
+
+      from_real_scalar<double>(source + i,destination + i,count - i,scale,conversion);
+   }
+
+   BITMAP_IMAGE_SSE4 inline void combine_sse4(const double* a, const double* b, const double* c, double* destination, std::size_t count,
+                                              const double weight[3], double scale, double offset, double lower, double upper)
+   {
+      const __m128d w0 = _mm_set1_pd(weight[0]);
+      const __m128d w1 = _mm_set1_pd(weight[1]);
+      const __m128d w2 = _mm_set1_pd(weight[2]);
+      const __m128d s  = _mm_set1_pd(scale);
+      const __m128d o  = _mm_set1_pd(offset);
+      const __m128d lo = _mm_set1_pd(lower);
+      const __m128d hi = _mm_set1_pd(upper);
+      std::size_t i = 0;
+
+      for (; i + 2 <= count; i += 2)
+      {
+         __m128d v = _mm_add_pd(_mm_mul_pd(w0,_mm_loadu_pd(a + i)),_mm_mul_pd(w1,_mm_loadu_pd(b + i)));
+         v = _mm_add_pd(v,_mm_mul_pd(w2,_mm_loadu_pd(c + i)));
+         v = _mm_add_pd(o,_mm_mul_pd(s,v));
+
+         // lower and upper first, so that a NaN goes through as in the scalar code
+         _mm_storeu_pd(destination + i,_mm_min_pd(hi,_mm_max_pd(lo,v)));
+      }
+
+      combine_scalar(a + i,b + i,c + i,destination + i,count - i,weight,scale,offset,lower,upper);
+   }
+
+   // 4 bytes of a channel as 4 ints
+   BITMAP_IMAGE_SSE4 inline __m128i load_4_bytes_sse4(const unsigned char* bytes)
+   {
+      int v;
+      std::memcpy(&v,bytes,sizeof(v));
+      return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+   }
+
+   BITMAP_IMAGE_SSE4 inline void transform_sse4(const unsigned char* source, std::size_t count, const pixel_transform& t, double* destination[3])
+   {
+      const bool    multiply = power_of_two(t.divisor);
+      const __m128d d        = _mm_set1_pd(multiply ? 1.0 / t.divisor : t.divisor);
+      const __m128d s        = _mm_set1_pd(t.scale);
+      const __m128d lo       = _mm_set1_pd(t.lower);
+      const __m128d hi       = _mm_set1_pd(t.upper);
+
+      // a divisor or scale of 1 and infinite bounds leave every value as it is, they are skipped
+      const bool    divide   = (1.0 != t.divisor);
+      const bool    scaled   = (1.0 != t.scale);
+      const bool    clamped  = (t.lower > -std::numeric_limits<double>::infinity()) ||
+                               (t.upper <  std::numeric_limits<double>::infinity());
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16, source += 48)
+      {
+         __m128i channel[3];
+         __m128d p[3][8];
+
+         split_sse4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source +  0)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 32)),
+                    channel);
+
+         // the 16 pixels as doubles, 2 at a time
+         for (int k = 0; k < 3; ++k)
+         {
+            const __m128i c = channel[t.order[k]];
+            const __m128i q[4] = {
+                                    _mm_cvtepu8_epi32(c),
+                                    _mm_cvtepu8_epi32(_mm_srli_si128(c, 4)),
+                                    _mm_cvtepu8_epi32(_mm_srli_si128(c, 8)),
+                                    _mm_cvtepu8_epi32(_mm_srli_si128(c,12))
+                                 };
+
+            for (int g = 0; g < 4; ++g)
+            {
+               p[k][2 * g    ] = _mm_cvtepi32_pd(q[g]);
+               p[k][2 * g + 1] = _mm_cvtepi32_pd(_mm_srli_si128(q[g],8));
+            }
+
+            if (divide)
+            {
+               for (int g = 0; g < 8; ++g)
+               {
+                  p[k][g] = multiply ? _mm_mul_pd(p[k][g],d) : _mm_div_pd(p[k][g],d);
+               }
+            }
+         }
+
+         // then one output at a time, with only its own weights in registers
+         for (int j = 0; j < 3; ++j)
+         {
+            if (0 == destination[j])
+               continue;
+
+            const __m128d w0 = _mm_set1_pd(t.weight[j][0]);
+            const __m128d w1 = _mm_set1_pd(t.weight[j][1]);
+            const __m128d w2 = _mm_set1_pd(t.weight[j][2]);
+            const __m128d o  = _mm_set1_pd(t.offset[j]);
+
+            for (int g = 0; g < 8; ++g)
+            {
+               __m128d v = _mm_add_pd(_mm_mul_pd(w0,p[0][g]),_mm_mul_pd(w1,p[1][g]));
+               v = _mm_add_pd(v,_mm_mul_pd(w2,p[2][g]));
+               v = _mm_add_pd(o,scaled ? _mm_mul_pd(s,v) : v);
+
+               _mm_storeu_pd(destination[j] + i + 2 * g,clamped ? _mm_min_pd(hi,_mm_max_pd(lo,v)) : v);
+            }
+         }
+      }
+
+      double* rest[3];
+
+      for (int j = 0; j < 3; ++j)
+      {
+         rest[j] = destination[j] ? destination[j] + i : 0;
+      }
+
+      transform_scalar(source,count - i,t,rest);
+   }
+
+   // 32 pixels, the first 16 in the low lanes and the next 16 in the high lanes
+   BITMAP_IMAGE_AVX2 inline __m256i load_pixels_avx2(const unsigned char* source, const int v)
+   {
+      return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16 * v))),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 48 + 16 * v)),1);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void store_pixels_avx2(unsigned char* destination, const int v, const __m256i x)
+   {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 16 * v     ),_mm256_castsi256_si128(x));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 48 + 16 * v),_mm256_extracti128_si256(x,1));
+   }
+
+   BITMAP_IMAGE_AVX2 inline void split_avx2(const __m256i in[3], __m256i channel[3])
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         channel[k] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(in[0],_mm256_broadcastsi128_si256(gather_mask(k,0))),
+                                                      _mm256_shuffle_epi8(in[1],_mm256_broadcastsi128_si256(gather_mask(k,1)))),
+                                                      _mm256_shuffle_epi8(in[2],_mm256_broadcastsi128_si256(gather_mask(k,2))));
+      }
+   }
+
+   BITMAP_IMAGE_AVX2 inline void join_avx2(const __m256i channel[3], __m256i out[3])
+   {
+      for (int v = 0; v < 3; ++v)
+      {
+         out[v] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(channel[0],_mm256_broadcastsi128_si256(scatter_mask(v,0))),
+                                                  _mm256_shuffle_epi8(channel[1],_mm256_broadcastsi128_si256(scatter_mask(v,1)))),
+                                                  _mm256_shuffle_epi8(channel[2],_mm256_broadcastsi128_si256(scatter_mask(v,2))));
+      }
+   }
+
+   BITMAP_IMAGE_AVX2 inline void deinterleave_avx2(const unsigned char* source, unsigned char* c0, unsigned char* c1, unsigned char* c2, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 32 <= count; i += 32, source += 96)
+      {
+         __m256i in[3], channel[3];
+
+         for (int v = 0; v < 3; ++v)
+         {
+            in[v] = load_pixels_avx2(source,v);
+         }
+
+         split_avx2(in,channel);
+
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(c0 + i),channel[0]);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(c1 + i),channel[1]);
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(c2 + i),channel[2]);
+      }
+
+      deinterleave_sse4(source,c0 + i,c1 + i,c2 + i,count - i);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void interleave_avx2(const unsigned char* c0, const unsigned char* c1, const unsigned char* c2, unsigned char* destination, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 32 <= count; i += 32, destination += 96)
+      {
+         __m256i channel[3], out[3];
+
+         channel[0] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c0 + i));
+         channel[1] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c1 + i));
+         channel[2] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c2 + i));
+
+         join_avx2(channel,out);
+
+         for (int v = 0; v < 3; ++v)
+         {
+            store_pixels_avx2(destination,v,out[v]);
+         }
+      }
+
+      interleave_sse4(c0 + i,c1 + i,c2 + i,destination,count - i);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void swap_outer_avx2(const unsigned char* source, unsigned char* destination, std::size_t count)
+   {
+      std::size_t i = 0;
+
+      for (; i + 32 <= count; i += 32, source += 96, destination += 96)
+      {
+         __m256i in[3], channel[3], out[3];
+
+         for (int v = 0; v < 3; ++v)
+         {
+            in[v] = load_pixels_avx2(source,v);
+         }
+
+         split_avx2(in,channel);
+         std::swap(channel[0],channel[2]);
+         join_avx2(channel,out);
+
+         for (int v = 0; v < 3; ++v)
+         {
+            store_pixels_avx2(destination,v,out[v]);
+         }
+      }
+
+      swap_outer_sse4(source,destination,count - i);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void to_float_avx2(const unsigned char* source, float* destination, std::size_t count, float divisor)
+   {
+      const bool   multiply = power_of_two(divisor);
+      const __m256 d        = _mm256_set1_ps(multiply ? 1.0f / divisor : divisor);
+      std::size_t i = 0;
+
+      for (; i + 8 <= count; i += 8)
+      {
+         __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i))));
+         _mm256_storeu_ps(destination + i,multiply ? _mm256_mul_ps(v,d) : _mm256_div_ps(v,d));
+      }
+
+      to_float_sse4(source + i,destination + i,count - i,divisor);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void to_double_avx2(const unsigned char* source, double* destination, std::size_t count, double divisor)
+   {
+      const bool    multiply = power_of_two(divisor);
+      const __m256d d        = _mm256_set1_pd(multiply ? 1.0 / divisor : divisor);
+      std::size_t i = 0;
+
+      for (; i + 8 <= count; i += 8)
+      {
+         __m256i v  = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(source + i)));
+         __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+         __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v,1));
+         _mm256_storeu_pd(destination + i    ,multiply ? _mm256_mul_pd(lo,d) : _mm256_div_pd(lo,d));
+         _mm256_storeu_pd(destination + i + 4,multiply ? _mm256_mul_pd(hi,d) : _mm256_div_pd(hi,d));
+      }
+
+      to_double_sse4(source + i,destination + i,count - i,divisor);
+   }
+
+   BITMAP_IMAGE_AVX2 inline __m256 prepare_avx2(const __m256 v, const __m256 scale, const byte_conversion conversion)
+   {
+      __m256 x = _mm256_mul_ps(scale,v);
+
+      if (clamp_bytes == conversion)
+      {
+         x = _mm256_min_ps(_mm256_set1_ps(255.0f),_mm256_max_ps(_mm256_setzero_ps(),x));
+      }
+      else if (round_bytes == conversion)
+      {
+         const __m256 one = _mm256_set1_ps(1.0f);
+         __m256 t = _mm256_round_ps(x,_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+         __m256 d = _mm256_sub_ps(x,t);
+         t = _mm256_add_ps(t,_mm256_and_ps(_mm256_cmp_ps(d,_mm256_set1_ps( 0.5f),_CMP_GE_OQ),one));
+         x = _mm256_sub_ps(t,_mm256_and_ps(_mm256_cmp_ps(d,_mm256_set1_ps(-0.5f),_CMP_LE_OQ),one));
+      }
+
+      return x;
+   }
+
+   BITMAP_IMAGE_AVX2 inline __m256d prepare_avx2(const __m256d v, const __m256d scale, const byte_conversion conversion)
+   {
+      __m256d x = _mm256_mul_pd(scale,v);
+
+      if (clamp_bytes == conversion)
+      {
+         x = _mm256_min_pd(_mm256_set1_pd(255.0),_mm256_max_pd(_mm256_setzero_pd(),x));
+      }
+      else if (round_bytes == conversion)
+      {
+         const __m256d one = _mm256_set1_pd(1.0);
+         __m256d t = _mm256_round_pd(x,_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+         __m256d d = _mm256_sub_pd(x,t);
+         t = _mm256_add_pd(t,_mm256_and_pd(_mm256_cmp_pd(d,_mm256_set1_pd( 0.5),_CMP_GE_OQ),one));
+         x = _mm256_sub_pd(t,_mm256_and_pd(_mm256_cmp_pd(d,_mm256_set1_pd(-0.5),_CMP_LE_OQ),one));
+      }
+
+      return x;
+   }
+
+   BITMAP_IMAGE_AVX2 inline void from_float_avx2(const float* source, unsigned char* destination, std::size_t count, float scale, byte_conversion conversion)
+   {
+      const __m256  s   = _mm256_set1_ps(scale);
+      const __m256i low = _mm256_set1_epi32(0xFF);
+      std::size_t i = 0;
+
+      for (; i + 32 <= count; i += 32)
+      {
+         __m256i q[4];
+
+         for (int k = 0; k < 4; ++k)
+         {
+            q[k] = _mm256_and_si256(_mm256_cvttps_epi32(prepare_avx2(_mm256_loadu_ps(source + i + 8 * k),s,conversion)),low);
+         }
+
+         // the packs work within 128-bit lanes, the permute puts the 4 byte groups back in order
+         __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(q[0],q[1]),_mm256_packus_epi32(q[2],q[3]));
+         bytes = _mm256_permutevar8x32_epi32(bytes,_mm256_setr_epi32(0,4,1,5,2,6,3,7));
+
+         _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i),bytes);
+      }
+
+      from_float_sse4(source + i,destination + i,count - i,scale,conversion);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void from_double_avx2(const double* source, unsigned char* destination, std::size_t count, double scale, byte_conversion conversion)
+   {
+      const __m256d s = _mm256_set1_pd(scale);
+      std::size_t i = 0;
+
+      for (; i + 16 <= count; i += 16)
+      {
+         __m128i q[4];
+
+         for (int k = 0; k < 4; ++k)
+         {
+            q[k] = _mm256_cvttpd_epi32(prepare_avx2(_mm256_loadu_pd(source + i + 4 * k),s,conversion));
+         }
+
+         _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i),pack_low_bytes_sse4(q[0],q[1],q[2],q[3]));
+      }
+
+      from_double_sse4(source + i,destination + i,count - i,scale,conversion);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void combine_avx2(const double* a, const double* b, const double* c, double* destination, std::size_t count,
+                                              const double weight[3], double scale, double offset, double lower, double upper)
+   {
+      const __m256d w0 = _mm256_set1_pd(weight[0]);
+      const __m256d w1 = _mm256_set1_pd(weight[1]);
+      const __m256d w2 = _mm256_set1_pd(weight[2]);
+      const __m256d s  = _mm256_set1_pd(scale);
+      const __m256d o  = _mm256_set1_pd(offset);
+      const __m256d lo = _mm256_set1_pd(lower);
+      const __m256d hi = _mm256_set1_pd(upper);
+      std::size_t i = 0;
+
+      for (; i + 4 <= count; i += 4)
+      {
+         __m256d v = _mm256_add_pd(_mm256_mul_pd(w0,_mm256_loadu_pd(a + i)),_mm256_mul_pd(w1,_mm256_loadu_pd(b + i)));
+         v = _mm256_add_pd(v,_mm256_mul_pd(w2,_mm256_loadu_pd(c + i)));
+         v = _mm256_add_pd(o,_mm256_mul_pd(s,v));
+
+         _mm256_storeu_pd(destination + i,_mm256_min_pd(hi,_mm256_max_pd(lo,v)));
+      }
+
+      combine_sse4(a + i,b + i,c + i,destination + i,count - i,weight,scale,offset,lower,upper);
+   }
+
+   BITMAP_IMAGE_AVX2 inline void transform_avx2(const unsigned char* source, std::size_t count, const pixel_transform& t, double* destination[3])
+   {
+      const bool    multiply = power_of_two(t.divisor);
+      const __m256d d        = _mm256_set1_pd(multiply ? 1.0 / t.divisor : t.divisor);
+      const __m256d s        = _mm256_set1_pd(t.scale);
+      const __m256d lo       = _mm256_set1_pd(t.lower);
+      const __m256d hi       = _mm256_set1_pd(t.upper);
+
+      // a divisor or scale of 1 and infinite bounds leave every value as it is, they are skipped
+      const bool    divide   = (1.0 != t.divisor);
+      const bool    scaled   = (1.0 != t.scale);
+      const bool    clamped  = (t.lower > -std::numeric_limits<double>::infinity()) ||
+                               (t.upper <  std::numeric_limits<double>::infinity());
+      std::size_t i = 0;
+
+      for (; i + 32 <= count; i += 32, source += 96)
+      {
+         __m256i in[3], channel[3];
+         alignas(32) unsigned char bytes[3][32];
+
+         for (int v = 0; v < 3; ++v)
+         {
+            in[v] = load_pixels_avx2(source,v);
+         }
+
+         split_avx2(in,channel);
+
+         for (int k = 0; k < 3; ++k)
+         {
+            _mm256_store_si256(reinterpret_cast<__m256i*>(bytes[k]),channel[t.order[k]]);
+         }
+
+         // one output at a time over the 32 pixels, 4 bytes of every channel at a time
+         for (int j = 0; j < 3; ++j)
+         {
+            if (0 == destination[j])
+               continue;
+
+            const __m256d w0 = _mm256_set1_pd(t.weight[j][0]);
+            const __m256d w1 = _mm256_set1_pd(t.weight[j][1]);
+            const __m256d w2 = _mm256_set1_pd(t.weight[j][2]);
+            const __m256d o  = _mm256_set1_pd(t.offset[j]);
+
+            for (int g = 0; g < 32; g += 4)
+            {
+               __m256d p[3];
+
+               for (int k = 0; k < 3; ++k)
+               {
+                  p[k] = _mm256_cvtepi32_pd(load_4_bytes_sse4(bytes[k] + g));
+
+                  if (divide)
+                     p[k] = multiply ? _mm256_mul_pd(p[k],d) : _mm256_div_pd(p[k],d);
+               }
+
+               __m256d v = _mm256_add_pd(_mm256_mul_pd(w0,p[0]),_mm256_mul_pd(w1,p[1]));
+               v = _mm256_add_pd(v,_mm256_mul_pd(w2,p[2]));
+               v = _mm256_add_pd(o,scaled ? _mm256_mul_pd(s,v) : v);
+
+               _mm256_storeu_pd(destination[j] + i + g,clamped ? _mm256_min_pd(hi,_mm256_max_pd(lo,v)) : v);
+            }
+         }
+      }
+
+      double* rest[3];
+
+      for (int j = 0; j < 3; ++j)
+      {
+         rest[j] = destination[j] ? destination[j] + i : 0;
+      }
+
+      transform_sse4(source,count - i,t,rest);
+   }
+
+#endif
+
+   inline const bitmap_kernels& scalar_kernels()
+   {
+      static const bitmap_kernels kernels = {
+                                               "scalar",
+                                               deinterleave_scalar,
+                                               interleave_scalar,
+                                               swap_outer_scalar,
+                                               to_real_scalar<float>,
+                                               to_real_scalar<double>,
+                                               from_real_scalar<float>,
+                                               from_real_scalar<double>,
+                                               combine_scalar,
+                                               transform_scalar
+                                            };
+      return kernels;
+   }
+
+#ifdef BITMAP_IMAGE_SIMD
+   inline bool cpu_runs_sse4()
+   {
+#ifdef BITMAP_IMAGE_CPUID
+      int info[4];
+      __cpuid(info,1);
+      return 0 != (info[2] & (1 << 19));
+#else
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.1");
+#endif
+   }
+
+   // AVX2 also needs the OS to save the ymm registers (OSXSAVE and XCR0 bits 1 and 2)
+   inline bool cpu_runs_avx2()
+   {
+#ifdef BITMAP_IMAGE_CPUID
+      int info[4];
+      __cpuid(info,0);
+
+      if (info[0] < 7)
+         return false;
+
+      __cpuid(info,1);
+
+      if ((0 == (info[2] & (1 << 27))) || (0 == (info[2] & (1 << 28))) || (6 != (_xgetbv(0) & 6)))
+         return false;
+
+      __cpuidex(info,7,0);
+      return 0 != (info[1] & (1 << 5));
+#else
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#endif
+   }
+#endif
+
+   // NULL where the CPU or the compiler cannot run them
+   inline const bitmap_kernels* sse4_kernels()
+   {
+#ifdef BITMAP_IMAGE_SIMD
+      static const bitmap_kernels kernels = {
+                                               "sse4",
+                                               deinterleave_sse4,
+                                               interleave_sse4,
+                                               swap_outer_sse4,
+                                               to_float_sse4,
+                                               to_double_sse4,
+                                               from_float_sse4,
+                                               from_double_sse4,
+                                               combine_sse4,
+                                               transform_sse4
+                                            };
+      return cpu_runs_sse4() ? &kernels : 0;
+#else
+      return 0;
+#endif
+   }
+
+   inline const bitmap_kernels* avx2_kernels()
+   {
+#ifdef BITMAP_IMAGE_SIMD
+      static const bitmap_kernels kernels = {
+                                               "avx2",
+                                               deinterleave_avx2,
+                                               interleave_avx2,
+                                               swap_outer_avx2,
+                                               to_float_avx2,
+                                               to_double_avx2,
+                                               from_float_avx2,
+                                               from_double_avx2,
+                                               combine_avx2,
+                                               transform_avx2
+                                            };
+      return (cpu_runs_avx2() && cpu_runs_sse4()) ? &kernels : 0;
+#else
+      return 0;
+#endif
+   }
+
+   inline const bitmap_kernels*& selected_kernels()
+   {
+      static const bitmap_kernels* selected = avx2_kernels()  ? avx2_kernels() :
+                                              sse4_kernels()  ? sse4_kernels() :
+                                                                &scalar_kernels();
+      return selected;
+   }
+}
+
+// the kernels the bitmap functions use, the fastest the CPU runs unless changed
+inline const bitmap_kernels& pixel_kernels()
+{
+   return *bitmap_kernel_impl::selected_kernels();
+}
+
+// every kernel set this CPU runs, scalar first
+inline std::vector<const bitmap_kernels*> supported_pixel_kernels()
+{
+   std::vector<const bitmap_kernels*> supported(1,&bitmap_kernel_impl::scalar_kernels());
+
+   if (bitmap_kernel_impl::sse4_kernels()) supported.push_back(bitmap_kernel_impl::sse4_kernels());
+   if (bitmap_kernel_impl::avx2_kernels()) supported.push_back(bitmap_kernel_impl::avx2_kernels());
+
+   return supported;
+}
+
+// picks the kernels by name (scalar, sse4 or avx2), false if this CPU does not run them
+inline bool use_pixel_kernels(const std::string& name)
+{
+   std::vector<const bitmap_kernels*> supported = supported_pixel_kernels();
+
+   for (std::size_t i = 0; i < supported.size(); ++i)
+   {
+      if (name == supported[i]->name)
+      {
+         bitmap_kernel_impl::selected_kernels() = supported[i];
+         return true;
+      }
+   }
+
+   return false;
+}
 
 
 class bitmap_image
@@ -47,6 +1424,13 @@ public:
                        red_plane   = 2
                     };
 
+   // system_io maps a file to load it and hands the rows to writev in place to save it; it
+   // falls back to the streams where that fails or is not available
+   enum io_mode {
+                   stream_io = 0,
+                   system_io = 1
+                };
+
 
    bitmap_image()
    : file_name_(""),
@@ -376,8 +1760,19 @@ public:
       }
    }
 
-   void save_image(const std::string& file_name)
+   void load_image(const std::string& file_name, const io_mode mode = system_io)
+   {
+      file_name_ = file_name;
+      load_bitmap(mode);
+   }
+
+   void save_image(const std::string& file_name, const io_mode mode = system_io)
    {
+      if ((system_io == mode) && (3 == bytes_per_pixel_) && write_rows(file_name))
+      {
+         return;
+      }
+
       std::ofstream stream(file_name.c_str(),std::ios::binary);
 
       if (!stream)
@@ -510,14 +1905,29 @@ public:
          b_scaler = tmp;
       }
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); )
+      const bitmap_kernels& kernels = pixel_kernels();
+      const double infinity = std::numeric_limits<double>::infinity();
+
+      // red, green and blue are the third, second and first byte
+      const pixel_transform gray =
+                               {
+                                  { 2, 1, 0 }, 1.0,
+                                  { { r_scaler, g_scaler, b_scaler }, { 0, 0, 0 }, { 0, 0, 0 } },
+                                  1.0, { 0.0, 0.0, 0.0 }, -infinity, infinity
+                               };
+
+      unsigned char plane[kernel_block];
+      double        real [kernel_block];
+      double*       destination[3] = { real, 0, 0 };
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         unsigned char gray_value = static_cast<unsigned char>((r_scaler * (*(itr + 2))) +
-                                                               (g_scaler * (*(itr + 1))) +
-                                                               (b_scaler * (*(itr + 0))) );
-         *(itr++) = gray_value;
-         *(itr++) = gray_value;
-         *(itr++) = gray_value;
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+         unsigned char* itr = data_ + 3 * i;
+
+         kernels.transform(itr,n,gray,destination);
+         kernels.from_double(real,plane,n,1.0,wrap_bytes);
+         kernels.interleave(plane,plane,plane,itr,n);
       }
    }
 
@@ -661,11 +2071,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         (*blue)  = (1.0 * (*(itr++))) / 256.0;
-         (*green) = (1.0 * (*(itr++))) / 256.0;
-         (*red)   = (1.0 * (*(itr++))) / 256.0;
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().deinterleave(data_ + 3 * i,plane[0],plane[1],plane[2],n);
+         pixel_kernels().to_double(plane[0],blue  + i,n,256.0);
+         pixel_kernels().to_double(plane[1],green + i,n,256.0);
+         pixel_kernels().to_double(plane[2],red   + i,n,256.0);
       }
    }
 
@@ -674,11 +2089,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         (*blue)  = (1.0f * (*(itr++))) / 256.0f;
-         (*green) = (1.0f * (*(itr++))) / 256.0f;
-         (*red)   = (1.0f * (*(itr++))) / 256.0f;
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().deinterleave(data_ + 3 * i,plane[0],plane[1],plane[2],n);
+         pixel_kernels().to_float(plane[0],blue  + i,n,256.0f);
+         pixel_kernels().to_float(plane[1],green + i,n,256.0f);
+         pixel_kernels().to_float(plane[2],red   + i,n,256.0f);
       }
    }
 
@@ -687,12 +2107,7 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
-      {
-         (*blue)  = *(itr++);
-         (*green) = *(itr++);
-         (*red)   = *(itr++);
-      }
+      pixel_kernels().deinterleave(data_,blue,green,red,pixel_count());
    }
 
    inline void export_ycbcr(double* y, double* cb, double* cr)
@@ -700,16 +2115,21 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++y, ++cb, ++cr)
-      {
-         double blue  = (1.0 * (*(itr++)));
-         double green = (1.0 * (*(itr++)));
-         double red   = (1.0 * (*(itr++)));
-
-         ( *y) = clamp<double>( 16.0 + (1.0/256.0) * (  65.738 * red + 129.057 * green +  25.064 * blue),1.0,254);
-         (*cb) = clamp<double>(128.0 + (1.0/256.0) * (- 37.945 * red -  74.494 * green + 112.439 * blue),1.0,254);
-         (*cr) = clamp<double>(128.0 + (1.0/256.0) * ( 112.439 * red -  94.154 * green -  18.285 * blue),1.0,254);
-      }
+      // red, green and blue are the third, second and first byte
+      static const pixel_transform ycbcr =
+                                      {
+                                         { 2, 1, 0 }, 1.0,
+                                         {
+                                            {   65.738, 129.057,  25.064 },
+                                            { - 37.945, -74.494, 112.439 },
+                                            {  112.439, -94.154, -18.285 }
+                                         },
+                                         1.0 / 256.0, { 16.0, 128.0, 128.0 }, 1.0, 254.0
+                                      };
+
+      double* destination[3] = { y, cb, cr };
+
+      pixel_kernels().transform(data_,pixel_count(),ycbcr,destination);
    }
 
    inline void export_rgb_normal(double* red, double* green, double* blue) const
@@ -717,11 +2137,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         (*blue)  = (1.0 * (*(itr++)));
-         (*green) = (1.0 * (*(itr++)));
-         (*red)   = (1.0 * (*(itr++)));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().deinterleave(data_ + 3 * i,plane[0],plane[1],plane[2],n);
+         pixel_kernels().to_double(plane[0],blue  + i,n,1.0);
+         pixel_kernels().to_double(plane[1],green + i,n,1.0);
+         pixel_kernels().to_double(plane[2],red   + i,n,1.0);
       }
    }
 
@@ -730,11 +2155,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         (*blue)  = (1.0f * (*(itr++)));
-         (*green) = (1.0f * (*(itr++)));
-         (*red)   = (1.0f * (*(itr++)));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().deinterleave(data_ + 3 * i,plane[0],plane[1],plane[2],n);
+         pixel_kernels().to_float(plane[0],blue  + i,n,1.0f);
+         pixel_kernels().to_float(plane[1],green + i,n,1.0f);
+         pixel_kernels().to_float(plane[2],red   + i,n,1.0f);
       }
    }
 
@@ -743,11 +2173,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(256.0 * (*blue ));
-         *(itr++) = static_cast<unsigned char>(256.0 * (*green));
-         *(itr++) = static_cast<unsigned char>(256.0 * (*red  ));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_double(blue  + i,plane[0],n,256.0,wrap_bytes);
+         pixel_kernels().from_double(green + i,plane[1],n,256.0,wrap_bytes);
+         pixel_kernels().from_double(red   + i,plane[2],n,256.0,wrap_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -756,11 +2191,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(256.0f * (*blue ));
-         *(itr++) = static_cast<unsigned char>(256.0f * (*green));
-         *(itr++) = static_cast<unsigned char>(256.0f * (*red  ));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_float(blue  + i,plane[0],n,256.0f,wrap_bytes);
+         pixel_kernels().from_float(green + i,plane[1],n,256.0f,wrap_bytes);
+         pixel_kernels().from_float(red   + i,plane[2],n,256.0f,wrap_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -769,12 +2209,7 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
-      {
-         *(itr++) = (*blue );
-         *(itr++) = (*green);
-         *(itr++) = (*red  );
-      }
+      pixel_kernels().interleave(blue,green,red,data_,pixel_count());
    }
 
    inline void import_ycbcr(double* y, double* cb, double* cr)
@@ -782,15 +2217,31 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++y, ++cb, ++cr)
+      // blue and red take two terms, the third is 0 * 0
+      static const double blue_weight [3] = { 298.082,  516.412,    0.000 };
+      static const double green_weight[3] = { 298.082, -100.291, -208.120 };
+      static const double red_weight  [3] = { 298.082,  408.583,    0.000 };
+      static const double zero[kernel_block] = { 0.0 };
+
+      const bitmap_kernels& kernels = pixel_kernels();
+
+      unsigned char plane[3][kernel_block];
+      double        real [3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         double y_  =  (*y);
-         double cb_ = (*cb);
-         double cr_ = (*cr);
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         kernels.combine(y + i,cb + i,zero  ,real[0],n,blue_weight ,1.0/256.0,-276.836,0.0,255.0);
+         kernels.combine(y + i,cb + i,cr + i,real[1],n,green_weight,1.0/256.0, 135.576,0.0,255.0);
+         kernels.combine(y + i,cr + i,zero  ,real[2],n,red_weight  ,1.0/256.0,-222.921,0.0,255.0);
 
-         *(itr++) = static_cast<unsigned char>(clamp((298.082 * y_ + 516.412 * cb_                 ) / 256.0 - 276.836,0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp((298.082 * y_ - 100.291 * cb_ - 208.120 * cr_ ) / 256.0 + 135.576,0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp((298.082 * y_                 + 408.583 * cr_ ) / 256.0 - 222.921,0.0,255.0));
+         for (int k = 0; k < 3; ++k)
+         {
+            kernels.from_double(real[k],plane[k],n,1.0,wrap_bytes);
+         }
+
+         kernels.interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -799,11 +2250,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0 * (*blue ),0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0 * (*green),0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0 * (*red  ),0.0,255.0));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_double(blue  + i,plane[0],n,256.0,clamp_bytes);
+         pixel_kernels().from_double(green + i,plane[1],n,256.0,clamp_bytes);
+         pixel_kernels().from_double(red   + i,plane[2],n,256.0,clamp_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -812,11 +2268,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0f * (*blue ),0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0f * (*green),0.0,255.0));
-         *(itr++) = static_cast<unsigned char>(clamp<double>(256.0f * (*red  ),0.0,255.0));
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_float(blue  + i,plane[0],n,256.0f,clamp_bytes);
+         pixel_kernels().from_float(green + i,plane[1],n,256.0f,clamp_bytes);
+         pixel_kernels().from_float(red   + i,plane[2],n,256.0f,clamp_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -825,11 +2286,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(*blue );
-         *(itr++) = static_cast<unsigned char>(*green);
-         *(itr++) = static_cast<unsigned char>(*red  );
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_double(blue  + i,plane[0],n,1.0,wrap_bytes);
+         pixel_kernels().from_double(green + i,plane[1],n,1.0,wrap_bytes);
+         pixel_kernels().from_double(red   + i,plane[2],n,1.0,wrap_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -838,11 +2304,16 @@ public:
       if (bgr_mode != channel_mode_)
          return;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); ++red, ++green, ++blue)
+      unsigned char plane[3][kernel_block];
+
+      for (std::size_t i = 0; i < pixel_count(); i += kernel_block)
       {
-         *(itr++) = static_cast<unsigned char>(*blue );
-         *(itr++) = static_cast<unsigned char>(*green);
-         *(itr++) = static_cast<unsigned char>(*red  );
+         const std::size_t n = std::min<std::size_t>(kernel_block,pixel_count() - i);
+
+         pixel_kernels().from_float(blue  + i,plane[0],n,1.0f,wrap_bytes);
+         pixel_kernels().from_float(green + i,plane[1],n,1.0f,wrap_bytes);
+         pixel_kernels().from_float(red   + i,plane[2],n,1.0f,wrap_bytes);
+         pixel_kernels().interleave(plane[0],plane[1],plane[2],data_ + 3 * i,n);
       }
    }
 
@@ -941,7 +2412,7 @@ public:
             {
                total = 0;
                total += *(itr1[k]); itr1[k] += bytes_per_pixel_;
-               total += *(itr2[k]); itr2[k] += bytes_per_pixel_;
+               total += *(itr1[k]); itr1[k] += bytes_per_pixel_;
 
                *(s_itr[k]) = static_cast<unsigned char>(total >> 1);
             }
@@ -1174,6 +2645,9 @@ public:
 
 private:
 
+   // pixels converted at a time by the functions built on the kernels, kept on the stack
+   enum { kernel_block = 256 };
+
    struct bitmap_file_header
    {
       unsigned short type;
@@ -1367,8 +2841,29 @@ private:
       data_ = new unsigned char[length_];
    }
 
-   void load_bitmap()
+   void load_bitmap(const io_mode mode = system_io)
    {
+      if (system_io == mode)
+      {
+         mapped_bitmap file;
+
+         if (file.open(file_name_))
+         {
+            width_           = file.width();
+            height_          = file.height();
+            bytes_per_pixel_ = 3;
+
+            create_bitmap();
+
+            for (unsigned int i = 0; i < height_; ++i)
+            {
+               std::memcpy(row(i),file.row(i),row_increment_);
+            }
+
+            return;
+         }
+      }
+
       std::ifstream stream(file_name_.c_str(),std::ios::binary);
 
       if (!stream)
@@ -1398,6 +2893,14 @@ private:
          return;
       }
 
+      if (!mapped_bitmap::valid_size(bih.width,bih.height))
+      {
+         stream.close();
+         std::cerr << "bitmap_image::load_bitmap() ERROR: bitmap_image - Invalid size " << bih.width << "x" << bih.height << "." << std::endl;
+
+         return;
+      }
+
       height_ = bih.height;
       width_  = bih.width;
 
@@ -1417,18 +2920,93 @@ private:
       }
    }
 
-   inline void reverse_channels()
+   // the header and the rows, bottom row first, each followed by its padding, gathered
+   // straight from data_ into writev calls of up to 1024 pieces
+   bool write_rows(const std::string& file_name)
    {
-      if (3 != bytes_per_pixel_)
-         return;
+#ifdef BITMAP_IMAGE_MMAP
+      if ((0 == width_) || (0 == height_))
+         return false;
 
-      for (unsigned char* itr = data_; itr < (data_ + length_); itr += bytes_per_pixel_)
+      const int file = ::open(file_name.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+
+      if (file < 0)
+         return false;
+
+      unsigned char header[mapped_bitmap::header_size];
+      static const unsigned char padding_data[4] = {0x0,0x0,0x0,0x0};
+      const unsigned int padding = mapped_bitmap::padded_row_size(width_) - row_increment_;
+
+      mapped_bitmap::write_header(header,width_,height_);
+
+      std::vector<iovec> pieces;
+      pieces.reserve(1 + height_ * (padding ? 2 : 1));
+
+      iovec piece;
+      piece.iov_base = header;
+      piece.iov_len  = sizeof(header);
+      pieces.push_back(piece);
+
+      for (unsigned int i = 0; i < height_; ++i)
       {
-         unsigned char tmp = *(itr + 0);
+         piece.iov_base = row(height_ - i - 1);
+         piece.iov_len  = row_increment_;
+         pieces.push_back(piece);
+
+         if (padding)
+         {
+            piece.iov_base = const_cast<unsigned char*>(padding_data);
+            piece.iov_len  = padding;
+            pieces.push_back(piece);
+         }
+      }
+
+      iovec* next = &pieces[0];
+      std::size_t left = pieces.size();
+
+      while (left > 0)
+      {
+         const ssize_t written = ::writev(file,next,static_cast<int>(std::min<std::size_t>(left,1024)));
+
+         if (written <= 0)
+         {
+            if ((written < 0) && (EINTR == errno))
+               continue;
+
+            ::close(file);
+            return false;
+         }
+
+         // a short write stops inside a piece, the rest of it goes next
+         std::size_t done = static_cast<std::size_t>(written);
 
-         *(itr + 0) = *(itr + 2);
-         *(itr + 2) = tmp;
+         while ((left > 0) && (done >= next->iov_len))
+         {
+            done -= next->iov_len;
+            ++next;
+            --left;
+         }
+
+         if (left > 0)
+         {
+            next->iov_base = static_cast<char*>(next->iov_base) + done;
+            next->iov_len -= done;
+         }
       }
+
+      return 0 == ::close(file);
+#else
+      (void)file_name;
+      return false;
+#endif
+   }
+
+   inline void reverse_channels()
+   {
+      if (3 != bytes_per_pixel_)
+         return;
+
+      pixel_kernels().swap_outer(data_,data_,pixel_count());
    }
 
    template<typename T>
@@ -1566,7 +3144,7 @@ inline void subsample(const unsigned int& width,
    {
       for (unsigned int i = 0; i < horizontal_upper; ++i, ++s_itr)
       {
-         (*s_itr) += (*(itr1++));
+         (*s_itr)  = (*(itr1++));
          (*s_itr) += (*(itr1++));
          (*s_itr) /= 2.0;
       }
@@ -1611,6 +3189,405 @@ inline void upsample(const unsigned int& width,
    }
 }
 
+/*
+   Image pyramid of float samples with any number of interleaved channels.
+   Level 0 is the source and every further level halves the width and the
+   height of the one before, rounded up the way subsample() rounds, down to
+   1x1 or to the number of levels asked for. All the levels are stored one
+   after the other in a single allocation.
+
+   box_filter      - the 2x2 average of subsample(): the odd last column or
+                     row averages 2 samples and the odd corner is copied, in
+                     floats so that nothing is truncated between levels
+   gaussian_filter - the 5-tap binomial filter [1 4 6 4 1]/16 across and
+                     down with the edges clamped, then every second sample
+
+   The box levels are built in one pass over tiles of 64x64 samples: a tile
+   holds all that its own part of the next 6 levels needs, so the threads
+   take tiles from a shared counter and carry each one all the way down
+   while it is still in the cache; the levels past those 6 are built from
+   the last one the same way. A gaussian level reaches 2 samples past the
+   ones it halves, so those are built a level at a time, in bands of rows
+   taken by the threads, each source row filtered across once into a
+   rolling window of 5 rows.
+*/
+class image_pyramid
+{
+public:
+
+   enum filter_type
+   {
+      box_filter      = 0,
+      gaussian_filter = 1
+   };
+
+   image_pyramid()
+   : channels_(0)
+   {}
+
+   // levels = 0 goes down to 1x1, threads = 0 uses every hardware thread
+   inline void build(const float* source,
+                     const unsigned int width, const unsigned int height, const unsigned int channels,
+                     const filter_type filter = box_filter,
+                     const unsigned int levels = 0,
+                     const unsigned int threads = 0)
+   {
+      create(width,height,channels,levels);
+
+      if (0 == data_.size())
+         return;
+
+      std::copy(source,source + level_size(0),level(0));
+
+      build_levels(filter,threads);
+   }
+
+   // 8-bit samples, kept as 0 to 255
+   inline void build(const unsigned char* source,
+                     const unsigned int width, const unsigned int height, const unsigned int channels,
+                     const filter_type filter = box_filter,
+                     const unsigned int levels = 0,
+                     const unsigned int threads = 0)
+   {
+      create(width,height,channels,levels);
+
+      if (0 == data_.size())
+         return;
+
+      pixel_kernels().to_float(source,level(0),level_size(0),1.0f);
+
+      build_levels(filter,threads);
+   }
+
+   inline void build(const bitmap_image& image,
+                     const filter_type filter = box_filter,
+                     const unsigned int levels = 0,
+                     const unsigned int threads = 0)
+   {
+      build(image.row(0),image.width(),image.height(),image.bytes_per_pixel(),filter,levels,threads);
+   }
+
+   inline unsigned int levels() const
+   {
+      return static_cast<unsigned int>(width_.size());
+   }
+
+   inline unsigned int width(const unsigned int level) const
+   {
+      return width_[level];
+   }
+
+   inline unsigned int height(const unsigned int level) const
+   {
+      return height_[level];
+   }
+
+   inline unsigned int channels() const
+   {
+      return channels_;
+   }
+
+   // samples in one level, and in all of them
+   inline std::size_t level_size(const unsigned int level) const
+   {
+      return static_cast<std::size_t>(width_[level]) * height_[level] * channels_;
+   }
+
+   inline std::size_t size() const
+   {
+      return data_.size();
+   }
+
+   inline const float* level(const unsigned int level) const
+   {
+      return &data_[offset_[level]];
+   }
+
+   inline float* level(const unsigned int level)
+   {
+      return &data_[offset_[level]];
+   }
+
+   // a level of 3 channels as 8-bit pixels, clamped and truncated as subsample() truncates
+   inline void export_level(const unsigned int level, bitmap_image& image) const
+   {
+      if ((level >= levels()) || (3 != channels_))
+         return;
+
+      image.setwidth_height(width_[level],height_[level]);
+
+      pixel_kernels().from_float(this->level(level),image.row(0),level_size(level),1.0f,clamp_bytes);
+   }
+
+   // of one level against the same level of a pyramid of the same size, 1000000 if they are equal
+   inline double psnr(const image_pyramid& pyramid, const unsigned int level, const double peak = 255.0) const
+   {
+      if (
+           (level >= levels())                       ||
+           (level >= pyramid.levels())               ||
+           (pyramid.width_ [level] != width_ [level]) ||
+           (pyramid.height_[level] != height_[level]) ||
+           (pyramid.channels_      != channels_    )
+         )
+      {
+         return 0.0;
+      }
+
+      const float* itr1 = this->level(level);
+      const float* itr2 = pyramid.level(level);
+      const std::size_t count = level_size(level);
+
+      double mse = 0.0;
+
+      for (std::size_t i = 0; i < count; ++i)
+      {
+         double v = static_cast<double>(itr1[i]) - static_cast<double>(itr2[i]);
+
+         mse += v * v;
+      }
+
+      if (mse <= 0.0000001)
+      {
+         return 1000000.0;
+      }
+      else
+      {
+         mse /= static_cast<double>(count);
+         return 20.0 * std::log10(peak / std::sqrt(mse));
+      }
+   }
+
+private:
+
+   enum { tile_levels = 6, tile_size = 1 << tile_levels, band_rows = 16 };
+
+   inline void create(const unsigned int width, const unsigned int height, const unsigned int channels, const unsigned int levels)
+   {
+      width_ .clear();
+      height_.clear();
+      offset_.clear();
+      channels_ = channels;
+
+      std::size_t total = 0;
+
+      if ((0 != width) && (0 != height) && (0 != channels))
+      {
+         unsigned int w = width;
+         unsigned int h = height;
+
+         for ( ; ; )
+         {
+            width_ .push_back(w);
+            height_.push_back(h);
+            offset_.push_back(total);
+
+            total += static_cast<std::size_t>(w) * h * channels;
+
+            if (((1 == w) && (1 == h)) || ((0 != levels) && (width_.size() == levels)))
+               break;
+
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+         }
+      }
+
+      data_.resize(total);
+   }
+
+   // runs task(0) to task(count - 1) on up to threads threads, this one included
+   template <typename Task>
+   static inline void parallel_for(const std::size_t count, const unsigned int threads, const Task& task)
+   {
+      std::atomic<std::size_t> next(0);
+
+      const auto worker = [&]()
+                          {
+                             for (std::size_t i = next++; i < count; i = next++)
+                             {
+                                task(i);
+                             }
+                          };
+
+      std::vector<std::thread> team;
+
+      for (std::size_t t = 1; t < std::min<std::size_t>(threads,count); ++t)
+      {
+         team.push_back(std::thread(worker));
+      }
+
+      worker();
+
+      for (std::size_t t = 0; t < team.size(); ++t)
+      {
+         team[t].join();
+      }
+   }
+
+   inline void build_levels(const filter_type filter, unsigned int threads)
+   {
+      if (0 == threads)
+         threads = std::max(1u,std::thread::hardware_concurrency());
+
+      if (box_filter == filter)
+      {
+         for (unsigned int s = 0; s + 1 < levels(); s += tile_levels)
+         {
+            const unsigned int last     = std::min<unsigned int>(s + tile_levels,levels() - 1);
+            const unsigned int columns  = (width_ [s] + tile_size - 1) / tile_size;
+            const unsigned int rows     = (height_[s] + tile_size - 1) / tile_size;
+
+            parallel_for(static_cast<std::size_t>(columns) * rows,threads,
+                         [&](const std::size_t tile)
+                         {
+                            box_tile(s,last,static_cast<unsigned int>(tile % columns),static_cast<unsigned int>(tile / columns));
+                         });
+         }
+      }
+      else
+      {
+         for (unsigned int l = 1; l < levels(); ++l)
+         {
+            const unsigned int bands = (height_[l] + band_rows - 1) / band_rows;
+
+            parallel_for(bands,threads,
+                         [&](const std::size_t band)
+                         {
+                            gaussian_band(l,static_cast<unsigned int>(band));
+                         });
+         }
+      }
+   }
+
+   // the part of levels first + 1 to last under one tile of level first
+   inline void box_tile(const unsigned int first, const unsigned int last, const unsigned int tx, const unsigned int ty)
+   {
+      const unsigned int x0 = tx * tile_size;
+      const unsigned int y0 = ty * tile_size;
+      const unsigned int x1 = std::min<unsigned int>(x0 + tile_size,width_ [first]);
+      const unsigned int y1 = std::min<unsigned int>(y0 + tile_size,height_[first]);
+      const unsigned int c  = channels_;
+
+      for (unsigned int l = first + 1; l <= last; ++l)
+      {
+         const unsigned int d  = l - first;
+         const unsigned int pw = width_ [l - 1];
+         const unsigned int ph = height_[l - 1];
+         const float* source   = level(l - 1);
+               float* dest     = level(l);
+
+         const unsigned int xa = x0 >> d;
+         const unsigned int ya = y0 >> d;
+         const unsigned int xb = (x1 + (1u << d) - 1) >> d;
+         const unsigned int yb = (y1 + (1u << d) - 1) >> d;
+
+         for (unsigned int y = ya; y < yb; ++y)
+         {
+            const float* itr1 = source + static_cast<std::size_t>(2 * y) * pw * c;
+            const float* itr2 = (2 * y + 1 < ph) ? itr1 + static_cast<std::size_t>(pw) * c : 0;
+                  float* s_itr = dest + (static_cast<std::size_t>(y) * width_[l] + xa) * c;
+
+            // the pairs of columns, then the odd last column
+            const unsigned int pairs = std::min(xb,pw / 2);
+            const std::size_t  begin = static_cast<std::size_t>(2 * xa) * c;
+            const std::size_t  end   = static_cast<std::size_t>(2 * pairs) * c;
+
+            for (std::size_t i = begin; i < end; i += c)
+            {
+               for (unsigned int k = 0; k < c; ++k, ++i, ++s_itr)
+               {
+                  if (itr2)
+                     (*s_itr) = (((itr1[i] + itr1[i + c]) + itr2[i]) + itr2[i + c]) / 4.0f;
+                  else
+                     (*s_itr) = (itr1[i] + itr1[i + c]) / 2.0f;
+               }
+            }
+
+            if (pairs < xb)
+            {
+               const std::size_t i = static_cast<std::size_t>(2 * pairs) * c;
+
+               for (unsigned int k = 0; k < c; ++k, ++s_itr)
+               {
+                  (*s_itr) = itr2 ? (itr1[i + k] + itr2[i + k]) / 2.0f : itr1[i + k];
+               }
+            }
+         }
+      }
+   }
+
+   // one band of rows of a gaussian level, from the level above it
+   inline void gaussian_band(const unsigned int l, const unsigned int band)
+   {
+      const unsigned int pw = width_ [l - 1];
+      const unsigned int ph = height_[l - 1];
+      const unsigned int w  = width_ [l];
+      const unsigned int c  = channels_;
+      const float* source   = level(l - 1);
+            float* dest     = level(l);
+
+      const unsigned int ya = band * band_rows;
+      const unsigned int yb = std::min<unsigned int>(ya + band_rows,height_[l]);
+
+      // source rows filtered across, in the slot of their row number modulo 5
+      std::vector<float> window(5 * static_cast<std::size_t>(w) * c);
+      int filtered[5] = { -1, -1, -1, -1, -1 };
+
+      for (unsigned int y = ya; y < yb; ++y)
+      {
+         const float* rows[5];
+
+         for (int t = 0; t < 5; ++t)
+         {
+            const int r    = std::max(0,std::min(static_cast<int>(2 * y) + t - 2,static_cast<int>(ph) - 1));
+            const int slot = r % 5;
+            float*    row  = &window[static_cast<std::size_t>(slot) * w * c];
+
+            if (filtered[slot] != r)
+            {
+               filter_across(source + static_cast<std::size_t>(r) * pw * c,pw,w,row);
+               filtered[slot] = r;
+            }
+
+            rows[t] = row;
+         }
+
+         float* s_itr = dest + static_cast<std::size_t>(y) * w * c;
+
+         for (std::size_t i = 0; i < static_cast<std::size_t>(w) * c; ++i)
+         {
+            s_itr[i] = ((rows[0][i] + rows[4][i]) + 4.0f * (rows[1][i] + rows[3][i]) + 6.0f * rows[2][i]) / 256.0f;
+         }
+      }
+   }
+
+   // [1 4 6 4 1] across a row of pw samples, every second one, unscaled
+   inline void filter_across(const float* source, const unsigned int pw, const unsigned int w, float* dest) const
+   {
+      const unsigned int c = channels_;
+
+      for (unsigned int x = 0; x < w; ++x)
+      {
+         std::size_t i[5];
+
+         for (int t = 0; t < 5; ++t)
+         {
+            i[t] = static_cast<std::size_t>(std::max(0,std::min(static_cast<int>(2 * x) + t - 2,static_cast<int>(pw) - 1))) * c;
+         }
+
+         for (unsigned int k = 0; k < c; ++k, ++dest)
+         {
+            (*dest) = (source[i[0] + k] + source[i[4] + k]) + 4.0f * (source[i[1] + k] + source[i[3] + k]) + 6.0f * source[i[2] + k];
+         }
+      }
+   }
+
+   unsigned int              channels_;
+   std::vector<unsigned int> width_;
+   std::vector<unsigned int> height_;
+   std::vector<std::size_t>  offset_;
+   std::vector<float>        data_;
+};
+
 inline void checkered_pattern(const unsigned int x_width,
                               const unsigned int y_width,
                               const unsigned char value,
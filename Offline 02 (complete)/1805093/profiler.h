@@ -0,0 +1,106 @@
+// scoped timers for chrome://tracing (or ui.perfetto.dev), compiled in only with -DPROFILE
+// every thread writes its events into its own ring buffer without locking,
+// writeTrace() dumps all buffers in the Chrome trace_event JSON format
+// without PROFILE, PROFILE_SCOPE expands to nothing
+
+#ifdef PROFILE
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class TraceEvent {
+public:
+  const char* name;
+  long long start;    // microseconds since the program started
+  long long duration; // microseconds
+};
+
+class TraceBuffer {
+public:
+  static const int CAPACITY = 1 << 16; // the oldest events are overwritten
+
+  int threadId;
+  std::atomic<unsigned long long> head; // only the owning thread moves it
+  TraceEvent events[CAPACITY];
+
+  TraceBuffer(int threadId) : threadId(threadId), head(0) {}
+
+  void push(const char* name, long long start, long long duration) {
+    unsigned long long index = head.load(std::memory_order_relaxed);
+    TraceEvent& event = events[index % CAPACITY];
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    head.store(index + 1, std::memory_order_release);
+  }
+};
+
+std::mutex traceBuffersLock;
+std::vector<TraceBuffer*> traceBuffers;
+
+long long profilerNow() {
+  static std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+TraceBuffer& threadTraceBuffer() {
+  thread_local TraceBuffer* buffer = NULL;
+  if (buffer == NULL) {
+    // registered once per thread and never freed, so it can be dumped after the thread ends
+    std::lock_guard<std::mutex> guard(traceBuffersLock);
+    buffer = new TraceBuffer(traceBuffers.size());
+    traceBuffers.push_back(buffer);
+  }
+  return *buffer;
+}
+
+class ScopedTimer {
+  const char* name;
+  long long start;
+
+public:
+  ScopedTimer(const char* name) : name(name), start(profilerNow()) {}
+  ~ScopedTimer() { threadTraceBuffer().push(name, start, profilerNow() - start); }
+};
+
+// events still being written by a running thread may be torn, so dump while the workers are idle
+void writeTrace(std::string fileName) {
+  std::ofstream output(fileName);
+  output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+
+  std::lock_guard<std::mutex> guard(traceBuffersLock);
+  bool first = true;
+  for (TraceBuffer* buffer : traceBuffers) {
+    unsigned long long head = buffer->head.load(std::memory_order_acquire);
+    unsigned long long begin = head > TraceBuffer::CAPACITY ? head - TraceBuffer::CAPACITY : 0;
+
+    output << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+           << ",\"args\":{\"name\":\"" << (buffer->threadId == 0 ? "main" : "worker " + std::to_string(buffer->threadId)) << "\"}}";
+    first = false;
+
+    for (unsigned long long i = begin; i < head; i++) {
+      TraceEvent& event = buffer->events[i % TraceBuffer::CAPACITY];
+      output << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"raster\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+             << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+    }
+  }
+
+  output << "\n]}" << std::endl;
+  output.close();
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ScopedTimer PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+inline void writeTrace(std::string fileName) {}
+
+#endif
@@ -10,10 +10,12 @@
 #include "color.h"
 #include "triangle.h"
 #include "bitmap_image.hpp"
+#include "profiler.h"
 
 using namespace std;
 
 void stage1() {
+  PROFILE_SCOPE("stage1");
   ifstream input("scene.txt");
   ofstream output("stage1.txt");
 
@@ -117,6 +119,7 @@ void stage1() {
 }
 
 void stage2() {
+  PROFILE_SCOPE("stage2");
   ifstream input("scene.txt");
 
   Point* eye = new Point();
@@ -182,6 +185,7 @@ void stage2() {
 }
 
 void stage3() {
+  PROFILE_SCOPE("stage3");
   ifstream input("scene.txt");
   string _;
   for (int i = 0; i < 3; i++) {
@@ -233,6 +237,7 @@ void stage3() {
 }
 
 void stage4() {
+  PROFILE_SCOPE("stage4");
   ifstream input("config.txt");
   double screenWidth, screenHeight;
   input >> screenWidth >> screenHeight;
@@ -365,6 +370,7 @@ void stage4() {
   }
 
   // write to file
+  PROFILE_SCOPE("write output");
   ofstream output("z-buffer.txt");
   bitmap_image image(screenWidth, screenHeight);
 
@@ -387,5 +393,6 @@ int main(int argc, char** argv) {
   stage3();
   stage4();
 
+  writeTrace("trace.json");
   return 0;
 }
\ No newline at end of file